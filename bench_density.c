@@ -0,0 +1,408 @@
+/*
+ * Benchmark of the analysis kernels of g_mydensity on synthetic systems.
+ *
+ * A system of uniformly distributed atoms is generated in memory, with a
+ * compact reference group at the center of the box and analysed groups of
+ * consecutive atoms. Each frame moves every atom by a small random step.
+ * The frames are analysed with each density mode in turn and the
+ * throughput is reported; with -sweep, the number of atoms is doubled
+ * between repetitions. No topology or trajectory is needed; with -o, the
+ * frames are also written as XTC and read back, timing the decoding.
+ */
+#include <math.h>
+#include <string.h>
+
+#include <gromacs/typedefs.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/macros.h>
+#include <gromacs/vec.h>
+#include <gromacs/pbc.h>
+#include <gromacs/copyrite.h>
+#include <gromacs/statutil.h>
+#include <gromacs/xtcio.h>
+
+#include "density.h"
+#include "timing.h"
+
+/* Names, masses and electron counts of the atoms of the synthetic system */
+static char *bench_names[] = { "OW", "HW1", "HW2", "C", "N" };
+static const real bench_masses[] = { 15.9994, 1.008, 1.008, 12.011, 14.007 };
+static const real bench_electrons[] = { 8, 1, 1, 6, 7 };
+static const real bench_charges[] = { -0.834, 0.417, 0.417, 0.1, -0.1 };
+#define BENCH_NTYPES asize(bench_masses)
+/* Atoms per molecule */
+#define BENCH_MOLSIZE (3)
+
+/* Density modes benchmarked */
+enum {
+    ebSLAB, ebXYZ, ebGRID, ebSPARSE, ebVOXEL, ebDIST2D, ebDIST3D, ebCOM,
+    ebVERLET, ebEDT, ebELECTRON, ebTYPES, ebNR
+};
+static const char *bench_modes[ebNR] = {
+    "slab", "xyz", "grid", "sparse", "voxel", "dist2d", "dist3d", "com",
+    "verlet", "edt", "electron", "types"
+};
+
+/* Small deterministic generator, so runs are reproducible */
+static real bench_random(unsigned int *state) {
+    *state = *state * 1103515245u + 12345u;
+    return (real)((*state >> 8) & 0xffffff) / (real)0x1000000;
+}
+
+/** Build a topology of "natoms" atoms, in molecules of BENCH_MOLSIZE atoms
+ */
+static t_topology *bench_topology(int natoms) {
+    t_topology *top;
+    int i, type;
+
+    snew(top, 1);
+    top->atoms.nr = natoms;
+    snew(top->atoms.atom, natoms);
+    snew(top->atoms.atomname, natoms);
+    for (i=0; i<natoms; ++i) {
+        type = i % BENCH_NTYPES;
+        top->atoms.atom[i].m = bench_masses[type];
+        top->atoms.atom[i].q = bench_charges[type];
+        top->atoms.atomname[i] = &bench_names[type];
+    }
+    top->mols.nr = (natoms + BENCH_MOLSIZE - 1) / BENCH_MOLSIZE;
+    snew(top->mols.index, top->mols.nr + 1);
+    for (i=0; i<top->mols.nr; ++i) {
+        top->mols.index[i] = i * BENCH_MOLSIZE;
+    }
+    top->mols.index[top->mols.nr] = natoms;
+    return top;
+}
+
+static void bench_clean_topology(t_topology *top) {
+    sfree(top->atoms.atom);
+    sfree(top->atoms.atomname);
+    sfree(top->mols.index);
+    sfree(top);
+}
+
+/** Generate the frames
+ *
+ * The first "refsize" atoms are in a sphere at the center of the box, the
+ * others are uniformly distributed. All the atoms move by up to "step" nm
+ * per frame and are put back in the box.
+ */
+static rvec **bench_frames(int natoms, int nframes, int refsize, matrix box,
+        real step, unsigned int seed) {
+    rvec **frames;
+    rvec center, dx;
+    real radius;
+    int f, i, d;
+
+    calc_box_center(ecenterDEF, box, center);
+    radius = pow(refsize * 0.03, 1.0/3.0);
+    snew(frames, nframes);
+    for (f=0; f<nframes; ++f) {
+        snew(frames[f], natoms);
+    }
+    for (i=0; i<natoms; ++i) {
+        if (i < refsize) {
+            do {
+                for (d=0; d<DIM; ++d) {
+                    dx[d] = radius * (2 * bench_random(&seed) - 1);
+                }
+            } while (norm2(dx) > radius * radius);
+            rvec_add(center, dx, frames[0][i]);
+        }
+        else {
+            for (d=0; d<DIM; ++d) {
+                frames[0][i][d] = bench_random(&seed);
+            }
+            /* Fractional to cartesian coordinates, triclinic safe */
+            for (d=0; d<DIM; ++d) {
+                dx[d] = frames[0][i][XX] * box[XX][d]
+                    + frames[0][i][YY] * box[YY][d]
+                    + frames[0][i][ZZ] * box[ZZ][d];
+            }
+            copy_rvec(dx, frames[0][i]);
+        }
+    }
+    for (f=1; f<nframes; ++f) {
+        for (i=0; i<natoms; ++i) {
+            for (d=0; d<DIM; ++d) {
+                frames[f][i][d] = frames[f-1][i][d]
+                    + step * (2 * bench_random(&seed) - 1);
+            }
+            put_atom_in_box(box, frames[f][i]);
+        }
+    }
+    return frames;
+}
+
+/** Analyse all the frames with one mode and report the throughput
+ */
+static void bench_mode(int mode, t_topology *top, rvec **frames, int nframes,
+        matrix box, int ngroups, int gsize, int refsize, int nslices,
+        gmx_bool bSelPBC, real skin, real edt_spacing, FILE *fp) {
+    DensityJob job;
+    DensityAccum *accum;
+    GridHeight *grid = NULL;
+    VoxelGrid *voxel = NULL;
+    DistMode *dist = NULL;
+    Timing *timing;
+    atom_id **index, *ref_index;
+    int *gnx;
+    real **weights;
+    rvec *x;
+    const char **names;
+    /* The types mode computes the mass, number and charge densities at
+     * once */
+    const char *dens = (mode == ebELECTRON) ? "e"
+        : (mode == ebTYPES) ? "mnc" : "m";
+    int nchannels = strlen(dens);
+    int natoms = top->atoms.nr;
+    int n, i, f, c;
+
+    snew(index, ngroups);
+    snew(gnx, ngroups);
+    snew(names, ngroups);
+    for (n=0; n<ngroups; ++n) {
+        gnx[n] = gsize;
+        snew(index[n], gsize);
+        for (i=0; i<gsize; ++i) {
+            index[n][i] = (refsize + n * gsize + i) % natoms;
+        }
+        names[n] = bench_names[n % BENCH_NTYPES];
+    }
+    snew(weights, nchannels);
+    for (c=0; c<nchannels; ++c) {
+        snew(weights[c], natoms);
+        for (i=0; i<natoms; ++i) {
+            switch (dens[c]) {
+                case 'e':
+                    weights[c][i] = bench_electrons[i % BENCH_NTYPES]
+                        - top->atoms.atom[i].q;
+                    break;
+                case 'n':
+                    weights[c][i] = 1;
+                    break;
+                case 'c':
+                    weights[c][i] = top->atoms.atom[i].q;
+                    break;
+                default:
+                    weights[c][i] = top->atoms.atom[i].m;
+            }
+        }
+    }
+
+    if (mode == ebGRID || mode == ebSPARSE) {
+        /* The npz format opens no file before grid_end, which is not
+         * called; the sparse mode forces the tiled grids */
+        grid = build_grids((int[2]){nslices, nslices}, ZZ, ngroups, "",
+                dens, 'n', names, mode == ebSPARSE ? 1 : 0);
+    }
+    if (mode == ebVOXEL) {
+        /* No output is written, voxel_end is not called */
+        voxel = build_voxels((int[3]){nslices, nslices, nslices}, ngroups,
+                NULL, dens, 'n', names);
+    }
+    if (mode == ebDIST2D || mode == ebDIST3D || mode == ebCOM
+            || mode == ebVERLET || mode == ebEDT) {
+        snew(ref_index, refsize);
+        for (i=0; i<refsize; ++i) {
+            ref_index[i] = i;
+        }
+        dist = build_dist_ref(nslices, ZZ, ngroups, dens, ref_index, refsize,
+                top, mode != ebDIST2D, mode == ebCOM,
+                mode == ebVERLET ? skin : 0,
+                mode == ebEDT ? edt_spacing : 0, TRUE, 0);
+    }
+
+    /* Slab profiles along the three axes for ebXYZ, the normal first */
+    set_job(&job, index, gnx, ngroups, nslices, (int[DIM]){ZZ, XX, YY},
+            mode == ebXYZ ? DIM : 1, top, epbcXYZ, FALSE, dens, weights);
+    build_job_atoms(&job, dist, bSelPBC, NULL, 0);
+
+    timing = build_timing();
+    accum = build_accum(&job, grid, voxel, dist, box);
+    accum->timing = timing;
+    snew(x, natoms);
+    for (f=0; f<nframes; ++f) {
+        /* The analysis modifies the coordinates */
+        memcpy(x, frames[f], natoms * sizeof(rvec));
+        analyse_frame(&job, accum, x, box);
+    }
+    timing_end(timing);
+    fprintf(fp, "%-10s %10d %10d %6d %10.3f %12.1f %12.3g\n",
+            bench_modes[mode], natoms, ngroups * gsize, nframes,
+            timing->run_wall, nframes / timing->run_wall,
+            timing->natoms / timing->run_wall);
+    dist_report(dist, stderr);
+
+    clean_accum(&job, accum);
+    clean_timing(timing);
+    clean_job_atoms(&job);
+    clean_grids(grid);
+    clean_voxels(voxel);
+    clean_dist(dist);
+    sfree(x);
+    for (c=0; c<nchannels; ++c) {
+        sfree(weights[c]);
+    }
+    sfree(weights);
+    for (n=0; n<ngroups; ++n) {
+        sfree(index[n]);
+    }
+    sfree(index);
+    sfree(gnx);
+    sfree(names);
+}
+
+/** Write the frames as an XTC trajectory
+ */
+static void bench_write_xtc(const char *fn, rvec **frames, int nframes,
+        int natoms, matrix box) {
+    t_fileio *fio;
+    int f;
+
+    fio = open_xtc(fn, "w");
+    for (f=0; f<nframes; ++f) {
+        write_xtc(fio, natoms, f, (real)f, box, frames[f], 1000);
+    }
+    close_xtc(fio);
+}
+
+/** Time a pass of the trajectory reader over a file
+ *
+ * It is the decoding g_mydensity does before the analysis of each frame.
+ */
+static void bench_decode(const char *fn, const output_env_t oenv, FILE *fp) {
+    t_trxstatus *status;
+    rvec *x;
+    matrix box;
+    real t;
+    int natoms, nframes = 0;
+    Timing *timing;
+
+    timing = build_timing();
+    natoms = read_first_x(oenv, &status, fn, &t, &x, box);
+    if (natoms == 0) {
+        gmx_fatal(FARGS, "Could not read %s\n", fn);
+    }
+    do {
+        nframes++;
+    } while (read_next_x(oenv, status, &t, natoms, x, box));
+    close_trj(status);
+    timing_end(timing);
+    fprintf(fp, "%-10s %10d %10d %6d %10.3f %12.1f %12.3g\n", "decode",
+            natoms, natoms, nframes, timing->run_wall,
+            nframes / timing->run_wall,
+            (double)natoms * nframes / timing->run_wall);
+    clean_timing(timing);
+    sfree(x);
+}
+
+int main(int argc, char *argv[]) {
+    const char *desc[] = {
+        "Benchmark the analysis kernels of g_mydensity on a synthetic",
+        "system. The atoms are uniformly distributed in the box, except a",
+        "reference group packed in a sphere at its center. Each mode is",
+        "timed over all the frames, in memory; with [TT]-sweep[tt] the",
+        "number of atoms is doubled between repetitions. [TT]-o[tt] writes",
+        "the frames of the first system as an XTC trajectory and times",
+        "reading it back, in the decode mode."
+    };
+    static const char *mode_opt[] =
+        { NULL, "all", "slab", "xyz", "grid", "sparse", "voxel", "dist2d",
+          "dist3d", "com", "verlet", "edt", "electron", "types", NULL };
+    static int natoms = 100000;
+    static int ngroups = 2;
+    static int gsize = 0;
+    static int refsize = 1000;
+    static int nframes = 20;
+    static int nslices = 50;
+    static int nsweep = 0;
+    static int seed = 1993;
+    static real step = 0.05;
+    static real skin = 0.2;
+    static real edt_spacing = 0.1;
+    static rvec box_size = {10, 10, 10};
+    static gmx_bool bTric = FALSE;
+    static gmx_bool bSelPBC = FALSE;
+    t_pargs pa[] = {
+        { "-natoms", FALSE, etINT, {&natoms}, "Number of atoms" },
+        { "-ng", FALSE, etINT, {&ngroups}, "Number of analysed groups" },
+        { "-gsize", FALSE, etINT, {&gsize},
+            "Number of atoms per group, 0 for a tenth of the atoms" },
+        { "-refsize", FALSE, etINT, {&refsize},
+            "Number of atoms of the reference group" },
+        { "-frames", FALSE, etINT, {&nframes}, "Number of frames" },
+        { "-sl", FALSE, etINT, {&nslices},
+            "Number of slices of the profiles and grids" },
+        { "-box", FALSE, etRVEC, {box_size}, "Box size (nm)" },
+        { "-tric", FALSE, etBOOL, {&bTric},
+            "Use a triclinic box, tilted along Z" },
+        { "-pbcsel", FALSE, etBOOL, {&bSelPBC},
+            "Only make whole the molecules of the analysed atoms" },
+        { "-mode", FALSE, etENUM, {mode_opt}, "Mode to benchmark" },
+        { "-sweep", FALSE, etINT, {&nsweep},
+            "Number of times the number of atoms is doubled" },
+        { "-seed", FALSE, etINT, {&seed}, "Seed of the generator" },
+        { "-step", FALSE, etREAL, {&step},
+            "Largest move of an atom along each axis between frames (nm)" },
+        { "-skin", FALSE, etREAL, {&skin},
+            "Verlet skin of the verlet mode, a 3D distance mode (nm)" },
+        { "-edt", FALSE, etREAL, {&edt_spacing},
+            "Grid spacing of the edt mode, a 3D distance mode (nm)" },
+    };
+    t_filenm fnm[] = {
+        { efXTC, "-o", "bench", ffOPTWR },
+    };
+#define NFILE asize(fnm)
+    output_env_t oenv;
+    t_topology *top;
+    rvec **frames;
+    matrix box;
+    int sweep, mode, f, n, size;
+
+    CopyRight(stderr, argv[0]);
+    parse_common_args(&argc, argv, 0, NFILE, fnm, asize(pa), pa,
+            asize(desc), desc, 0, NULL, &oenv);
+
+    clear_mat(box);
+    for (n=0; n<DIM; ++n) {
+        box[n][n] = box_size[n];
+    }
+    if (bTric) {
+        box[ZZ][XX] = box[XX][XX] / 4;
+        box[ZZ][YY] = box[YY][YY] / 4;
+    }
+
+    fprintf(stdout, "%-10s %10s %10s %6s %10s %12s %12s\n", "mode", "atoms",
+            "binned", "frames", "wall (s)", "frames/s", "atoms/s");
+    for (sweep=0; sweep<=nsweep; ++sweep) {
+        top = bench_topology(natoms);
+        size = gsize > 0 ? gsize : natoms / 10;
+        if (refsize + ngroups * size > natoms) {
+            gmx_fatal(FARGS, "%d atoms can not hold %d groups of %d atoms "
+                    "and a reference of %d atoms\n", natoms, ngroups, size,
+                    refsize);
+        }
+        frames = bench_frames(natoms, nframes, refsize, box, step, seed);
+        if (sweep == 0 && opt2bSet("-o", NFILE, fnm)) {
+            bench_write_xtc(opt2fn("-o", NFILE, fnm), frames, nframes,
+                    natoms, box);
+            bench_decode(opt2fn("-o", NFILE, fnm), oenv, stdout);
+        }
+        for (mode=0; mode<ebNR; ++mode) {
+            if (strcmp(mode_opt[0], "all") == 0 ||
+                    strcmp(mode_opt[0], bench_modes[mode]) == 0) {
+                bench_mode(mode, top, frames, nframes, box, ngroups, size,
+                        refsize, nslices, bSelPBC, skin, edt_spacing,
+                        stdout);
+            }
+        }
+        for (f=0; f<nframes; ++f) {
+            sfree(frames[f]);
+        }
+        sfree(frames);
+        bench_clean_topology(top);
+        natoms *= 2;
+    }
+    return 0;
+}
@@ -0,0 +1,359 @@
+#include "binning.h"
+
+#include <math.h>
+
+/* The bin computation uses AVX2 or SSE4.1 when the compiler targets them,
+ * and a scalar loop otherwise; the remainder of each batch always goes
+ * through the scalar loop. */
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BIN_AVX2
+#elif defined(__SSE4_1__)
+#include <smmintrin.h>
+#define BIN_SSE4
+#endif
+
+/** Contruct an instance of BinBuffer able to hold "size" atoms, with
+ * "nchannels" weights each, belonging to some of "ngroups" groups
+ */
+BinBuffer *build_bin_buffer(int size, int nchannels, int ngroups) {
+    BinBuffer *buf;
+    int i;
+
+    snew(buf, 1);
+    buf->coord = NULL;
+    buf->weight = NULL;
+    buf->bin = NULL;
+    buf->bin2 = NULL;
+    buf->x = NULL;
+    buf->xbox = NULL;
+    buf->bBox = FALSE;
+    buf->n = 0;
+    buf->mask = NULL;
+    buf->nmask = bin_mask_words(ngroups);
+    buf->ngroups = ngroups;
+    snew(buf->hist, ngroups);
+    buf->ncached = 0;
+    for (i=0; i<BIN_MAX_CACHED; ++i) {
+        buf->cache_bin[i] = NULL;
+    }
+    buf->nalloc = 0;
+    buf->nchannels = nchannels;
+    bin_buffer_reserve(buf, size);
+    return buf;
+}
+
+/** Clean an instance of BinBuffer
+ */
+void clean_bin_buffer(BinBuffer *buf) {
+    int i;
+    if (buf) {
+        sfree_aligned(buf->coord);
+        sfree_aligned(buf->weight);
+        sfree_aligned(buf->bin);
+        sfree_aligned(buf->bin2);
+        sfree(buf->x);
+        sfree(buf->xbox);
+        sfree(buf->hist);
+        for (i=0; i<BIN_MAX_CACHED; ++i) {
+            sfree_aligned(buf->cache_bin[i]);
+        }
+        sfree(buf);
+    }
+}
+
+/** Make sure the buffers can hold "size" atoms
+ */
+void bin_buffer_reserve(BinBuffer *buf, int size) {
+    int i;
+    if (size > buf->nalloc) {
+        sfree_aligned(buf->coord);
+        sfree_aligned(buf->weight);
+        sfree_aligned(buf->bin);
+        sfree_aligned(buf->bin2);
+        sfree(buf->x);
+        sfree(buf->xbox);
+        buf->nalloc = size;
+        snew_aligned(buf->coord, size, 32);
+        snew_aligned(buf->weight, (size_t)size * buf->nchannels, 32);
+        snew_aligned(buf->bin, size, 32);
+        snew_aligned(buf->bin2, size, 32);
+        snew(buf->x, size);
+        snew(buf->xbox, size);
+        /* The arrays of bins are allocated when first used */
+        for (i=0; i<BIN_MAX_CACHED; ++i) {
+            sfree_aligned(buf->cache_bin[i]);
+            buf->cache_bin[i] = NULL;
+        }
+        buf->ncached = 0;
+    }
+}
+
+/** Start the geometry of a frame
+ *
+ * The coordinates of the atoms are gathered once; the bins and the
+ * positions in the box computed for the previous frame are dropped.
+ *
+ * Parameters :
+ *  - buf   : the buffers, able to hold "n" atoms
+ *  - x     : the coordinates of all the atoms
+ *  - index : the atoms to bin, each one once
+ *  - mask  : the groups of each atom, bin_mask_words words per atom
+ *  - n     : the number of atoms to bin
+ *  - box   : the box of the frame
+ */
+void bin_geometry_start(BinBuffer *buf, rvec *x, atom_id *index,
+        const unsigned int *mask, int n, matrix box) {
+    int i;
+    for (i=0; i<n; ++i) {
+        copy_rvec(x[index[i]], buf->x[i]);
+    }
+    copy_mat(box, buf->box);
+    buf->mask = mask;
+    buf->n = n;
+    buf->ncached = 0;
+    buf->bBox = FALSE;
+}
+
+/** Periodic bins of the atoms of the frame along a box dimension
+ *
+ * The bins are computed by periodic_bins with the box length of the frame,
+ * the first time they are asked for with these "dim" and "nbins"; the
+ * following calls for the frame return the same array.
+ */
+const int *bin_geometry_bins(BinBuffer *buf, int dim, int nbins) {
+    int i, k;
+
+    for (k=0; k<buf->ncached; ++k) {
+        if (buf->cache_dim[k] == dim && buf->cache_nbins[k] == nbins) {
+            return buf->cache_bin[k];
+        }
+    }
+    if (k == BIN_MAX_CACHED) {
+        gmx_fatal(FARGS, "Too many different bins for a frame\n");
+    }
+    if (buf->cache_bin[k] == NULL) {
+        snew_aligned(buf->cache_bin[k], buf->nalloc, 32);
+    }
+    for (i=0; i<buf->n; ++i) {
+        buf->coord[i] = buf->x[i][dim];
+    }
+    periodic_bins(buf->coord, buf->n, buf->box[dim][dim], nbins,
+            buf->cache_bin[k]);
+    buf->cache_dim[k] = dim;
+    buf->cache_nbins[k] = nbins;
+    buf->ncached++;
+    return buf->cache_bin[k];
+}
+
+/** Coordinates of the atoms of the frame put in the box
+ *
+ * They are computed once per frame, for the modes that need to wrap the
+ * atoms with the box vectors.
+ */
+rvec *bin_geometry_in_box(BinBuffer *buf) {
+    int i;
+
+    if (!buf->bBox) {
+        for (i=0; i<buf->n; ++i) {
+            copy_rvec(buf->x[i], buf->xbox[i]);
+            put_atom_in_box(buf->box, buf->xbox[i]);
+        }
+        buf->bBox = TRUE;
+    }
+    return buf->xbox;
+}
+
+/** Copy the weights of the atoms of a group in a contiguous array
+ */
+void gather_weights(real *weights, atom_id *index, int n, real *out) {
+    int i;
+    for (i=0; i<n; ++i) {
+        out[i] = weights[index[i]];
+    }
+}
+
+/** Compute the bins of coordinates along a periodic dimension
+ *
+ * The coordinates are put back in [0, length[ before being binned, so atoms
+ * out of the box are counted in their periodic image. The bins are computed
+ * as a fraction of the box length using its precomputed inverse.
+ *
+ * Parameters :
+ *  - coord  : the coordinates
+ *  - n      : the number of coordinates
+ *  - length : the box length along the dimension
+ *  - nbins  : the number of bins the box is divided in
+ *  - bin    : where to write the bins, in [0, nbins[
+ */
+void periodic_bins(const real *coord, int n, real length, int nbins,
+        int *bin) {
+    real invlength = 1/length;
+    real t;
+    int i = 0;
+#if defined(BIN_AVX2) && !defined(GMX_DOUBLE)
+    __m256 vinv = _mm256_set1_ps(invlength);
+    __m256 vn = _mm256_set1_ps((float)nbins);
+    __m256i vmax = _mm256_set1_epi32(nbins - 1);
+    __m256i vzero = _mm256_setzero_si256();
+    __m256 vt;
+    __m256i vb;
+    for (; i + 8 <= n; i += 8) {
+        vt = _mm256_mul_ps(_mm256_loadu_ps(coord + i), vinv);
+        vt = _mm256_sub_ps(vt, _mm256_floor_ps(vt));
+        vb = _mm256_cvttps_epi32(_mm256_mul_ps(vt, vn));
+        vb = _mm256_max_epi32(_mm256_min_epi32(vb, vmax), vzero);
+        _mm256_storeu_si256((__m256i *)(bin + i), vb);
+    }
+#elif defined(BIN_AVX2)
+    __m256d vinv = _mm256_set1_pd(invlength);
+    __m256d vn = _mm256_set1_pd((double)nbins);
+    __m128i vmax = _mm_set1_epi32(nbins - 1);
+    __m128i vzero = _mm_setzero_si128();
+    __m256d vt;
+    __m128i vb;
+    for (; i + 4 <= n; i += 4) {
+        vt = _mm256_mul_pd(_mm256_loadu_pd(coord + i), vinv);
+        vt = _mm256_sub_pd(vt, _mm256_floor_pd(vt));
+        vb = _mm256_cvttpd_epi32(_mm256_mul_pd(vt, vn));
+        vb = _mm_max_epi32(_mm_min_epi32(vb, vmax), vzero);
+        _mm_storeu_si128((__m128i *)(bin + i), vb);
+    }
+#elif defined(BIN_SSE4) && !defined(GMX_DOUBLE)
+    __m128 vinv = _mm_set1_ps(invlength);
+    __m128 vn = _mm_set1_ps((float)nbins);
+    __m128i vmax = _mm_set1_epi32(nbins - 1);
+    __m128i vzero = _mm_setzero_si128();
+    __m128 vt;
+    __m128i vb;
+    for (; i + 4 <= n; i += 4) {
+        vt = _mm_mul_ps(_mm_loadu_ps(coord + i), vinv);
+        vt = _mm_sub_ps(vt, _mm_floor_ps(vt));
+        vb = _mm_cvttps_epi32(_mm_mul_ps(vt, vn));
+        vb = _mm_max_epi32(_mm_min_epi32(vb, vmax), vzero);
+        _mm_storeu_si128((__m128i *)(bin + i), vb);
+    }
+#elif defined(BIN_SSE4)
+    __m128d vinv = _mm_set1_pd(invlength);
+    __m128d vn = _mm_set1_pd((double)nbins);
+    __m128i vmax = _mm_set1_epi32(nbins - 1);
+    __m128i vzero = _mm_setzero_si128();
+    __m128d vt;
+    __m128i vb;
+    for (; i + 2 <= n; i += 2) {
+        vt = _mm_mul_pd(_mm_loadu_pd(coord + i), vinv);
+        vt = _mm_sub_pd(vt, _mm_floor_pd(vt));
+        vb = _mm_cvttpd_epi32(_mm_mul_pd(vt, vn));
+        vb = _mm_max_epi32(_mm_min_epi32(vb, vmax), vzero);
+        _mm_storel_epi64((__m128i *)(bin + i), vb);
+    }
+#endif
+    for (; i < n; ++i) {
+        t = coord[i] * invlength;
+        t -= floor(t);
+        bin[i] = (int)(t * nbins);
+        if (bin[i] >= nbins) {
+            bin[i] = nbins - 1;
+        }
+        else if (bin[i] < 0) {
+            bin[i] = 0;
+        }
+    }
+}
+
+/** Compute the bins of positive values on a non periodic axis
+ *
+ * Parameters :
+ *  - value    : the values to bin, like distances
+ *  - n        : the number of values
+ *  - invwidth : the inverse of the bin width
+ *  - nbins    : the number of bins
+ *  - bin      : where to write the bins; values beyond the last bin get -1
+ */
+void linear_bins(const real *value, int n, real invwidth, int nbins,
+        int *bin) {
+    real t;
+    int i = 0;
+#if defined(BIN_AVX2) && !defined(GMX_DOUBLE)
+    __m256 vinv = _mm256_set1_ps(invwidth);
+    __m256 vn = _mm256_set1_ps((float)nbins);
+    __m256i vni = _mm256_set1_epi32(nbins);
+    __m256i vout = _mm256_set1_epi32(-1);
+    __m256 vt;
+    __m256i vb, vin;
+    for (; i + 8 <= n; i += 8) {
+        vt = _mm256_min_ps(_mm256_mul_ps(_mm256_loadu_ps(value + i), vinv),
+                vn);
+        vb = _mm256_cvttps_epi32(vt);
+        vin = _mm256_cmpgt_epi32(vni, vb);
+        vb = _mm256_or_si256(_mm256_and_si256(vin, vb),
+                _mm256_andnot_si256(vin, vout));
+        _mm256_storeu_si256((__m256i *)(bin + i), vb);
+    }
+#elif defined(BIN_AVX2)
+    __m256d vinv = _mm256_set1_pd(invwidth);
+    __m256d vn = _mm256_set1_pd((double)nbins);
+    __m128i vni = _mm_set1_epi32(nbins);
+    __m128i vout = _mm_set1_epi32(-1);
+    __m256d vt;
+    __m128i vb, vin;
+    for (; i + 4 <= n; i += 4) {
+        vt = _mm256_min_pd(_mm256_mul_pd(_mm256_loadu_pd(value + i), vinv),
+                vn);
+        vb = _mm256_cvttpd_epi32(vt);
+        vin = _mm_cmpgt_epi32(vni, vb);
+        vb = _mm_or_si128(_mm_and_si128(vin, vb), _mm_andnot_si128(vin, vout));
+        _mm_storeu_si128((__m128i *)(bin + i), vb);
+    }
+#elif defined(BIN_SSE4) && !defined(GMX_DOUBLE)
+    __m128 vinv = _mm_set1_ps(invwidth);
+    __m128 vn = _mm_set1_ps((float)nbins);
+    __m128i vni = _mm_set1_epi32(nbins);
+    __m128i vout = _mm_set1_epi32(-1);
+    __m128 vt;
+    __m128i vb, vin;
+    for (; i + 4 <= n; i += 4) {
+        vt = _mm_min_ps(_mm_mul_ps(_mm_loadu_ps(value + i), vinv), vn);
+        vb = _mm_cvttps_epi32(vt);
+        vin = _mm_cmpgt_epi32(vni, vb);
+        vb = _mm_or_si128(_mm_and_si128(vin, vb), _mm_andnot_si128(vin, vout));
+        _mm_storeu_si128((__m128i *)(bin + i), vb);
+    }
+#endif
+    for (; i < n; ++i) {
+        t = value[i] * invwidth;
+        if (t < nbins) {
+            bin[i] = (int)t;
+        }
+        else {
+            bin[i] = -1;
+        }
+    }
+}
+
+/** Add weighted counts to the histograms of the groups of each atom
+ *
+ * The update is done one atom after the other, so atoms sharing a bin are
+ * all counted. Atoms with a bin of -1 are skipped.
+ *
+ * Parameters :
+ *  - hist   : the histogram of each group
+ *  - bin    : the bin of each atom of "buf"
+ *  - weight : the weight of each atom of "buf"
+ *  - buf    : the buffers, for the number of atoms and their groups
+ *  - factor : the factor applied to the weights
+ */
+void histogram_add_groups(real **hist, const int *bin, const real *weight,
+        const BinBuffer *buf, double factor) {
+    const unsigned int *mask;
+    int i, g;
+    for (i=0; i<buf->n; ++i) {
+        if (bin[i] >= 0) {
+            mask = buf->mask + (size_t)i * buf->nmask;
+            for (g = bin_mask_next(mask, buf->ngroups, -1); g >= 0;
+                    g = bin_mask_next(mask, buf->ngroups, g)) {
+                hist[g][bin[i]] += weight[i]*factor;
+            }
+        }
+    }
+}
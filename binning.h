@@ -0,0 +1,108 @@
+#ifndef _binning_h
+#define _binning_h
+
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/pbc.h>
+#include <gromacs/vec.h>
+
+/* Maximum number of weight channels, one per type of density */
+#define BIN_MAX_CHANNELS (4)
+/* Maximum number of arrays of bins kept for a frame, one per dimension and
+ * number of bins */
+#define BIN_MAX_CACHED (3*DIM)
+/* Number of groups in a word of a membership mask */
+#define BIN_MASK_BITS (32)
+
+/** Scratch buffers to bin a whole group at once
+ *
+ * The coordinates and weights of the group are gathered in structure of
+ * arrays layout so the bin computation can run on SIMD registers; the
+ * histograms are then updated with a scalar loop, which is safe when
+ * several atoms fall in the same bin.
+ *
+ * Each atom has one weight per channel, so the densities of several types
+ * are added to their histograms from the same bins.
+ *
+ * The buffer also holds the geometry of the atoms being binned, shared by
+ * all the modes: their coordinates, gathered once per frame by
+ * bin_geometry_start, their periodic bins along each dimension, computed
+ * the first time a mode asks for them and reused by the others, and their
+ * position in a triclinic box. Each atom is binned once even if it belongs
+ * to several groups; its membership mask tells the histograms of which
+ * groups it is added to.
+ */
+typedef struct BinBuffer {
+    real *coord;    /* One coordinate (or a distance) per atom */
+    real *weight;   /* Weight of each atom, channel after channel */
+    int *bin;       /* Computed bins, -1 for atoms out of the histogram */
+    int *bin2;      /* Bins along a second dimension */
+    int nalloc;
+    int nchannels;
+    rvec *x;        /* Coordinates of the atoms */
+    rvec *xbox;     /* Same, put in the box, if bBox */
+    gmx_bool bBox;
+    matrix box;
+    int n;          /* Number of atoms */
+    const unsigned int *mask; /* Groups of each atom, nmask words each */
+    int nmask;
+    int ngroups;
+    real **hist;    /* Histogram of each group, for the modes to fill */
+    int ncached;    /* Number of arrays of bins */
+    int cache_dim[BIN_MAX_CACHED];
+    int cache_nbins[BIN_MAX_CACHED];
+    int *cache_bin[BIN_MAX_CACHED];
+} BinBuffer;
+
+/** Weights of the atoms for a channel
+ */
+static inline real *bin_weights(BinBuffer *buf, int channel) {
+    return buf->weight + (size_t)channel * buf->nalloc;
+}
+
+/** Number of words of the membership mask of an atom
+ */
+static inline int bin_mask_words(int ngroups) {
+    return (ngroups + BIN_MASK_BITS - 1) / BIN_MASK_BITS;
+}
+
+/** Next group after "group" an atom belongs to, -1 if there is none
+ *
+ * "mask" is the membership mask of the atom; start with a group of -1.
+ */
+static inline int bin_mask_next(const unsigned int *mask, int ngroups,
+        int group) {
+    for (++group; group < ngroups; ++group) {
+        if ((mask[group / BIN_MASK_BITS] >> (group % BIN_MASK_BITS)) & 1) {
+            return group;
+        }
+    }
+    return -1;
+}
+
+BinBuffer *build_bin_buffer(int size, int nchannels, int ngroups);
+
+void clean_bin_buffer(BinBuffer *buf);
+
+void bin_buffer_reserve(BinBuffer *buf, int size);
+
+void bin_geometry_start(BinBuffer *buf, rvec *x, atom_id *index,
+        const unsigned int *mask, int n, matrix box);
+
+const int *bin_geometry_bins(BinBuffer *buf, int dim, int nbins);
+
+rvec *bin_geometry_in_box(BinBuffer *buf);
+
+void gather_weights(real *weights, atom_id *index, int n, real *out);
+
+void periodic_bins(const real *coord, int n, real length, int nbins,
+        int *bin);
+
+void linear_bins(const real *value, int n, real invwidth, int nbins,
+        int *bin);
+
+void histogram_add_groups(real **hist, const int *bin, const real *weight,
+        const BinBuffer *buf, double factor);
+
+#endif /* _binning_h */
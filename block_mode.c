@@ -0,0 +1,198 @@
+#include "block_mode.h"
+
+/** Contruct an instance of BlockOutput and open its files
+ *
+ * Parameters :
+ *  - length   : the number of frames in a block, greater than 0
+ *  - naxes    : the number of axes with a slab profile
+ *  - slab_fns : the output file of each type of density and axis, channel
+ *               after channel
+ *  - grid_fn  : the output file of the grids, named for each type of density
+ *               like the one of -og, or NULL
+ *  - dist_fn  : the output file of the distance profiles, named like the
+ *               ones of -od, or NULL
+ *  - nref     : the number of reference groups of the distance mode
+ *  - ngroups  : the number of analysed groups
+ *  - names    : the name of each group, for the legends
+ *  - dens     : the types of density, one per channel
+ *  - oenv     : the output environment for the xvg files
+ */
+BlockOutput *build_block_output(int length, int naxes, char **slab_fns,
+        const char *grid_fn, const char *dist_fn, int nref, int ngroups,
+        const char **names, const char *dens, output_env_t oenv) {
+    BlockOutput *out;
+    char *dens_fn, *fn;
+    int a, c, ref;
+
+    if (length <= 0) {
+        gmx_fatal(FARGS, "Invalid number of frames per block: %d\n", length);
+    }
+    snew(out, 1);
+    out->length = length;
+    out->nframes = 0;
+    out->nblocks = 0;
+    out->naxes = naxes;
+    out->nchannels = strlen(dens);
+    snew(out->out_slab, out->nchannels * naxes);
+    for (c=0; c<out->nchannels; ++c) {
+        out->dens[c] = dens[c];
+        for (a=0; a<naxes; ++a) {
+            out->out_slab[c * naxes + a] = xvgropen(slab_fns[c * naxes + a],
+                    "Partial densities by block", "Box (nm)",
+                    dens_ylabel(dens[c]), oenv);
+            xvgr_legend(out->out_slab[c * naxes + a], ngroups, names, oenv);
+        }
+    }
+    for (c=0; c<BIN_MAX_CHANNELS; ++c) {
+        out->out_grid[c] = NULL;
+    }
+    for (c=0; c<out->nchannels && grid_fn; ++c) {
+        fn = dens_output_fn(grid_fn, dens[c], out->nchannels);
+        out->out_grid[c] = ffopen(fn, "w");
+        if (out->out_grid[c] == NULL) {
+            gmx_fatal(FARGS, "Error opening %s for block output\n", fn);
+        }
+        sfree(fn);
+    }
+    out->out_dist = NULL;
+    out->nref = 0;
+    if (dist_fn) {
+        out->nref = nref;
+        snew(out->out_dist, out->nchannels * nref);
+        for (c=0; c<out->nchannels; ++c) {
+            dens_fn = dens_output_fn(dist_fn, dens[c], out->nchannels);
+            for (ref=0; ref<nref; ++ref) {
+                fn = dist_ref_fn(dens_fn, ref, nref);
+                out->out_dist[c * nref + ref] = xvgropen(fn,
+                        "Density by block", "Distance (nm)",
+                        dens_ylabel(dens[c]), oenv);
+                xvgr_legend(out->out_dist[c * nref + ref], ngroups, names,
+                        oenv);
+                sfree(fn);
+            }
+            sfree(dens_fn);
+        }
+    }
+    return out;
+}
+
+void clean_block_output(BlockOutput *out) {
+    int i;
+    if (out) {
+        for (i=0; i<out->nchannels * out->naxes; ++i) {
+            ffclose(out->out_slab[i]);
+        }
+        sfree(out->out_slab);
+        for (i=0; i<out->nchannels; ++i) {
+            if (out->out_grid[i]) {
+                ffclose(out->out_grid[i]);
+            }
+        }
+        for (i=0; i<out->nchannels * out->nref; ++i) {
+            ffclose(out->out_dist[i]);
+        }
+        sfree(out->out_dist);
+        sfree(out);
+    }
+}
+
+/** Count a frame of the current block
+ *
+ * Returns TRUE when the frame completes the block, which should then be
+ * written with block_write.
+ */
+gmx_bool block_frame(BlockOutput *out, double t) {
+    if (out->nframes == 0) {
+        out->t0 = t;
+    }
+    out->t1 = t;
+    out->nframes++;
+    return out->nframes == out->length;
+}
+
+static void block_header(BlockOutput *out, FILE *fp, int nframes) {
+    fprintf(fp, "# Block %d: %d frames from t = %.12g to %.12g\n", out->nblocks,
+            nframes, out->t0, out->t1);
+}
+
+/** Append the averages of a block to the outputs
+ *
+ * The sums of "block" are normalized in place: they have to be added to the
+ * totals before, and reset after.
+ *
+ * Parameters :
+ *  - out     : the block outputs
+ *  - job     : the description of the analysis
+ *  - block   : the sums of the frames of the block
+ *  - slWidth : the width of the slices along each axis
+ */
+void block_write(BlockOutput *out, DensityJob *job, DensityAccum *block,
+        real *slWidth) {
+    FILE *saved[BIN_MAX_CHANNELS];
+    FILE *fp;
+    DistMode *dist, *next;
+    char format;
+    real factor;
+    int a, c, n, i, ref;
+
+    for (c=0; c<out->nchannels; ++c) {
+        factor = 1.0/block->nframes;
+        if (out->dens[c] == 'm') {
+            factor *= AMU/(NANO*NANO*NANO);
+        }
+        for (a=0; a<out->naxes; ++a) {
+            fp = out->out_slab[c * out->naxes + a];
+            block_header(out, fp, block->nframes);
+            for (i=0; i<job->nslices; ++i) {
+                fprintf(fp, "%12g  ", i * slWidth[a]);
+                for (n=0; n<job->ngroups; ++n) {
+                    fprintf(fp, "   %12g", block->slDensity[(c * job->naxes
+                                + a) * job->ngroups + n][i] * factor);
+                }
+                fprintf(fp, "\n");
+            }
+            fprintf(fp, "&\n");
+            fflush(fp);
+        }
+    }
+
+    /* The grids and distance profiles of the block are written by the
+     * modes themselves, to the streams of the block output */
+    if (out->out_grid[0] && block->grid) {
+        for (c=0; c<out->nchannels; ++c) {
+            block_header(out, out->out_grid[c], block->nframes);
+            saved[c] = block->grid->out_grid[c];
+            block->grid->out_grid[c] = out->out_grid[c];
+        }
+        format = block->grid->format;
+        block->grid->format = 't';
+        grid_end(block->grid);
+        block->grid->format = format;
+        for (c=0; c<out->nchannels; ++c) {
+            block->grid->out_grid[c] = saved[c];
+            fflush(out->out_grid[c]);
+        }
+    }
+    for (dist = block->dist, ref = 0; out->out_dist && dist;
+            dist = dist->next, ++ref) {
+        for (c=0; c<out->nchannels; ++c) {
+            block_header(out, out->out_dist[c * out->nref + ref],
+                    block->nframes);
+            saved[c] = dist->out_dist[c];
+            dist->out_dist[c] = out->out_dist[c * out->nref + ref];
+        }
+        /* dist_end works on a whole chain */
+        next = dist->next;
+        dist->next = NULL;
+        dist_end(dist);
+        dist->next = next;
+        for (c=0; c<out->nchannels; ++c) {
+            dist->out_dist[c] = saved[c];
+            fprintf(out->out_dist[c * out->nref + ref], "&\n");
+            fflush(out->out_dist[c * out->nref + ref]);
+        }
+    }
+
+    out->nblocks++;
+    out->nframes = 0;
+}
@@ -0,0 +1,58 @@
+#ifndef _block_mode_h
+#define _block_mode_h
+
+#include <stdio.h>
+
+#include <gromacs/statutil.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/physics.h>
+#include <gromacs/xvgr.h>
+#include <gromacs/futil.h>
+
+#include "density.h"
+
+/** Stream the densities of consecutive blocks of frames
+ *
+ * The frames are analysed into a separate instance of DensityAccum; every
+ * "length" frames, its sums are added to the totals, the averages of the
+ * block are appended to the block outputs, and it is set back to zero. The
+ * memory used does not depend on the number of blocks.
+ *
+ * Each output is an xvg-like text file where a block starts with a comment
+ * giving its number of frames and its time range, and ends with "&":
+ *  - the slab profiles, one file per type of density and axis;
+ *  - the grids, in the text format of -og, one file per type of density, if
+ *    requested;
+ *  - the distance profiles, one file per type of density and reference
+ *    group, if requested.
+ */
+typedef struct BlockOutput {
+    int length;         /* Number of frames in a block */
+    int nframes;        /* Number of frames in the current block */
+    int nblocks;        /* Number of blocks written */
+    double t0;          /* Time of the first frame of the current block */
+    double t1;          /* Time of the last frame of the current block */
+    int naxes;
+    int nchannels;
+    FILE **out_slab;    /* Slab profiles, channel * naxes + axis */
+    FILE *out_grid[BIN_MAX_CHANNELS]; /* Grids, NULL if not requested */
+    FILE **out_dist;    /* Distance profiles, channel * nref + reference,
+                           NULL if not requested */
+    int nref;
+    char dens[BIN_MAX_CHANNELS];
+} BlockOutput;
+
+BlockOutput *build_block_output(int length, int naxes, char **slab_fns,
+        const char *grid_fn, const char *dist_fn, int nref, int ngroups,
+        const char **names, const char *dens, output_env_t oenv);
+
+void clean_block_output(BlockOutput *out);
+
+gmx_bool block_frame(BlockOutput *out, double t);
+
+void block_write(BlockOutput *out, DensityJob *job, DensityAccum *block,
+        real *slWidth);
+
+#endif /* _block_mode_h */
@@ -0,0 +1,468 @@
+#include "cell_list.h"
+
+/* Average number of reference atoms wanted in a cell */
+#define CELL_OCCUPANCY (4.0)
+/* Cells wider than that (in nm) would hold too many atoms for a dense group */
+#define CELL_MAX_WIDTH (0.5)
+/* Upper bound on the number of cells to keep the memory footprint sane */
+#define CELL_MAX_TOTAL (1 << 21)
+
+/** Contruct an instance of CellList
+ *
+ * Parameters :
+ *  - masked_axis : the axis to ignore in distance calculation, -1 for none
+ */
+CellList *build_cell_list(int masked_axis) {
+    CellList *cells;
+    int d;
+
+    snew(cells, 1);
+    cells->masked = masked_axis;
+    cells->ntotal = 0;
+    cells->ncell_alloc = 0;
+    cells->start = NULL;
+    cells->occupied = NULL;
+    cells->noccupied = 0;
+    cells->x = NULL;
+    cells->cell = NULL;
+    cells->order = NULL;
+    cells->natoms = 0;
+    cells->natoms_alloc = 0;
+    cells->min_width = 0;
+    cells->bValid = FALSE;
+    for (d=0; d<DIM; ++d) {
+        cells->ncells[d] = 1;
+        cells->width[d] = 0;
+        cells->invwidth[d] = 0;
+        cells->box[d] = 0;
+        cells->hbox[d] = 0;
+    }
+    return cells;
+}
+
+/** Clean an instance of CellList
+ */
+void clean_cell_list(CellList *cells) {
+    if (cells) {
+        sfree(cells->start);
+        sfree(cells->occupied);
+        sfree(cells->x);
+        sfree(cells->cell);
+        sfree(cells->order);
+        sfree(cells);
+    }
+}
+
+/** Tell if the cell list can reproduce pbc_dx for this box
+ */
+static gmx_bool cell_list_usable(CellList *cells, t_pbc *pbc, matrix box) {
+    int d, e;
+    if (pbc == NULL) {
+        return FALSE;
+    }
+    if (pbc->ePBC != epbcXYZ &&
+            !(pbc->ePBC == epbcXY && cells->masked == ZZ)) {
+        return FALSE;
+    }
+    for (d=0; d<DIM; ++d) {
+        for (e=0; e<DIM; ++e) {
+            if (d != e && box[d][e] != 0) {
+                return FALSE;
+            }
+        }
+        if (d != cells->masked && box[d][d] <= 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/** Put a coordinate in [0, length[ and return the matching cell
+ */
+static int wrap_coordinate(real value, real length, real invwidth, int ncells,
+        real *wrapped) {
+    int idx;
+    value -= length * floor(value / length);
+    if (value >= length || value < 0) {
+        value = 0;
+    }
+    *wrapped = value;
+    idx = (int)(value * invwidth);
+    if (idx >= ncells) {
+        idx = ncells - 1;
+    }
+    return idx;
+}
+
+/** Choose the cell grid for the current box and reference group size
+ */
+static void cell_list_set_grid(CellList *cells, matrix box, int size) {
+    int d, ndim = 0;
+    double volume = 1, target = 0;
+    long ntotal = 1;
+
+    for (d=0; d<DIM; ++d) {
+        if (d != cells->masked) {
+            volume *= box[d][d];
+            ndim++;
+        }
+    }
+    target = pow(volume * CELL_OCCUPANCY / size, 1.0/ndim);
+    if (target > CELL_MAX_WIDTH) {
+        target = CELL_MAX_WIDTH;
+    }
+    do {
+        ntotal = 1;
+        for (d=0; d<DIM; ++d) {
+            if (d == cells->masked) {
+                cells->ncells[d] = 1;
+            }
+            else {
+                cells->ncells[d] = (int)(box[d][d] / target);
+                if (cells->ncells[d] < 1) {
+                    cells->ncells[d] = 1;
+                }
+            }
+            ntotal *= cells->ncells[d];
+        }
+        target *= 1.1;
+    } while (ntotal > CELL_MAX_TOTAL);
+    cells->ntotal = (int)ntotal;
+
+    cells->min_width = GMX_REAL_MAX;
+    for (d=0; d<DIM; ++d) {
+        if (d == cells->masked) {
+            cells->box[d] = 0;
+            cells->hbox[d] = 0;
+            cells->width[d] = 0;
+            cells->invwidth[d] = 0;
+        }
+        else {
+            cells->box[d] = box[d][d];
+            cells->hbox[d] = box[d][d]/2;
+            cells->width[d] = box[d][d] / cells->ncells[d];
+            cells->invwidth[d] = 1 / cells->width[d];
+            if (cells->width[d] < cells->min_width) {
+                cells->min_width = cells->width[d];
+            }
+        }
+    }
+}
+
+/** Sort the reference group into the cells
+ *
+ * Must be called at each frame, after the molecules have been made whole and
+ * centered, before any call to cell_list_min_dist.
+ */
+void cell_list_update(CellList *cells, t_pbc *pbc, matrix box,
+        atom_id *index, int size, rvec *x) {
+    int i, d, c, pos;
+    int idx[DIM];
+    rvec wrapped;
+
+    cells->bValid = FALSE;
+    if (size <= 0 || !cell_list_usable(cells, pbc, box)) {
+        return;
+    }
+    cell_list_set_grid(cells, box, size);
+
+    if (cells->ntotal + 1 > cells->ncell_alloc) {
+        cells->ncell_alloc = cells->ntotal + 1;
+        srenew(cells->start, cells->ncell_alloc);
+        srenew(cells->occupied, cells->ncell_alloc);
+    }
+    if (size > cells->natoms_alloc) {
+        cells->natoms_alloc = size;
+        srenew(cells->x, cells->natoms_alloc);
+        srenew(cells->cell, cells->natoms_alloc);
+        srenew(cells->order, cells->natoms_alloc);
+    }
+    cells->natoms = size;
+
+    /* Count the atoms in each cell */
+    for (c=0; c<=cells->ntotal; ++c) {
+        cells->start[c] = 0;
+    }
+    for (i=0; i<size; ++i) {
+        for (d=0; d<DIM; ++d) {
+            if (d == cells->masked) {
+                idx[d] = 0;
+            }
+            else {
+                idx[d] = wrap_coordinate(x[index[i]][d], cells->box[d],
+                        cells->invwidth[d], cells->ncells[d], &wrapped[d]);
+            }
+        }
+        c = (idx[XX] * cells->ncells[YY] + idx[YY]) * cells->ncells[ZZ]
+            + idx[ZZ];
+        cells->cell[i] = c;
+        cells->start[c + 1]++;
+    }
+    for (c=0; c<cells->ntotal; ++c) {
+        cells->start[c + 1] += cells->start[c];
+    }
+
+    /* Scatter the wrapped coordinates; start[c] is used as a cursor and
+     * ends up pointing at the first atom of the next cell. */
+    for (i=0; i<size; ++i) {
+        c = cells->cell[i];
+        pos = cells->start[c]++;
+        cells->order[pos] = i;
+        for (d=0; d<DIM; ++d) {
+            if (d == cells->masked) {
+                cells->x[pos][d] = 0;
+            }
+            else {
+                wrap_coordinate(x[index[i]][d], cells->box[d],
+                        cells->invwidth[d], cells->ncells[d], &wrapped[d]);
+                cells->x[pos][d] = wrapped[d];
+            }
+        }
+    }
+    for (c=cells->ntotal; c>0; --c) {
+        cells->start[c] = cells->start[c - 1];
+    }
+    cells->start[0] = 0;
+
+    cells->noccupied = 0;
+    for (c=0; c<cells->ntotal; ++c) {
+        if (cells->start[c + 1] > cells->start[c]) {
+            cells->occupied[cells->noccupied++] = c;
+        }
+    }
+    cells->bValid = TRUE;
+}
+
+/** Squared minimum distance between a point and the atoms of a cell
+ *
+ * Returns the smallest of "best2" and the distances found in the cell.
+ */
+static real cell_min_dist2(CellList *cells, rvec point, int c, real best2) {
+    int a, d;
+    real dx, d2;
+    for (a=cells->start[c]; a<cells->start[c + 1]; ++a) {
+        d2 = 0;
+        for (d=0; d<DIM; ++d) {
+            dx = point[d] - cells->x[a][d];
+            if (dx > cells->hbox[d]) {
+                dx -= cells->box[d];
+            }
+            else if (dx < -cells->hbox[d]) {
+                dx += cells->box[d];
+            }
+            d2 += dx*dx;
+        }
+        if (d2 < best2) {
+            best2 = d2;
+        }
+    }
+    return best2;
+}
+
+/** Range of cell offsets to visit along one dimension for a given ring
+ *
+ * When the ring is wider than the grid, the range is clamped so that each
+ * cell is visited only once.
+ */
+static gmx_bool ring_range(int ncells, int ring, int *lo, int *hi) {
+    if (2 * ring + 1 >= ncells) {
+        *lo = -((ncells - 1) / 2);
+        *hi = *lo + ncells - 1;
+        return TRUE;
+    }
+    *lo = -ring;
+    *hi = ring;
+    return FALSE;
+}
+
+/** Scan every occupied cell, skipping those that can not be closer than the
+ * best distance found so far
+ */
+static real scan_occupied(CellList *cells, rvec point, real best2) {
+    int n, c, d, rest;
+    int idx[DIM];
+    real dx, gap, lb2;
+    for (n=0; n<cells->noccupied; ++n) {
+        c = cells->occupied[n];
+        idx[ZZ] = c % cells->ncells[ZZ];
+        rest = c / cells->ncells[ZZ];
+        idx[YY] = rest % cells->ncells[YY];
+        idx[XX] = rest / cells->ncells[YY];
+        lb2 = 0;
+        for (d=0; d<DIM; ++d) {
+            if (d == cells->masked) {
+                continue;
+            }
+            dx = (idx[d] + 0.5) * cells->width[d] - point[d];
+            if (dx > cells->hbox[d]) {
+                dx -= cells->box[d];
+            }
+            else if (dx < -cells->hbox[d]) {
+                dx += cells->box[d];
+            }
+            gap = fabs(dx) - 0.5 * cells->width[d];
+            if (gap > 0) {
+                lb2 += gap*gap;
+            }
+        }
+        if (lb2 < best2) {
+            best2 = cell_min_dist2(cells, point, c, best2);
+        }
+    }
+    return best2;
+}
+
+/** Get the minimum distance between a point and the reference group
+ *
+ * The result is the same as min_dist on the same reference group. The search
+ * stops when no atom closer than "max_dist" can be found anymore: in that
+ * case, the returned distance is greater than "max_dist" but may not be the
+ * actual minimum distance.
+ */
+real cell_list_min_dist(CellList *cells, rvec point, real max_dist) {
+    int d, i, j, k, c, ring;
+    int home[DIM], lo[DIM], hi[DIM], plo[DIM], phi[DIM];
+    int off[DIM], cidx[DIM];
+    long nring;
+    rvec p;
+    real best2 = GMX_REAL_MAX;
+    real bound;
+    gmx_bool bFull, bPrev;
+
+    for (d=0; d<DIM; ++d) {
+        if (d == cells->masked) {
+            p[d] = 0;
+            home[d] = 0;
+        }
+        else {
+            home[d] = wrap_coordinate(point[d], cells->box[d],
+                    cells->invwidth[d], cells->ncells[d], &p[d]);
+        }
+    }
+
+    for (ring=0; ; ++ring) {
+        bFull = TRUE;
+        nring = 1;
+        for (d=0; d<DIM; ++d) {
+            bFull = ring_range(cells->ncells[d], ring, &lo[d], &hi[d])
+                && bFull;
+            nring *= hi[d] - lo[d] + 1;
+        }
+        /* Past a few rings, looking at every occupied cell is cheaper than
+         * walking through the empty ones. */
+        if (ring > 1 && nring > 2 * cells->noccupied) {
+            return sqrt(scan_occupied(cells, p, best2));
+        }
+        for (i=lo[XX]; i<=hi[XX]; ++i) {
+            for (j=lo[YY]; j<=hi[YY]; ++j) {
+                for (k=lo[ZZ]; k<=hi[ZZ]; ++k) {
+                    off[XX] = i; off[YY] = j; off[ZZ] = k;
+                    /* Skip the cells already visited with the previous
+                     * ring */
+                    bPrev = (ring > 0);
+                    for (d=0; d<DIM && bPrev; ++d) {
+                        bPrev = (off[d] >= plo[d] && off[d] <= phi[d]);
+                    }
+                    if (bPrev) {
+                        continue;
+                    }
+                    for (d=0; d<DIM; ++d) {
+                        cidx[d] = (home[d] + off[d]) % cells->ncells[d];
+                        if (cidx[d] < 0) {
+                            cidx[d] += cells->ncells[d];
+                        }
+                    }
+                    c = (cidx[XX] * cells->ncells[YY] + cidx[YY])
+                        * cells->ncells[ZZ] + cidx[ZZ];
+                    best2 = cell_min_dist2(cells, p, c, best2);
+                }
+            }
+        }
+        if (bFull) {
+            break;
+        }
+        /* Cells out of the current ring are at least that far */
+        bound = ring * cells->min_width;
+        if (best2 <= bound*bound || bound > max_dist) {
+            break;
+        }
+        for (d=0; d<DIM; ++d) {
+            plo[d] = lo[d];
+            phi[d] = hi[d];
+        }
+    }
+    if (best2 == GMX_REAL_MAX) {
+        return GMX_REAL_MAX;
+    }
+    return sqrt(best2);
+}
+
+/** List the reference atoms within "cutoff" of a point
+ *
+ * The positions of the atoms in the index given to cell_list_update are
+ * appended to "list", after its first "n" elements; "list" is grown as
+ * needed and "nalloc" is its allocated size. Returns the new number of
+ * elements. The distances are the same as in cell_list_min_dist.
+ */
+int cell_list_within(CellList *cells, rvec point, real cutoff, int n,
+        atom_id **list, int *nalloc) {
+    int d, i, j, k, a, c;
+    int lo[DIM], hi[DIM], cidx[DIM];
+    rvec p;
+    real dx, d2, cutoff2 = cutoff*cutoff;
+
+    for (d=0; d<DIM; ++d) {
+        if (d == cells->masked) {
+            p[d] = 0;
+            lo[d] = 0;
+            hi[d] = 0;
+            continue;
+        }
+        wrap_coordinate(point[d], cells->box[d], cells->invwidth[d],
+                cells->ncells[d], &p[d]);
+        lo[d] = (int)floor((p[d] - cutoff) * cells->invwidth[d]);
+        hi[d] = (int)floor((p[d] + cutoff) * cells->invwidth[d]);
+        /* Visit each cell only once when the range wraps around the box */
+        if (hi[d] - lo[d] + 1 >= cells->ncells[d]) {
+            lo[d] = 0;
+            hi[d] = cells->ncells[d] - 1;
+        }
+    }
+
+    for (i=lo[XX]; i<=hi[XX]; ++i) {
+        for (j=lo[YY]; j<=hi[YY]; ++j) {
+            for (k=lo[ZZ]; k<=hi[ZZ]; ++k) {
+                cidx[XX] = i; cidx[YY] = j; cidx[ZZ] = k;
+                for (d=0; d<DIM; ++d) {
+                    cidx[d] %= cells->ncells[d];
+                    if (cidx[d] < 0) {
+                        cidx[d] += cells->ncells[d];
+                    }
+                }
+                c = (cidx[XX] * cells->ncells[YY] + cidx[YY])
+                    * cells->ncells[ZZ] + cidx[ZZ];
+                for (a=cells->start[c]; a<cells->start[c + 1]; ++a) {
+                    d2 = 0;
+                    for (d=0; d<DIM; ++d) {
+                        dx = p[d] - cells->x[a][d];
+                        if (dx > cells->hbox[d]) {
+                            dx -= cells->box[d];
+                        }
+                        else if (dx < -cells->hbox[d]) {
+                            dx += cells->box[d];
+                        }
+                        d2 += dx*dx;
+                    }
+                    if (d2 <= cutoff2) {
+                        if (n >= *nalloc) {
+                            *nalloc = 2 * n + 16;
+                            srenew(*list, *nalloc);
+                        }
+                        (*list)[n++] = cells->order[a];
+                    }
+                }
+            }
+        }
+    }
+    return n;
+}
@@ -0,0 +1,61 @@
+#ifndef _cell_list_h
+#define _cell_list_h
+
+#include <math.h>
+
+#include <gromacs/macros.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/pbc.h>
+#include <gromacs/vec.h>
+
+/** Spatial binning of a reference group to speed up minimum distance search
+ *
+ * The reference atoms are sorted into a regular grid of cells that is rebuilt
+ * at each frame. A minimum distance lookup only visits the cells around the
+ * point of interest, ring after ring, and stops as soon as the remaining
+ * cells can not hold a closer atom.
+ *
+ * The axis given as "masked" is ignored in the distance calculation, as
+ * make_2D does it for the brute force search; there is only one cell along
+ * that axis.
+ *
+ * The cell list only handles rectangular boxes that are periodic along all
+ * the dimensions used for the distance. When it is not the case, "bValid" is
+ * FALSE and the caller must use min_dist instead.
+ */
+typedef struct CellList {
+    int ncells[DIM];    /* Number of cells along each dimension */
+    real width[DIM];    /* Width of a cell along each dimension */
+    real invwidth[DIM]; /* Inverse of the cell width */
+    real box[DIM];      /* Box length along each dimension */
+    real hbox[DIM];     /* Half of the box length */
+    real min_width;     /* Smallest cell width among the used dimensions */
+    int masked;         /* Axis to ignore, -1 to use the 3 dimensions */
+    int ntotal;         /* Total number of cells */
+    int ncell_alloc;
+    int *start;         /* Index of the first atom of each cell in x */
+    int *occupied;      /* Indices of the cells that contain atoms */
+    int noccupied;
+    rvec *x;            /* Wrapped reference coordinates sorted by cell */
+    int *cell;          /* Cell of each reference atom, in the index order */
+    int *order;         /* Position in the index of each atom of x */
+    int natoms;
+    int natoms_alloc;
+    gmx_bool bValid;
+} CellList;
+
+CellList *build_cell_list(int masked_axis);
+
+void clean_cell_list(CellList *cells);
+
+void cell_list_update(CellList *cells, t_pbc *pbc, matrix box,
+        atom_id *index, int size, rvec *x);
+
+real cell_list_min_dist(CellList *cells, rvec point, real max_dist);
+
+int cell_list_within(CellList *cells, rvec point, real cutoff, int n,
+        atom_id **list, int *nalloc);
+
+#endif /* _cell_list_h */
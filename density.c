@@ -0,0 +1,462 @@
+#include "density.h"
+
+/** Mark the atoms of a group in "bUsed"
+ */
+static void mark_atoms(gmx_bool *bUsed, atom_id *index, int n) {
+    int i;
+    for (i=0; i<n; ++i) {
+        bUsed[index[i]] = TRUE;
+    }
+}
+
+/** Describe an analysis
+ *
+ * The atoms the analysis reads are listed afterwards by build_job_atoms.
+ *
+ * Parameters :
+ *  - job     : the description to fill
+ *  - index   : the atoms of each analysed group
+ *  - gnx     : the size of each group
+ *  - ngroups : the number of groups
+ *  - nslices : the number of slices of the slab profiles
+ *  - axes    : the axes of the slab profiles, the normal first
+ *  - naxes   : the number of axes
+ *  - top     : the topology
+ *  - ePBC    : the type of periodic conditions
+ *  - bCenter : center the frames on the normal axis?
+ *  - dens    : the type of each density, one character per channel
+ *  - weights : the contribution of each atom to each channel
+ */
+void set_job(DensityJob *job, atom_id **index, int gnx[], int ngroups,
+        int nslices, int *axes, int naxes, t_topology *top, int ePBC,
+        gmx_bool bCenter, const char *dens, real **weights) {
+    int a, c;
+
+    job->index = index;
+    job->gnx = gnx;
+    job->ngroups = ngroups;
+    job->nslices = nslices;
+    job->axis = axes[0];
+    job->naxes = naxes;
+    for (a=0; a<naxes; ++a) {
+        job->axes[a] = axes[a];
+    }
+    job->top = top;
+    job->ePBC = ePBC;
+    job->bCenter = bCenter;
+    job->nchannels = strlen(dens);
+    for (c=0; c<job->nchannels; ++c) {
+        job->dens[c] = dens[c];
+    }
+    job->weights = weights;
+    job->unique = NULL;
+    job->nunique = 0;
+    job->mask = NULL;
+    job->used = NULL;
+    job->nused = 0;
+    job->bSelPBC = FALSE;
+    job->whole = NULL;
+    job->whole_prev = NULL;
+    job->nwhole = 0;
+    job->cindex = NULL;
+    job->csize = 0;
+    job->cmass = 0;
+    job->bPrepared = FALSE;
+}
+
+/** List the atoms the analysis reads and the molecules they belong to
+ *
+ * Each atom of the analysed groups is listed once in the unique atoms, with
+ * a mask of the groups it belongs to, so an atom shared by overlapping
+ * groups is binned once per frame and added to each of its groups.
+ *
+ * The used atoms are the ones of the analysed groups, of the reference groups
+ * of the distance mode, and of the centering group. They are the only atoms
+ * centered. When "bSelPBC" is set, only the molecules that contain a used
+ * atom are made whole, each atom being put next to the previous atom of its
+ * molecule; this assumes that consecutive atoms of a molecule are closer than
+ * half the box.
+ *
+ * Parameters :
+ *  - job       : the description of the analysis, with its groups set
+ *  - dist      : the distance mode, whose reference groups are used, or NULL
+ *  - bSelPBC   : only make whole the molecules of the used atoms
+ *  - cindex    : the group to center on, or NULL for the whole system
+ *  - csize     : the size of the centering group
+ */
+void build_job_atoms(DensityJob *job, DistMode *dist, gmx_bool bSelPBC,
+        atom_id *cindex, int csize) {
+    t_topology *top = job->top;
+    t_block *mols = &top->mols;
+    int natoms = top->atoms.nr;
+    int nmask = bin_mask_words(job->ngroups);
+    gmx_bool *bUsed;
+    int *unique_pos;
+    int i, n, m, a, nmols = 0, ntotal = 0;
+
+    snew(bUsed, natoms);
+    for (n=0; n<job->ngroups; ++n) {
+        mark_atoms(bUsed, job->index[n], job->gnx[n]);
+        ntotal += job->gnx[n];
+    }
+    job->nunique = 0;
+    for (i=0; i<natoms; ++i) {
+        if (bUsed[i]) {
+            job->nunique++;
+        }
+    }
+    snew(job->unique, job->nunique);
+    snew(job->mask, (size_t)job->nunique * nmask);
+    snew(unique_pos, natoms);
+    job->nunique = 0;
+    for (i=0; i<natoms; ++i) {
+        if (bUsed[i]) {
+            unique_pos[i] = job->nunique;
+            job->unique[job->nunique++] = i;
+        }
+    }
+    for (n=0; n<job->ngroups; ++n) {
+        for (i=0; i<job->gnx[n]; ++i) {
+            job->mask[(size_t)unique_pos[job->index[n][i]] * nmask
+                + n / BIN_MASK_BITS] |= 1u << (n % BIN_MASK_BITS);
+        }
+    }
+    sfree(unique_pos);
+    if (job->nunique < ntotal) {
+        fprintf(stderr, "The groups overlap: binning %d unique atoms instead "
+                "of %d\n", job->nunique, ntotal);
+    }
+    for (; dist; dist = dist->next) {
+        mark_atoms(bUsed, dist->ref_index, dist->ref_size);
+    }
+    if (cindex) {
+        mark_atoms(bUsed, cindex, csize);
+    }
+    job->nused = 0;
+    for (i=0; i<natoms; ++i) {
+        if (bUsed[i]) {
+            job->nused++;
+        }
+    }
+    snew(job->used, job->nused);
+    job->nused = 0;
+    for (i=0; i<natoms; ++i) {
+        if (bUsed[i]) {
+            job->used[job->nused++] = i;
+        }
+    }
+
+    job->bSelPBC = bSelPBC;
+    job->whole = NULL;
+    job->whole_prev = NULL;
+    job->nwhole = 0;
+    if (bSelPBC) {
+        snew(job->whole, natoms);
+        snew(job->whole_prev, natoms);
+        for (m=0; m<mols->nr; ++m) {
+            for (a=mols->index[m]; a<mols->index[m+1]; ++a) {
+                if (bUsed[a]) {
+                    break;
+                }
+            }
+            if (a == mols->index[m+1]) {
+                continue;
+            }
+            nmols++;
+            for (a=mols->index[m]; a<mols->index[m+1]; ++a) {
+                job->whole[job->nwhole] = a;
+                job->whole_prev[job->nwhole] = (a == mols->index[m]) ? -1 : a-1;
+                job->nwhole++;
+            }
+        }
+        srenew(job->whole, job->nwhole);
+        srenew(job->whole_prev, job->nwhole);
+        fprintf(stderr, "Making whole %d molecules, %d atoms out of %d\n",
+                nmols, job->nwhole, natoms);
+    }
+
+    job->cindex = cindex;
+    job->csize = cindex ? csize : natoms;
+    job->cmass = 0;
+    for (i=0; i<job->csize; ++i) {
+        job->cmass += top->atoms.atom[cindex ? cindex[i] : i].m;
+    }
+    sfree(bUsed);
+}
+
+void clean_job_atoms(DensityJob *job) {
+    sfree(job->unique);
+    sfree(job->mask);
+    sfree(job->used);
+    sfree(job->whole);
+    sfree(job->whole_prev);
+}
+
+/** Make whole the molecules listed in the job
+ */
+static void make_whole(DensityJob *job, t_pbc *pbc, rvec x0[]) {
+    rvec dx;
+    atom_id a, prev;
+    int i;
+
+    for (i=0; i<job->nwhole; ++i) {
+        prev = job->whole_prev[i];
+        if (prev >= 0) {
+            a = job->whole[i];
+            pbc_dx(pbc, x0[a], x0[prev], dx);
+            rvec_add(x0[prev], dx, x0[a]);
+        }
+    }
+}
+
+/** Shift the used atoms so the center of mass of the centering group is at
+ * the center of the box, and at 0 along the axis
+ */
+void center_coords(DensityJob *job, matrix box, rvec x0[])
+{
+  t_atoms *atoms = &job->top->atoms;
+  int  i,m;
+  atom_id a;
+  real mm;
+  rvec com,shift,box_center;
+
+  clear_rvec(com);
+  for(i=0; (i<job->csize); i++) {
+    a      = job->cindex ? job->cindex[i] : i;
+    mm     = atoms->atom[a].m;
+    for(m=0; (m<DIM); m++)
+      com[m] += mm*x0[a][m];
+  }
+  for(m=0; (m<DIM); m++)
+    com[m] /= job->cmass;
+  calc_box_center(ecenterDEF,box,box_center);
+  rvec_sub(box_center,com,shift);
+  shift[job->axis] -= box_center[job->axis];
+
+  for(i=0; (i<job->nused); i++)
+    rvec_dec(x0[job->used[i]],shift);
+}
+
+/** Contruct the main instance of DensityAccum
+ *
+ * Parameters :
+ *  - job  : the description of the analysis
+ *  - grid  : the grid mode, or NULL if it is not used
+ *  - voxel : the voxel mode, or NULL if it is not used
+ *  - dist  : the distance mode, or NULL if it is not used
+ *  - box   : the box of the first frame, to set up PBC removal
+ */
+DensityAccum *build_accum(DensityJob *job, GridHeight *grid,
+        VoxelGrid *voxel, DistMode *dist, matrix box) {
+    DensityAccum *accum;
+    int n;
+
+    snew(accum, 1);
+    snew(accum->slDensity, job_nprofiles(job));
+    for (n=0; n<job_nprofiles(job); ++n) {
+        snew(accum->slDensity[n], job->nslices);
+    }
+    accum->grid = grid;
+    accum->voxel = voxel;
+    accum->dist = dist;
+    accum->nframes = 0;
+    accum->bCopy = FALSE;
+    accum->timing = NULL;
+    accum->bins = build_bin_buffer(job->nunique, job->nchannels,
+            job->ngroups);
+
+    if (job->ePBC != epbcNONE)
+        snew(accum->pbc, 1);
+    else
+        accum->pbc = NULL;
+    accum->gpbc = NULL;
+    if (!job->bSelPBC) {
+        accum->gpbc = gmx_rmpbc_init(&job->top->idef, job->ePBC,
+                job->top->atoms.nr, box);
+    }
+    return accum;
+}
+
+/** Contruct an empty instance of DensityAccum shaped like "src"
+ */
+DensityAccum *copy_accum(DensityJob *job, DensityAccum *src, matrix box) {
+    DensityAccum *accum;
+
+    accum = build_accum(job, NULL, NULL, NULL, box);
+    accum->grid = copy_grids(src->grid);
+    accum->voxel = copy_voxels(src->voxel);
+    accum->dist = copy_dist(src->dist);
+    accum->timing = copy_timing(src->timing);
+    accum->bCopy = TRUE;
+    return accum;
+}
+
+/** Add the accumulators of "src" to the ones of "dst"
+ */
+void reduce_accum(DensityJob *job, DensityAccum *dst, DensityAccum *src) {
+    int n, i;
+
+    for (n=0; n<job_nprofiles(job); ++n) {
+        for (i=0; i<job->nslices; ++i) {
+            dst->slDensity[n][i] += src->slDensity[n][i];
+        }
+    }
+    dst->nframes += src->nframes;
+    grid_reduce(dst->grid, src->grid);
+    voxel_reduce(dst->voxel, src->voxel);
+    dist_reduce(dst->dist, src->dist);
+    timing_reduce(dst->timing, src->timing);
+}
+
+/** Set the accumulators of an instance back to zero, keeping their memory
+ *
+ * The timings are only reset for a copy, as they are summed into the main
+ * instance with the other accumulators.
+ */
+void reset_accum(DensityJob *job, DensityAccum *accum) {
+    int n;
+
+    for (n=0; n<job_nprofiles(job); ++n) {
+        memset(accum->slDensity[n], 0, job->nslices * sizeof(real));
+    }
+    accum->nframes = 0;
+    reset_grids(accum->grid);
+    reset_voxels(accum->voxel);
+    reset_dist(accum->dist);
+    if (accum->bCopy) {
+        reset_timing(accum->timing);
+    }
+}
+
+/** Clean an instance of DensityAccum
+ *
+ * The slab profiles are freed unless they were detached by setting
+ * slDensity to NULL.
+ */
+void clean_accum(DensityJob *job, DensityAccum *accum) {
+    int n;
+    if (accum) {
+        if (accum->slDensity) {
+            for (n=0; n<job_nprofiles(job); ++n) {
+                sfree(accum->slDensity[n]);
+            }
+            sfree(accum->slDensity);
+        }
+        if (accum->bCopy) {
+            clean_grids(accum->grid);
+            clean_voxels(accum->voxel);
+            clean_dist(accum->dist);
+            clean_timing(accum->timing);
+        }
+        if (accum->gpbc) {
+            gmx_rmpbc_done(accum->gpbc);
+        }
+        sfree(accum->pbc);
+        clean_bin_buffer(accum->bins);
+        sfree(accum);
+    }
+}
+
+/** Make the molecules of a frame whole, and center it if requested
+ *
+ * The PBC of "accum" are set to the box of the frame.
+ */
+void prepare_frame(DensityJob *job, DensityAccum *accum, rvec *x0,
+        matrix box) {
+    t_pbc *pbc = accum->pbc;
+    Timing *timing = accum->timing;
+
+    timing_start(timing);
+    if (pbc) {
+        set_pbc(pbc,job->ePBC,box);
+        /* make molecules whole again */
+        if (job->bSelPBC)
+            make_whole(job, pbc, x0);
+        else
+            gmx_rmpbc(accum->gpbc,job->top->atoms.nr,box,x0);
+    }
+    timing_stop(timing, etimPBC);
+
+    if (job->bCenter) {
+        timing_start(timing);
+        center_coords(job,box,x0);
+        timing_stop(timing, etimCENTER);
+    }
+}
+
+/** Add the contribution of one frame to the accumulators
+ *
+ * The coordinates are modified: molecules are made whole and centered if
+ * requested, unless the job says the frames are already prepared.
+ */
+void analyse_frame(DensityJob *job, DensityAccum *accum, rvec *x0,
+        matrix box) {
+    t_topology *top = job->top;
+    t_pbc *pbc = accum->pbc;
+    Timing *timing = accum->timing;
+    BinBuffer *buf = accum->bins;
+    const int *bin;
+    int n, a, c;
+    double invvol;
+
+    if (!job->bPrepared)
+        prepare_frame(job, accum, x0, box);
+    else if (pbc)
+        set_pbc(pbc,job->ePBC,box);
+
+    timing_start(timing);
+    grid_start_frame(accum->grid, box);
+    timing_stop(timing, etimGRID);
+    timing_start(timing);
+    voxel_start_frame(accum->voxel, box);
+    timing_stop(timing, etimVOXEL);
+    timing_start(timing);
+    dist_start_frame(accum->dist, box, x0, top, pbc);
+    timing_stop(timing, etimDIST);
+
+    invvol = job->nslices/(box[XX][XX]*box[YY][YY]*box[ZZ][ZZ]);
+
+    /* The unique atoms of the groups are binned as a batch. Their geometry
+     * is gathered first: their coordinates and their weights for every
+     * channel. The modes then read their bins from it; a bin along a
+     * dimension is computed once, by the first mode that needs it, and
+     * each bin is used by all the channels and all the groups of the
+     * atom. */
+    timing_start(timing);
+    bin_geometry_start(buf, x0, job->unique, job->mask, job->nunique, box);
+    for (c = 0; c < job->nchannels; c++) {
+        gather_weights(job->weights[c], job->unique, job->nunique,
+                bin_weights(buf, c));
+    }
+    timing_stop(timing, etimGEOM);
+    timing_start(timing);
+    for (a = 0; a < job->naxes; a++) {
+        bin = bin_geometry_bins(buf, job->axes[a], job->nslices);
+        for (c = 0; c < job->nchannels; c++) {
+            histogram_add_groups(accum->slDensity + (c * job->naxes + a)
+                    * job->ngroups, bin, bin_weights(buf, c), buf, invvol);
+        }
+    }
+    timing_stop(timing, etimSLAB);
+    timing_start(timing);
+    grid_store(accum->grid, buf);
+    timing_stop(timing, etimGRID);
+    timing_start(timing);
+    voxel_store(accum->voxel, buf);
+    timing_stop(timing, etimVOXEL);
+    timing_start(timing);
+    dist_store(accum->dist, x0, pbc, buf);
+    timing_stop(timing, etimDIST);
+    if (timing) {
+        for (n = 0; n < job->ngroups; n++) {
+            timing->natoms += job->gnx[n];
+        }
+    }
+    timing_start(timing);
+    dist_end_frame(accum->dist);
+    timing_stop(timing, etimDIST);
+    accum->nframes++;
+    if (timing) {
+        timing->nframes++;
+    }
+}
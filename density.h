@@ -0,0 +1,115 @@
+#ifndef _density_h
+#define _density_h
+
+#include <gromacs/macros.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/pbc.h>
+#include <gromacs/vec.h>
+#include <gromacs/rmpbc.h>
+
+#include "grid_mode.h"
+#include "voxel_mode.h"
+#include "dist_mode.h"
+#include "binning.h"
+#include "timing.h"
+
+/** Description of the analysis that does not change along the trajectory
+ *
+ * It is shared, read only, by all the threads.
+ */
+typedef struct DensityJob {
+    atom_id **index;
+    int *gnx;
+    int ngroups;
+    int nslices;
+    int axis;           /* Normal axis, the first of "axes" */
+    int naxes;          /* Number of axes with a slab profile */
+    int axes[DIM];
+    t_topology *top;
+    int ePBC;
+    gmx_bool bCenter;
+    int nchannels;      /* Number of types of density */
+    char dens[BIN_MAX_CHANNELS]; /* Type of density of each channel */
+    real **weights;     /* Contribution of each atom to the density, for
+                           each channel */
+    atom_id *unique;    /* Atoms of the analysed groups, each one once,
+                           sorted */
+    int nunique;
+    unsigned int *mask; /* Groups of each unique atom, bin_mask_words words
+                           per atom */
+    atom_id *used;      /* Atoms read by the analysis, sorted */
+    int nused;
+    gmx_bool bSelPBC;   /* Only make whole the molecules of the used atoms */
+    atom_id *whole;     /* Atoms of these molecules */
+    atom_id *whole_prev;/* Atom of the same molecule each one is placed from,
+                           -1 for the first atom of a molecule */
+    int nwhole;
+    atom_id *cindex;    /* Group to center on, NULL for the whole system */
+    int csize;
+    real cmass;         /* Total mass of the centering group */
+    gmx_bool bPrepared; /* Are the frames given to analyse_frame already made
+                           whole and centered? */
+} DensityJob;
+
+/** Number of slab profiles: one per channel, axis and group
+ *
+ * The profile of group n along the a-th axis for channel c is
+ * (c * naxes + a) * ngroups + n.
+ */
+static inline int job_nprofiles(const DensityJob *job) {
+    return job->nchannels * job->naxes * job->ngroups;
+}
+
+/** Accumulators filled by the analysis of the frames
+ *
+ * Each worker thread owns an instance, with its own copy of the slab
+ * profiles, of the grids, of the voxels, and of the distance profiles. The copies are summed
+ * into the main instance with reduce_accum once the trajectory is read.
+ *
+ * The main instance uses the grid, voxel and distance modes it was built
+ * with and does not free them; copies own theirs.
+ */
+typedef struct DensityAccum {
+    real **slDensity;   /* Slab profiles, see job_nprofiles */
+    GridHeight *grid;
+    VoxelGrid *voxel;
+    DistMode *dist;
+    int nframes;
+    gmx_rmpbc_t gpbc;
+    t_pbc *pbc;
+    BinBuffer *bins;    /* Scratch buffers for the binning of a group */
+    Timing *timing;     /* Time spent in each phase, NULL if not measured */
+    gmx_bool bCopy;
+} DensityAccum;
+
+void set_job(DensityJob *job, atom_id **index, int gnx[], int ngroups,
+        int nslices, int *axes, int naxes, t_topology *top, int ePBC,
+        gmx_bool bCenter, const char *dens, real **weights);
+
+void build_job_atoms(DensityJob *job, DistMode *dist, gmx_bool bSelPBC,
+        atom_id *cindex, int csize);
+
+void clean_job_atoms(DensityJob *job);
+
+void center_coords(DensityJob *job, matrix box, rvec x0[]);
+
+DensityAccum *build_accum(DensityJob *job, GridHeight *grid,
+        VoxelGrid *voxel, DistMode *dist, matrix box);
+
+DensityAccum *copy_accum(DensityJob *job, DensityAccum *src, matrix box);
+
+void reduce_accum(DensityJob *job, DensityAccum *dst, DensityAccum *src);
+
+void reset_accum(DensityJob *job, DensityAccum *accum);
+
+void clean_accum(DensityJob *job, DensityAccum *accum);
+
+void prepare_frame(DensityJob *job, DensityAccum *accum, rvec *x0,
+        matrix box);
+
+void analyse_frame(DensityJob *job, DensityAccum *accum, rvec *x0,
+        matrix box);
+
+#endif /* _density_h */
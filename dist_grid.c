@@ -0,0 +1,460 @@
+#include "dist_grid.h"
+
+/* Squared distance of the nodes that no reference atom can reach */
+#define GRID_INF (1e30)
+
+/** Contruct an instance of DistanceGrid
+ *
+ * Parameters :
+ *  - spacing     : the distance between the nodes, in nm, greater than 0
+ *  - masked_axis : the axis to ignore in distance calculation, -1 for none
+ *  - bInterp     : interpolate the distances between the nodes?
+ *  - nstcheck    : the number of frames between comparisons with the
+ *                  exact distances, 0 for never
+ */
+DistanceGrid *build_distance_grid(real spacing, int masked_axis,
+        gmx_bool bInterp, int nstcheck) {
+    DistanceGrid *grid;
+    int d;
+
+    if (spacing <= 0) {
+        gmx_fatal(FARGS, "Invalid distance grid spacing: %g\n", spacing);
+    }
+    snew(grid, 1);
+    grid->spacing = spacing;
+    grid->masked = masked_axis;
+    grid->bInterp = bInterp;
+    grid->nstcheck = nstcheck;
+    for (d=0; d<DIM; ++d) {
+        grid->n[d] = 1;
+        grid->h[d] = 0;
+        grid->invh[d] = 0;
+        grid->box[d] = 0;
+    }
+    grid->ntotal = 0;
+    grid->nalloc = 0;
+    grid->dist = NULL;
+    grid->line_alloc = 0;
+    grid->line = NULL;
+    grid->out = NULL;
+    grid->v = NULL;
+    grid->z = NULL;
+    grid->bEmpty = TRUE;
+    grid->bValid = FALSE;
+    grid->bCheck = FALSE;
+    snew(grid->counter, 1);
+    pthread_mutex_init(&grid->counter->lock, NULL);
+    grid->counter->nupdate = 0;
+    grid->counter->nusers = 1;
+    distance_grid_reset(grid);
+    return grid;
+}
+
+/** Contruct an empty instance of DistanceGrid for another thread
+ *
+ * The copy shares the frame counter of "src", so the comparisons are done
+ * every "nstcheck" frames whichever thread analyses them.
+ */
+DistanceGrid *copy_distance_grid(DistanceGrid *src) {
+    DistanceGrid *grid;
+
+    grid = build_distance_grid(src->spacing, src->masked, src->bInterp,
+            src->nstcheck);
+    pthread_mutex_destroy(&grid->counter->lock);
+    sfree(grid->counter);
+    grid->counter = src->counter;
+    pthread_mutex_lock(&grid->counter->lock);
+    grid->counter->nusers++;
+    pthread_mutex_unlock(&grid->counter->lock);
+    return grid;
+}
+
+/** Clean an instance of DistanceGrid
+ */
+void clean_distance_grid(DistanceGrid *grid) {
+    int nusers;
+    if (grid) {
+        pthread_mutex_lock(&grid->counter->lock);
+        nusers = --grid->counter->nusers;
+        pthread_mutex_unlock(&grid->counter->lock);
+        if (nusers == 0) {
+            pthread_mutex_destroy(&grid->counter->lock);
+            sfree(grid->counter);
+        }
+        sfree(grid->dist);
+        sfree(grid->line);
+        sfree(grid->out);
+        sfree(grid->v);
+        sfree(grid->z);
+        sfree(grid);
+    }
+}
+
+/** Tell if the grid can reproduce pbc_dx for this box
+ */
+static gmx_bool distance_grid_usable(DistanceGrid *grid, t_pbc *pbc,
+        matrix box) {
+    int d, e;
+    if (pbc == NULL) {
+        return FALSE;
+    }
+    if (pbc->ePBC != epbcXYZ &&
+            !(pbc->ePBC == epbcXY && grid->masked == ZZ)) {
+        return FALSE;
+    }
+    for (d=0; d<DIM; ++d) {
+        for (e=0; e<DIM; ++e) {
+            if (d != e && box[d][e] != 0) {
+                return FALSE;
+            }
+        }
+        if (d != grid->masked && box[d][d] <= 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* Number of nodes a line is unrolled by on each side, so that the images
+ * within half a period of any node are in the line */
+static int line_margin(int n) {
+    return n/2 + 1;
+}
+
+/** Choose the nodes for the current box
+ *
+ * The spacing is widened if the grid would have too many nodes; the frame
+ * is then counted in "nwiden".
+ */
+static void distance_grid_set_shape(DistanceGrid *grid, matrix box) {
+    int d, nmax = 0;
+    long ntotal;
+    real spacing = grid->spacing;
+
+    do {
+        ntotal = 1;
+        for (d=0; d<DIM; ++d) {
+            if (d == grid->masked) {
+                grid->n[d] = 1;
+            }
+            else {
+                grid->n[d] = (int)(box[d][d] / spacing + 0.5);
+                if (grid->n[d] < 1) {
+                    grid->n[d] = 1;
+                }
+            }
+            ntotal *= grid->n[d];
+        }
+        spacing *= 1.1;
+    } while (ntotal > GRID_MAX_TOTAL);
+    grid->ntotal = (int)ntotal;
+    if (spacing > grid->spacing * 1.1) {
+        grid->nwiden++;
+    }
+
+    for (d=0; d<DIM; ++d) {
+        if (d == grid->masked) {
+            grid->box[d] = 0;
+            grid->h[d] = 0;
+            grid->invh[d] = 0;
+        }
+        else {
+            grid->box[d] = box[d][d];
+            grid->h[d] = box[d][d] / grid->n[d];
+            grid->invh[d] = 1 / grid->h[d];
+        }
+        if (grid->h[d] > grid->hmax[d]) {
+            grid->hmax[d] = grid->h[d];
+        }
+        if (grid->n[d] > nmax) {
+            nmax = grid->n[d];
+        }
+    }
+
+    if (grid->ntotal > grid->nalloc) {
+        grid->nalloc = grid->ntotal;
+        srenew(grid->dist, grid->nalloc);
+    }
+    /* The lines are unrolled on both sides */
+    if (nmax + 2 * line_margin(nmax) > grid->line_alloc) {
+        grid->line_alloc = nmax + 2 * line_margin(nmax);
+        srenew(grid->line, grid->line_alloc);
+        srenew(grid->out, grid->line_alloc);
+        srenew(grid->v, grid->line_alloc);
+        srenew(grid->z, grid->line_alloc);
+    }
+}
+
+/** Index of the node of a coordinate along a dimension, rounded to the
+ * nearest node and wrapped in the grid
+ */
+static int node_index(DistanceGrid *grid, real value, int d) {
+    int idx;
+    if (d == grid->masked) {
+        return 0;
+    }
+    idx = (int)floor(value * grid->invh[d] + 0.5) % grid->n[d];
+    if (idx < 0) {
+        idx += grid->n[d];
+    }
+    return idx;
+}
+
+/** Squared distance transform of a periodic line of n nodes
+ *
+ * "line" holds the squared distances of the nodes before the transform,
+ * GRID_INF for the nodes with no reference, unrolled by line_margin(n)
+ * nodes on each side; the transform of the n nodes is written to "out".
+ */
+static void distance_transform_1d(DistanceGrid *grid, int n, real h) {
+    int q, p, k = -1, j, half = line_margin(n), m = n + 2*half;
+    double s = 0, h2 = (double)h * h;
+    real *f = grid->line;
+    int *v = grid->v;
+    double *z = grid->z;
+
+    for (q=0; q<m; ++q) {
+        if (f[q] >= GRID_INF) {
+            continue;
+        }
+        /* Drop the parabolas hidden by the one of q */
+        while (k >= 0) {
+            p = v[k];
+            s = ((f[q] + h2*q*q) - (f[p] + h2*p*p)) / (2*h2*(q - p));
+            if (s > z[k]) {
+                break;
+            }
+            k--;
+        }
+        k++;
+        v[k] = q;
+        z[k] = (k == 0) ? -GRID_INF : s;
+    }
+
+    if (k < 0) {
+        for (q=0; q<n; ++q) {
+            grid->out[q] = GRID_INF;
+        }
+        return;
+    }
+    for (q=half, j=0; q<half+n; ++q) {
+        while (j < k && z[j + 1] < q) {
+            j++;
+        }
+        grid->out[q - half] = h2*(q - v[j])*(q - v[j]) + f[v[j]];
+    }
+}
+
+/** Run the distance transform along one dimension of the grid
+ */
+static void distance_transform_dim(DistanceGrid *grid, int d) {
+    int stride[DIM], a, b, i, j, e, f, base, n = grid->n[d];
+    int half = line_margin(n);
+
+    stride[ZZ] = 1;
+    stride[YY] = grid->n[ZZ];
+    stride[XX] = grid->n[YY] * grid->n[ZZ];
+    /* The two other dimensions */
+    e = (d + 1) % DIM;
+    f = (d + 2) % DIM;
+    for (a=0; a<grid->n[e]; ++a) {
+        for (b=0; b<grid->n[f]; ++b) {
+            base = a * stride[e] + b * stride[f];
+            /* Node j of the unrolled line is node j - half of the grid,
+             * wrapped */
+            for (j=0, i=n-half; j<n+2*half; ++j, ++i) {
+                if (i == n) {
+                    i = 0;
+                }
+                grid->line[j] = grid->dist[base + i * stride[d]];
+            }
+            distance_transform_1d(grid, n, grid->h[d]);
+            for (i=0; i<n; ++i) {
+                grid->dist[base + i * stride[d]] = grid->out[i];
+            }
+        }
+    }
+}
+
+/** Put the reference group on the grid and compute the distance transform
+ *
+ * Must be called at each frame, after the molecules have been made whole and
+ * centered, before any call to distance_grid_lookup. Returns "bValid":
+ * FALSE if the box can not be handled.
+ */
+gmx_bool distance_grid_update(DistanceGrid *grid, t_pbc *pbc, matrix box,
+        atom_id *index, int size, rvec *x) {
+    int i, d, c;
+
+    grid->nframes++;
+    grid->bValid = FALSE;
+    grid->bCheck = FALSE;
+    if (grid->nstcheck > 0) {
+        pthread_mutex_lock(&grid->counter->lock);
+        grid->bCheck = (grid->counter->nupdate % grid->nstcheck == 0);
+        grid->counter->nupdate++;
+        pthread_mutex_unlock(&grid->counter->lock);
+    }
+    if (!distance_grid_usable(grid, pbc, box)) {
+        grid->nexact++;
+        return FALSE;
+    }
+    distance_grid_set_shape(grid, box);
+
+    for (c=0; c<grid->ntotal; ++c) {
+        grid->dist[c] = GRID_INF;
+    }
+    for (i=0; i<size; ++i) {
+        c = (node_index(grid, x[index[i]][XX], XX) * grid->n[YY]
+                + node_index(grid, x[index[i]][YY], YY)) * grid->n[ZZ]
+            + node_index(grid, x[index[i]][ZZ], ZZ);
+        grid->dist[c] = 0;
+    }
+    grid->bEmpty = (size == 0);
+    for (d=0; d<DIM && !grid->bEmpty; ++d) {
+        if (d != grid->masked && grid->n[d] > 1) {
+            distance_transform_dim(grid, d);
+        }
+    }
+    for (c=0; c<grid->ntotal; ++c) {
+        grid->dist[c] = sqrt(grid->dist[c]);
+    }
+    grid->bValid = TRUE;
+    if (distance_grid_check_frame(grid)) {
+        grid->ncheck++;
+    }
+    return TRUE;
+}
+
+/** Tell if the distances of the current frame have to be compared with the
+ * exact ones
+ */
+gmx_bool distance_grid_check_frame(DistanceGrid *grid) {
+    return grid->bValid && grid->bCheck;
+}
+
+/** Get the approximate distance between a point and the reference group
+ *
+ * The distance of the nearest node, or the trilinear interpolation of the
+ * distances of the nodes around the point. Returns GMX_REAL_MAX if the
+ * reference group is empty.
+ */
+real distance_grid_lookup(DistanceGrid *grid, rvec point) {
+    int d, c, corner, i0[DIM], i1[DIM], idx[DIM];
+    real u, t[DIM], w, value = 0;
+
+    if (grid->bEmpty) {
+        return GMX_REAL_MAX;
+    }
+    if (!grid->bInterp) {
+        c = (node_index(grid, point[XX], XX) * grid->n[YY]
+                + node_index(grid, point[YY], YY)) * grid->n[ZZ]
+            + node_index(grid, point[ZZ], ZZ);
+        return grid->dist[c];
+    }
+    for (d=0; d<DIM; ++d) {
+        if (d == grid->masked) {
+            i0[d] = 0;
+            i1[d] = 0;
+            t[d] = 0;
+            continue;
+        }
+        u = point[d] * grid->invh[d];
+        i0[d] = (int)floor(u);
+        t[d] = u - i0[d];
+        i0[d] %= grid->n[d];
+        if (i0[d] < 0) {
+            i0[d] += grid->n[d];
+        }
+        i1[d] = (i0[d] + 1) % grid->n[d];
+    }
+    for (corner=0; corner<8; ++corner) {
+        w = 1;
+        for (d=0; d<DIM; ++d) {
+            if (corner & (1 << d)) {
+                idx[d] = i1[d];
+                w *= t[d];
+            }
+            else {
+                idx[d] = i0[d];
+                w *= 1 - t[d];
+            }
+        }
+        if (w != 0) {
+            value += w * grid->dist[(idx[XX] * grid->n[YY] + idx[YY])
+                * grid->n[ZZ] + idx[ZZ]];
+        }
+    }
+    return value;
+}
+
+/** Add the error of an approximate distance to the statistics
+ *
+ * Only the atoms that fall in a shell, with either distance below
+ * "max_dist", are counted. "width" is the width of the shells.
+ */
+void distance_grid_compare(DistanceGrid *grid, real approx, real exact,
+        real width, real max_dist) {
+    double err;
+
+    if (approx >= max_dist && exact >= max_dist) {
+        return;
+    }
+    err = fabs((double)approx - exact);
+    grid->nerr += 1;
+    grid->sum_err += err;
+    grid->sum_err2 += err*err;
+    if (err > grid->max_err) {
+        grid->max_err = err;
+    }
+    if (approx >= max_dist || exact >= max_dist
+            || (int)(approx / width) != (int)(exact / width)) {
+        grid->nshell += 1;
+    }
+}
+
+/** Add the frame counts and the error statistics of "src" to "dst"
+ */
+void distance_grid_reduce(DistanceGrid *dst, DistanceGrid *src) {
+    int d;
+    if (dst && src) {
+        dst->nframes += src->nframes;
+        dst->nexact += src->nexact;
+        dst->nwiden += src->nwiden;
+        for (d=0; d<DIM; ++d) {
+            if (src->hmax[d] > dst->hmax[d]) {
+                dst->hmax[d] = src->hmax[d];
+            }
+        }
+        dst->ncheck += src->ncheck;
+        dst->nerr += src->nerr;
+        dst->sum_err += src->sum_err;
+        dst->sum_err2 += src->sum_err2;
+        if (src->max_err > dst->max_err) {
+            dst->max_err = src->max_err;
+        }
+        dst->nshell += src->nshell;
+    }
+}
+
+/** Set the frame counts and the error statistics back to zero
+ *
+ * The comparisons keep their pace across the resets.
+ */
+void distance_grid_reset(DistanceGrid *grid) {
+    int d;
+    if (grid) {
+        grid->nframes = 0;
+        grid->nexact = 0;
+        grid->nwiden = 0;
+        for (d=0; d<DIM; ++d) {
+            grid->hmax[d] = 0;
+        }
+        grid->ncheck = 0;
+        grid->nerr = 0;
+        grid->sum_err = 0;
+        grid->sum_err2 = 0;
+        grid->max_err = 0;
+        grid->nshell = 0;
+    }
+}
@@ -0,0 +1,107 @@
+#ifndef _dist_grid_h
+#define _dist_grid_h
+
+#include <math.h>
+#include <pthread.h>
+
+#include <gromacs/macros.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/pbc.h>
+#include <gromacs/vec.h>
+
+/* Upper bound on the number of nodes to keep the memory footprint sane */
+#define GRID_MAX_TOTAL (1 << 24)
+
+/** Number of frames seen by a distance grid and its copies
+ *
+ * The copies of the worker threads share it, so the comparisons with the
+ * exact distances follow the frames of the whole run.
+ */
+typedef struct GridFrameCounter {
+    pthread_mutex_t lock;
+    int nupdate;        /* Frames seen since the construction */
+    int nusers;         /* Grids sharing the counter */
+} GridFrameCounter;
+
+/** Approximate distance to a reference group, tabulated on a periodic grid
+ *
+ * At each frame, the reference atoms are put on the nearest node of a
+ * regular grid spanning the box, and the Euclidean distance transform of
+ * the grid gives, for every node, the exact distance to the nearest of these
+ * nodes. The transform is separable: one pass of the lower envelope of
+ * parabolas of Felzenszwalb and Huttenlocher per dimension, in time linear
+ * in the number of nodes. The distance of an atom is then read from the
+ * node closest to it, or interpolated between the nodes around it.
+ *
+ * Putting the references on the nodes shifts them by up to half the
+ * diagonal of a grid cell, so the spacing sets the accuracy: the error on a
+ * distance is at most of that order. When the box is so large that the grid
+ * would have more than 2^24 nodes, the spacing is widened for that frame;
+ * those frames and the actual spacing are counted for the report. The axis
+ * given as "masked" is ignored,
+ * as make_2D does it for min_dist; there is only one node along that axis.
+ *
+ * Like the cell list, the grid only handles rectangular boxes that are
+ * periodic along all the dimensions used for the distance. When it is not
+ * the case, "bValid" is FALSE and the caller must use an exact search. The
+ * approximate distances can be compared with the exact ones every
+ * "nstcheck" frames of the run, counted over the grid and all its copies;
+ * the statistics of the errors are accumulated.
+ */
+typedef struct DistanceGrid {
+    real spacing;       /* Requested spacing of the nodes */
+    int masked;         /* Axis to ignore, -1 to use the 3 dimensions */
+    gmx_bool bInterp;   /* Interpolate between the nodes? */
+    int nstcheck;       /* Frames between comparisons, 0 for never */
+    int n[DIM];         /* Number of nodes along each dimension */
+    real h[DIM];        /* Actual spacing along each dimension */
+    real invh[DIM];
+    real box[DIM];      /* Box length along each dimension */
+    int ntotal;         /* Total number of nodes */
+    int nalloc;
+    real *dist;         /* Distance of each node to the reference nodes */
+    int line_alloc;
+    real *line;         /* Squared distances along a line of nodes */
+    real *out;
+    int *v;             /* Nodes of the lower envelope of a line */
+    double *z;          /* Bounds of the parabolas of the envelope */
+    gmx_bool bEmpty;    /* No reference atom on the grid */
+    gmx_bool bValid;
+    GridFrameCounter *counter;  /* Frames seen, for the comparisons */
+    gmx_bool bCheck;    /* Is the current frame compared? */
+    int nframes;        /* Number of frames seen */
+    int nexact;         /* Frames where the grid could not be used */
+    int nwiden;         /* Frames where the spacing had to be widened */
+    real hmax[DIM];     /* Largest actual spacing along each dimension */
+    int ncheck;         /* Frames compared with the exact distances */
+    double nerr;        /* Atoms compared */
+    double sum_err;     /* Sum of the absolute errors */
+    double sum_err2;    /* Sum of the squared errors */
+    double max_err;     /* Largest absolute error */
+    double nshell;      /* Atoms binned in another shell */
+} DistanceGrid;
+
+DistanceGrid *build_distance_grid(real spacing, int masked_axis,
+        gmx_bool bInterp, int nstcheck);
+
+DistanceGrid *copy_distance_grid(DistanceGrid *src);
+
+void clean_distance_grid(DistanceGrid *grid);
+
+gmx_bool distance_grid_update(DistanceGrid *grid, t_pbc *pbc, matrix box,
+        atom_id *index, int size, rvec *x);
+
+gmx_bool distance_grid_check_frame(DistanceGrid *grid);
+
+real distance_grid_lookup(DistanceGrid *grid, rvec point);
+
+void distance_grid_compare(DistanceGrid *grid, real approx, real exact,
+        real width, real max_dist);
+
+void distance_grid_reduce(DistanceGrid *dst, DistanceGrid *src);
+
+void distance_grid_reset(DistanceGrid *grid);
+
+#endif /* _dist_grid_h */
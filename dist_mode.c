@@ -1,4 +1,6 @@
 #include "dist_mode.h"
+#include "grid_mode.h"
+
 /** Calculate the minimum function between an atom and a set of atoms
  *
  * Parameters :
@@ -38,15 +40,22 @@ real _min_distance(int idx_fix, int nmobile, rvec *x, atom_id *index,
     return rd_min;
 }
 
-DistMode *build_dist(int length, int normal_axis, int ngroups, char dens,
-        const char *dist_fn, output_env_t oenv,
-        const char *index_fn, t_topology *top, const char **legend,
-        gmx_bool b3D, gmx_bool bCOM) {
+/** Contruct an instance of DistMode around a given reference group
+ *
+ * The instance takes ownership of "ref_index". It has no output file, so
+ * dist_end can not be called on it; build_dist opens one. With a "skin"
+ * greater than 0, the minimum distances are computed from Verlet lists
+ * kept across frames (see VerletList). With an "edt_spacing" greater than
+ * 0, they are approximated from a distance transform on a grid of that
+ * spacing instead (see DistanceGrid), interpolated if "bEdtInterp" is set,
+ * and compared with the exact ones every "nstedtcheck" frames.
+ */
+DistMode *build_dist_ref(int length, int normal_axis, int ngroups,
+        const char *dens, atom_id *ref_index, int ref_size, t_topology *top,
+        gmx_bool b3D, gmx_bool bCOM, real skin, real edt_spacing,
+        gmx_bool bEdtInterp, int nstedtcheck) {
     DistMode *dist_store;
-    int prof, i;
-    atom_id **index;
-    int *isize;
-    char **grpnames;
+    int prof, i, c;
 
     /* Check dimensions */
     if (length <= 0) {
@@ -55,6 +64,10 @@ DistMode *build_dist(int length, int normal_axis, int ngroups, char dens,
                 length);
         exit(1);
     }
+    if (strlen(dens) == 0 || strlen(dens) > BIN_MAX_CHANNELS) {
+        gmx_fatal(FARGS, "Invalid number of density types: %d\n",
+                (int)strlen(dens));
+    }
 
     /* Allocate empty structure */
     snew(dist_store, 1);
@@ -75,133 +88,476 @@ DistMode *build_dist(int length, int normal_axis, int ngroups, char dens,
     dist_store->ngroups = ngroups;
     dist_store->max_dist = 0;
     dist_store->height = 0;
-    dist_store->dens = dens;
+    dist_store->nchannels = strlen(dens);
+    for (c=0; c<dist_store->nchannels; ++c) {
+        dist_store->dens[c] = dens[c];
+    }
     dist_store->b3D = b3D;
 
     /* Allocate the profiles */
-    snew(dist_store->data, ngroups);
-    for (prof = 0; prof < ngroups; ++prof) {
+    snew(dist_store->data, dist_nprofiles(dist_store));
+    snew(dist_store->frame, dist_nprofiles(dist_store));
+    for (prof = 0; prof < dist_nprofiles(dist_store); ++prof) {
         snew(dist_store->data[prof], length);
+        snew(dist_store->frame[prof], length);
         for (i=0; i<length; ++i) {
             dist_store->data[prof][i] = 0;
         }
     }
+    snew(dist_store->invvol, length);
 
-    /* Get the reference group index */
-    snew(index, 1);
-    snew(isize, 1);
-    snew(grpnames, 1);
-    printf("Select reference group for distance calcultation:\n");
-    get_index(&(top->atoms), index_fn, 1, isize,index,grpnames);
-    dist_store->ref_index = index[0];
-    dist_store->ref_size = isize[0];
+    dist_store->ref_index = ref_index;
+    dist_store->ref_size = ref_size;
 
-    dist_store->com = NULL;
+    clear_rvec(dist_store->com);
     dist_store->ref_mass = 0;
     dist_store->bCOM = bCOM;
     if (bCOM) {
-        dist_store->ref_mass = get_mass(index[0], isize[0], top);
+        dist_store->ref_mass = get_mass(ref_index, ref_size, top);
+    }
+    dist_store->cells = NULL;
+    dist_store->verlet = NULL;
+    dist_store->edt = NULL;
+    if (!bCOM) {
+        dist_store->cells = build_cell_list(dist_store->axis[1]);
+        if (edt_spacing > 0) {
+            dist_store->edt = build_distance_grid(edt_spacing,
+                    dist_store->axis[1], bEdtInterp, nstedtcheck);
+        }
+        else if (skin > 0) {
+            dist_store->verlet = build_verlet_list(skin,
+                    dist_store->axis[1]);
+        }
+    }
+    for (c=0; c<BIN_MAX_CHANNELS; ++c) {
+        dist_store->out_dist[c] = NULL;
     }
+    dist_store->next = NULL;
+    return dist_store;
+}
+
+/** Build the output file name of a reference group
+ *
+ * With a single reference the name is kept, else the index of the reference
+ * is added before the extension: density_dist.xvg gives density_dist_1.xvg,
+ * density_dist_2.xvg...
+ */
+char *dist_ref_fn(const char *dist_fn, int ref, int nref) {
+    char suffix[16];
+
+    sprintf(suffix, "%d", ref + 1);
+    return output_fn(dist_fn, nref == 1 ? NULL : suffix);
+}
+
+/** Contruct the distance modes of one or several reference groups
+ *
+ * The reference groups are asked for at once; one instance of DistMode is
+ * built for each of them, chained through their "next" field, and each one
+ * writes its own output file (see dist_ref_fn). All the functions working on
+ * a DistMode work on the whole chain, so the frames are read once whatever
+ * the number of references. With several types of density, each one has its
+ * own files, named by dens_output_fn before the reference is added.
+ */
+DistMode *build_dist(int length, int normal_axis, int ngroups,
+        const char *dens,
+        const char *dist_fn, output_env_t oenv,
+        const char *index_fn, t_topology *top, const char **legend,
+        gmx_bool b3D, gmx_bool bCOM, int nref, real skin, real edt_spacing,
+        gmx_bool bEdtInterp, int nstedtcheck) {
+    DistMode *first = NULL, *last = NULL, *dist_store;
+    atom_id **index;
+    int *isize;
+    char **grpnames;
+    char *dens_fn, *fn, title[STRLEN];
+    int ref, c;
 
-    /* Open the output file */
-    dist_store->out_dist = xvgropen(dist_fn,"Density",
-            "Distance from Protein (nm)","Density (kg/m^3)",oenv);
-    xvgr_legend(dist_store->out_dist, dist_store->ngroups, legend, oenv);
+    if (nref <= 0) {
+        gmx_fatal(FARGS, "Invalid number of reference groups: %d\n", nref);
+    }
+
+    /* Get the reference group indices */
+    snew(index, nref);
+    snew(isize, nref);
+    snew(grpnames, nref);
+    printf("Select %d reference group(s) for distance calcultation:\n",
+            nref);
+    get_index(&(top->atoms), index_fn, nref, isize, index, grpnames);
+
+    for (ref=0; ref<nref; ++ref) {
+        dist_store = build_dist_ref(length, normal_axis, ngroups, dens,
+                index[ref], isize[ref], top, b3D, bCOM, skin, edt_spacing,
+                bEdtInterp, nstedtcheck);
+        /* Open the output files */
+        snprintf(title, STRLEN, "Distance from %s (nm)", grpnames[ref]);
+        for (c=0; c<dist_store->nchannels; ++c) {
+            dens_fn = dens_output_fn(dist_fn, dens[c], dist_store->nchannels);
+            fn = dist_ref_fn(dens_fn, ref, nref);
+            dist_store->out_dist[c] = xvgropen(fn, "Density", title,
+                    dens_ylabel(dens[c]), oenv);
+            xvgr_legend(dist_store->out_dist[c], dist_store->ngroups, legend,
+                    oenv);
+            sfree(fn);
+            sfree(dens_fn);
+        }
+        if (last) {
+            last->next = dist_store;
+        }
+        else {
+            first = dist_store;
+        }
+        last = dist_store;
+    }
+    sfree(index);
+    sfree(isize);
+    sfree(grpnames);
+    return first;
+}
+
+/** Contruct an empty instance of DistMode shaped like "src"
+ *
+ * The copy has no output file; it is meant to be summed back into "src" with
+ * dist_reduce. The other references of the chain are copied too. Returns
+ * NULL if "src" is NULL.
+ */
+DistMode *copy_dist(DistMode *src) {
+    DistMode *dist_store;
+    int prof, i, c;
+
+    if (src == NULL) {
+        return NULL;
+    }
+    snew(dist_store, 1);
+    *dist_store = *src;
+    dist_store->nframes = 0;
+    dist_store->box_width = 0.0;
+    for (c=0; c<BIN_MAX_CHANNELS; ++c) {
+        dist_store->out_dist[c] = NULL;
+    }
+    snew(dist_store->data, dist_nprofiles(src));
+    snew(dist_store->frame, dist_nprofiles(src));
+    for (prof = 0; prof < dist_nprofiles(src); ++prof) {
+        snew(dist_store->data[prof], src->length);
+        snew(dist_store->frame[prof], src->length);
+    }
+    snew(dist_store->invvol, src->length);
+    snew(dist_store->ref_index, src->ref_size);
+    for (i=0; i<src->ref_size; ++i) {
+        dist_store->ref_index[i] = src->ref_index[i];
+    }
+    dist_store->cells = NULL;
+    if (src->cells) {
+        dist_store->cells = build_cell_list(src->axis[1]);
+    }
+    dist_store->verlet = NULL;
+    if (src->verlet) {
+        dist_store->verlet = build_verlet_list(src->verlet->skin,
+                src->axis[1]);
+    }
+    dist_store->edt = NULL;
+    if (src->edt) {
+        dist_store->edt = copy_distance_grid(src->edt);
+    }
+    dist_store->next = copy_dist(src->next);
     return dist_store;
 }
 
 void clean_dist(DistMode *dist_store) {
-    int prof = 0;
+    int prof = 0, c;
     if (dist_store) {
-        for (prof = 0; prof < dist_store->ngroups; ++prof) {
+        for (prof = 0; prof < dist_nprofiles(dist_store); ++prof) {
             sfree(dist_store->data[prof]);
+            sfree(dist_store->frame[prof]);
         }
         sfree(dist_store->data);
+        sfree(dist_store->frame);
+        sfree(dist_store->invvol);
         sfree(dist_store->ref_index);
-        fclose(dist_store->out_dist);
+        clean_cell_list(dist_store->cells);
+        clean_verlet_list(dist_store->verlet);
+        clean_distance_grid(dist_store->edt);
+        for (c=0; c<BIN_MAX_CHANNELS; ++c) {
+            if (dist_store->out_dist[c]) {
+                fclose(dist_store->out_dist[c]);
+            }
+        }
+        clean_dist(dist_store->next);
         sfree(dist_store);
     }
 }
 
+/** Add the profiles, the frame count, the box widths, the Verlet list
+ * build counts and the distance grid statistics of "src" to "dst"
+ */
+void dist_reduce(DistMode *dst, DistMode *src) {
+    int prof, i;
+    for (; dst && src; dst = dst->next, src = src->next) {
+        for (prof = 0; prof < dist_nprofiles(dst); ++prof) {
+            for (i = 0; i < dst->length; ++i) {
+                dst->data[prof][i] += src->data[prof][i];
+            }
+        }
+        dst->nframes += src->nframes;
+        dst->box_width += src->box_width;
+        verlet_list_reduce(dst->verlet, src->verlet);
+        distance_grid_reduce(dst->edt, src->edt);
+    }
+}
+
+/** Set the profiles, the frame count, the box widths, the Verlet list
+ * build counts and the distance grid statistics of a chain back to zero
+ *
+ * The Verlet lists themselves are kept for the next frames.
+ */
+void reset_dist(DistMode *dist_store) {
+    int prof;
+    for (; dist_store; dist_store = dist_store->next) {
+        for (prof = 0; prof < dist_nprofiles(dist_store); ++prof) {
+            memset(dist_store->data[prof], 0,
+                    dist_store->length * sizeof(real));
+        }
+        dist_store->nframes = 0;
+        dist_store->box_width = 0.0;
+        verlet_list_reset(dist_store->verlet);
+        distance_grid_reset(dist_store->edt);
+    }
+}
+
+/** Prepare the distance mode for a new frame
+ *
+ * Sets the maximum distance and the volume of each shell from the box, and
+ * the reference positions (center of mass or cell list) from the
+ * coordinates. The shells are the same for all the references of a chain,
+ * they are computed once. With a Verlet list or a distance grid, the cell
+ * list is only updated by dist_store, when it needs it.
+ */
 void dist_start_frame(DistMode *dist_store, matrix box, rvec *x,
-        t_topology *top) {
+        t_topology *top, t_pbc *pbc) {
+    DistMode *first = dist_store;
     int i = 0;
     real max_dist = INT_MAX;
-    if (dist_store) {
+    double r1, r2 = 0, vslice;
+    if (first) {
         /* Find what the maximum distance is */
         for (i=0; i<DIM; ++i) {
-            if ((dist_store->b3D || i != dist_store->axis[0]) 
+            if ((first->b3D || i != first->axis[0]) 
                     && box[i][i]/2 < max_dist) {
                 max_dist = box[i][i]/2;
             }
         }
+        first->height = box[first->axis[0]][first->axis[0]];
+        for (i=0; i<first->length; ++i) {
+            r1 = r2;
+            r2 = max_dist * ((double)(i + 1) / first->length);
+            if (first->b3D)
+                vslice = (4.0/3.0) * PI  * (r2*r2*r2 - r1*r1*r1);
+            else
+                vslice = first->height * PI * (r2*r2 - r1*r1);
+            first->invvol[i] = 1/vslice;
+        }
+    }
+    for (; dist_store; dist_store = dist_store->next) {
         dist_store->nframes += 1;
         dist_store->width = max_dist/dist_store->length;
         dist_store->box_width += max_dist;
         dist_store->max_dist = max_dist;
-        dist_store->height = box[dist_store->axis[0]][dist_store->axis[0]];
+        dist_store->height = first->height;
+        if (dist_store != first) {
+            memcpy(dist_store->invvol, first->invvol,
+                    first->length * sizeof(real));
+        }
         if (dist_store->bCOM) {
-            dist_store->com = center_of_mass(dist_store->ref_index, 
-                    dist_store->ref_size, x, top, dist_store->ref_mass);
-            make_2D(*dist_store->com, dist_store->axis[1], *dist_store->com);
+            center_of_mass(dist_store->ref_index, dist_store->ref_size, x,
+                    top, dist_store->ref_mass, pbc, dist_store->com);
+            make_2D(dist_store->com, dist_store->axis[1], dist_store->com);
+        }
+        else if (dist_store->verlet == NULL && dist_store->edt == NULL) {
+            cell_list_update(dist_store->cells, pbc, box,
+                    dist_store->ref_index, dist_store->ref_size, x);
         }
     }
 }
 
-void dist_store(DistMode *dist, int group, int atom, rvec *x, t_pbc *pbc,
-        real mass) {
-    int slice = 0;
-    int i = 0;
+/** Minimum distance between a point and the reference group, from the cell
+ * list when it is valid for the frame, by brute force otherwise
+ *
+ * The cell list stops searching past "max_dist".
+ */
+static real exact_min_dist(DistMode *dist, rvec point, rvec *x, t_pbc *pbc,
+        real max_dist) {
+    if (dist->cells->bValid) {
+        return cell_list_min_dist(dist->cells, point, max_dist);
+    }
+    return min_dist(point, dist->ref_index, dist->ref_size, x, pbc,
+            dist->axis[1]);
+}
+
+/** Add the atoms of the frame to the distance profiles of their groups,
+ * one per channel
+ *
+ * The distance of an atom and its bin are computed once, from the
+ * coordinates gathered in the geometry of the frame, for all the channels
+ * and all the groups the atom belongs to.
+ * Parameters :
+ *  - dist  : the distance mode, nothing is done if it is NULL
+ *  - x     : the coordinates of all the atoms, for the references
+ *  - pbc   : the periodic box
+ *  - buf   : scratch buffers, with the geometry and the weights of the
+ *            atoms
+ */
+void dist_store(DistMode *dist, rvec *x, t_pbc *pbc, BinBuffer *buf) {
+    int i = 0, c, n = buf->n;
     rvec pointA;
-    real distance = 0;
-    real vslice = 0;
-    real r1 = 0, r2 = 0;
-    real height = 0;
-    if (dist) {
-        height = dist->height;
-        if (dist->bCOM) {
-            make_2D(x[atom], dist->axis[1], pointA);
-            distance = get_distance(pointA, *dist->com, pbc);
+    gmx_bool bGrid, bCheck;
+    for (; dist; dist = dist->next) {
+        bGrid = FALSE;
+        bCheck = FALSE;
+        if (dist->edt) {
+            bGrid = distance_grid_update(dist->edt, pbc, buf->box,
+                    dist->ref_index, dist->ref_size, x);
+            bCheck = distance_grid_check_frame(dist->edt);
+            /* The exact search is the fallback and the reference */
+            if (!bGrid || bCheck) {
+                cell_list_update(dist->cells, pbc, buf->box,
+                        dist->ref_index, dist->ref_size, x);
+            }
         }
-        else {
-            distance = min_dist(x[atom], dist->ref_index, dist->ref_size, x,
-                    pbc, dist->axis[1]);
-        }
-        slice = distance/dist->width;
-        if (slice < dist->length) {
-            r1 = dist->max_dist * ((float)slice / (float)dist->length);
-            r2 = dist->max_dist * ((float)(slice + 1) / (float)dist->length);
-            if (dist->b3D)
-                vslice = (4.0/3.0) * PI  * (r2*r2*r2 - r1*r1*r1);
-            else
-                vslice = height * PI * (r2*r2 - r1*r1);
-            /*printf("1/vslice: %f, r1: %f, r2: %f, height: %f, vol: %f\n", 1/vslice, r1, r2, height, vslice);*/
-            /*printf("mass: %f\n", mass);*/
-            /*printf("slice: %d, vslice: %f\n", slice, vslice);*/
-            dist->data[group][slice] += mass/vslice;
-            /*dist->data[group][slice] += 1;*/
+        else if (dist->verlet) {
+            verlet_list_update(dist->verlet, buf->x, n, dist->ref_index,
+                    dist->ref_size, x, dist->cells, pbc, buf->box,
+                    dist->max_dist);
+        }
+        for (i=0; i<n; ++i) {
+            if (dist->bCOM) {
+                make_2D(buf->x[i], dist->axis[1], pointA);
+                buf->coord[i] = get_distance(pointA, dist->com, pbc);
+            }
+            else if (bGrid) {
+                buf->coord[i] = distance_grid_lookup(dist->edt, buf->x[i]);
+                if (bCheck) {
+                    distance_grid_compare(dist->edt, buf->coord[i],
+                            exact_min_dist(dist, buf->x[i], x, pbc,
+                                GMX_REAL_MAX),
+                            dist->width, dist->max_dist);
+                }
+            }
+            else if (dist->verlet) {
+                buf->coord[i] = verlet_list_min_dist(dist->verlet, i,
+                        buf->x[i], dist->ref_index, x, pbc);
+            }
+            else {
+                /* The cell list gives up beyond max_dist, such atoms fall
+                 * after the last slice anyway */
+                buf->coord[i] = exact_min_dist(dist, buf->x[i], x, pbc,
+                        dist->max_dist);
+            }
+        }
+        linear_bins(buf->coord, n, 1/dist->width, dist->length, buf->bin);
+        /* The shell volumes are applied once per frame by dist_end_frame */
+        for (c=0; c<dist->nchannels; ++c) {
+            histogram_add_groups(dist->frame + c * dist->ngroups, buf->bin,
+                    bin_weights(buf, c), buf, 1.0);
+        }
+    }
+}
+
+/** Add the raw sums of the current frame, divided by the shell volumes, to
+ * the profiles
+ */
+void dist_end_frame(DistMode *dist_store) {
+    int group, i;
+    real *frame;
+    for (; dist_store; dist_store = dist_store->next) {
+        for (group=0; group < dist_nprofiles(dist_store); ++group) {
+            frame = dist_store->frame[group];
+            for (i=0; i<dist_store->length; ++i) {
+                dist_store->data[group][i] += frame[i]*dist_store->invvol[i];
+                frame[i] = 0;
+            }
         }
     }
 }
 
 void dist_end(DistMode *dist_store) {
-    if (dist_store) {
-        int i, group;
+    for (; dist_store; dist_store = dist_store->next) {
+        int i, group, c;
         real bin_size = 0;
+        real *data;
+        FILE *out;
         dist_store->box_width /= dist_store->nframes;
         bin_size = dist_store->box_width/dist_store->length;
-        /* Write the output */
-        for (i=0; i<dist_store->length; ++i) {
-            fprintf(dist_store->out_dist, "%7.3f", i*bin_size);
-            for (group=0; group < dist_store->ngroups; ++group) {
-                dist_store->data[group][i] /= dist_store->nframes;
-                if (dist_store->dens == 'm') {
-                    dist_store->data[group][i] *= AMU/(NANO*NANO*NANO);
+        /* Write the output of each channel */
+        for (c=0; c<dist_store->nchannels; ++c) {
+            out = dist_store->out_dist[c];
+            for (i=0; i<dist_store->length; ++i) {
+                fprintf(out, "%7.3f", i*bin_size);
+                for (group=0; group < dist_store->ngroups; ++group) {
+                    data = dist_store->data[c * dist_store->ngroups + group];
+                    data[i] /= dist_store->nframes;
+                    if (dist_store->dens[c] == 'm') {
+                        data[i] *= AMU/(NANO*NANO*NANO);
+                    }
+                    fprintf(out, "\t%7.3f", data[i]);
+                }
+                fprintf(out, "\n");
+            }
+        }
+    }
+}
+
+/** Print how often the Verlet lists of a chain were built, and the errors
+ * of the distance grids
+ *
+ * Nothing is printed without Verlet lists or distance grids, or without
+ * frames.
+ */
+void dist_report(DistMode *dist_store, FILE *fp) {
+    VerletList *list;
+    DistanceGrid *grid;
+    int ref, d;
+    const char *sep;
+    for (ref = 1; dist_store; dist_store = dist_store->next, ++ref) {
+        grid = dist_store->edt;
+        if (grid && grid->nframes > 0) {
+            /* The actual spacing follows the box, the largest one sets the
+             * accuracy */
+            fprintf(fp, "Reference %d: distances read from a grid of spacing "
+                    "up to ", ref);
+            sep = "";
+            for (d=0; d<DIM; ++d) {
+                if (d != grid->masked) {
+                    fprintf(fp, "%s%.4g", sep, grid->hmax[d]);
+                    sep = " x ";
                 }
-                fprintf(dist_store->out_dist, "\t%7.3f",
-                        dist_store->data[group][i]);
             }
-            fprintf(dist_store->out_dist, "\n");
+            fprintf(fp, " nm on %d frames", grid->nframes - grid->nexact);
+            if (grid->nexact > 0) {
+                fprintf(fp, ", searched exactly on %d frames with a box the "
+                        "grid does not handle", grid->nexact);
+            }
+            fprintf(fp, "\n");
+            if (grid->nwiden > 0) {
+                fprintf(fp, "WARNING: the grid of %g nm would have more than "
+                        "%d nodes on %d frames, its spacing was widened; the "
+                        "distances are less accurate\n", grid->spacing,
+                        GRID_MAX_TOTAL, grid->nwiden);
+            }
+            if (grid->nerr > 0) {
+                fprintf(fp, "Reference %d: compared with the exact distances "
+                        "on %d frames: mean error %.4f nm, RMS %.4f nm, "
+                        "max %.4f nm, %.2f%% of the atoms in another shell\n",
+                        ref, grid->ncheck, grid->sum_err / grid->nerr,
+                        sqrt(grid->sum_err2 / grid->nerr), grid->max_err,
+                        100.0 * grid->nshell / grid->nerr);
+            }
+        }
+        list = dist_store->verlet;
+        if (list == NULL || list->nupdate == 0) {
+            continue;
         }
+        fprintf(fp, "Reference %d: Verlet lists built %d times in %d frames "
+                "(%.1f%%), %.1f candidates per atom\n", ref, list->nrebuild,
+                list->nupdate, 100.0 * list->nrebuild / list->nupdate,
+                list->natoms_sum > 0 ?
+                list->ncand_sum / list->natoms_sum : 0.0);
     }
 }
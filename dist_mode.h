@@ -2,6 +2,7 @@
 #define _dist_mode_h
 
 #include <math.h>
+#include <string.h>
 
 #include <gromacs/statutil.h>
 #include <gromacs/macros.h>
@@ -14,19 +15,33 @@
 #include <gromacs/physics.h>
 
 #include "distances.h"
+#include "cell_list.h"
+#include "verlet_list.h"
+#include "dist_grid.h"
+#include "binning.h"
+#include "output_names.h"
 
 #define PI (3.141592653589793)
 
+/** Density profiles as a function of the distance to a reference group
+ *
+ * There is one profile per group and per channel, that is per type of
+ * density; the profile of channel c of group n is profile c * ngroups + n,
+ * and each channel is written to its own output.
+ */
 typedef struct DistMode {
     real **data;    
+    real **frame;   /* Raw sums of the current frame */
+    real *invvol;   /* Inverse volume of each shell for the current frame */
     int  length;
-    FILE *out_dist;
+    FILE *out_dist[BIN_MAX_CHANNELS]; /* Output of each channel */
     real width;
     int axis[2];
     real box_width;
     int nframes;
     int ngroups;
-    char dens;
+    int nchannels;
+    char dens[BIN_MAX_CHANNELS]; /* Type of density of each channel */
     atom_id *ref_index;
     int ref_size;
     real max_dist;
@@ -34,24 +49,51 @@ typedef struct DistMode {
     gmx_bool b3D;
     gmx_bool bCOM;
     real ref_mass;
-    rvec *com;
+    rvec com;       /* Center of mass of the reference, in the plane in 2D */
+    CellList *cells;
+    VerletList *verlet;     /* Candidates kept across frames, or NULL */
+    DistanceGrid *edt;      /* Approximate distances, or NULL */
+    struct DistMode *next;  /* Mode of the next reference group, or NULL */
 } DistMode; 
 
-DistMode *build_dist(int length, int normal_axis, int ngroups, char dens,
+/** Number of profiles, for all the groups and channels
+ */
+static inline int dist_nprofiles(const DistMode *dist) {
+    return dist->nchannels * dist->ngroups;
+}
+
+char *dist_ref_fn(const char *dist_fn, int ref, int nref);
+
+DistMode *build_dist_ref(int length, int normal_axis, int ngroups,
+        const char *dens,
+        atom_id *ref_index, int ref_size, t_topology *top,
+        gmx_bool b3D, gmx_bool bCOM, real skin, real edt_spacing,
+        gmx_bool bEdtInterp, int nstedtcheck);
+
+DistMode *build_dist(int length, int normal_axis, int ngroups,
+        const char *dens,
         const char *dist_fn, output_env_t oenv,
         const char *index_fn, t_topology *top, const char **legend,
-        gmx_bool b3D, gmx_bool bCOM);
+        gmx_bool b3D, gmx_bool bCOM, int nref, real skin, real edt_spacing,
+        gmx_bool bEdtInterp, int nstedtcheck);
+
+DistMode *copy_dist(DistMode *src);
 
 void clean_dist(DistMode *dist_store);
 
+void dist_reduce(DistMode *dst, DistMode *src);
+
+void reset_dist(DistMode *dist_store);
+
 void dist_start_frame(DistMode *dist_store, matrix box, rvec *x,
-        t_topology *top);
+        t_topology *top, t_pbc *pbc);
 
-void dist_end_frame(DistMode *dist_store, int adt);
+void dist_end_frame(DistMode *dist_store);
 
-void dist_store(DistMode *dist, int group, int atom, rvec *x, t_pbc *pbc,
-        real mass);
+void dist_store(DistMode *dist, rvec *x, t_pbc *pbc, BinBuffer *buf);
 
 void dist_end(DistMode *dist_store);
 
+void dist_report(DistMode *dist_store, FILE *fp);
+
 #endif
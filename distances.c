@@ -65,19 +65,20 @@ real get_mass(atom_id *group, int grp_size, t_topology *top) {
     return mass;
 }
 
-rvec *center_of_mass(atom_id *group, int grp_size, rvec *x,
-        t_topology *top, real mass) {
-    rvec *com = NULL;
+void center_of_mass(atom_id *group, int grp_size, rvec *x,
+        t_topology *top, real mass, t_pbc *pbc, rvec com) {
+    rvec dx, sum;
+    real m;
     int i = 0, dim=0;
-    snew(com, 1);
-    for (i=0; i<grp_size; ++i) {
+    clear_rvec(sum);
+    for (i=1; i<grp_size; ++i) {
+        pbc_rvec_sub(pbc, x[group[i]], x[group[0]], dx);
+        m = top->atoms.atom[group[i]].m;
         for (dim=0; dim<DIM; ++dim) {
-            (*com)[dim] += x[group[i]][dim] * top->atoms.atom[group[i]].m;
+            sum[dim] += dx[dim] * m;
         }
     }
     for (dim=0; dim<DIM; ++dim) {
-        (*com)[dim] /= mass;
+        com[dim] = x[group[0]][dim] + sum[dim] / mass;
     }
-    return com;
 }
-
@@ -29,8 +29,12 @@ real min_dist(rvec pointA, atom_id *group, int grp_size, rvec *x, t_pbc *pbc,
 real get_mass(atom_id *group, int grp_size, t_topology *top);
 
 /** Get the center of mass of a group of atoms
+ *
+ * With periodic conditions, the atoms are taken at their closest image to
+ * the first atom of the group, so the group must be smaller than half the
+ * box.
  */
-rvec *center_of_mass(atom_id *group, int grp_size, rvec *x,
-        t_topology *top, real mass);
+void center_of_mass(atom_id *group, int grp_size, rvec *x,
+        t_topology *top, real mass, t_pbc *pbc, rvec com);
 
 #endif	/* _distances_h */
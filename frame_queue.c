@@ -0,0 +1,197 @@
+#include "frame_queue.h"
+
+/** Monotonic wall clock time, in seconds
+ */
+static double frame_queue_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+/** Main loop of a worker thread
+ *
+ * Process ready frames until the queue is closed and empty.
+ */
+static void *frame_worker_run(void *arg) {
+    FrameWorker *worker = (FrameWorker *)arg;
+    FrameQueue *queue = worker->queue;
+    FrameSlot *slot = NULL;
+    int islot = 0;
+    double start;
+
+    pthread_mutex_lock(&queue->lock);
+    while (TRUE) {
+        if (queue->nready == 0 && !queue->bDone) {
+            start = frame_queue_clock();
+            while (queue->nready == 0 && !queue->bDone) {
+                pthread_cond_wait(&queue->cond_ready, &queue->lock);
+            }
+            if (queue->nready > 0) {
+                queue->wait_ready += frame_queue_clock() - start;
+            }
+        }
+        if (queue->nready == 0) {
+            break;
+        }
+        islot = queue->ready[queue->ready_head];
+        queue->ready_head = (queue->ready_head + 1) % queue->nslots;
+        queue->nready--;
+        pthread_mutex_unlock(&queue->lock);
+
+        slot = &queue->slots[islot];
+        queue->process(worker->data, slot->x, slot->box);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->free[queue->nfree++] = islot;
+        pthread_cond_signal(&queue->cond_free);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return NULL;
+}
+
+/** Contruct an instance of FrameQueue and start the worker threads
+ *
+ * Parameters :
+ *  - nworkers    : the number of worker threads
+ *  - nslots      : the number of frame buffers, at least nworkers
+ *  - natoms      : the number of atoms in a frame
+ *  - process     : the function to call on each frame
+ *  - worker_data : one pointer per worker, given to "process"
+ */
+FrameQueue *build_frame_queue(int nworkers, int nslots, int natoms,
+        frame_func process, void **worker_data) {
+    FrameQueue *queue;
+    int i;
+
+    if (nworkers <= 0 || nslots < nworkers) {
+        gmx_fatal(FARGS, "Invalid frame queue: %d workers, %d buffers\n",
+                nworkers, nslots);
+    }
+
+    snew(queue, 1);
+    queue->nslots = nslots;
+    queue->natoms = natoms;
+    queue->nworkers = nworkers;
+    queue->process = process;
+    queue->bDone = FALSE;
+    queue->ready_head = 0;
+    queue->nready = 0;
+    queue->wait_free = 0;
+    queue->wait_ready = 0;
+    queue->nframes = 0;
+
+    snew(queue->slots, nslots);
+    snew(queue->ready, nslots);
+    snew(queue->free, nslots);
+    for (i=0; i<nslots; ++i) {
+        snew(queue->slots[i].x, natoms);
+        queue->free[i] = nslots - 1 - i;
+    }
+    queue->nfree = nslots;
+
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond_ready, NULL);
+    pthread_cond_init(&queue->cond_free, NULL);
+
+    snew(queue->threads, nworkers);
+    snew(queue->workers, nworkers);
+    for (i=0; i<nworkers; ++i) {
+        queue->workers[i].queue = queue;
+        queue->workers[i].data = worker_data[i];
+        if (pthread_create(&queue->threads[i], NULL, frame_worker_run,
+                    &queue->workers[i]) != 0) {
+            gmx_fatal(FARGS, "Could not start worker thread %d\n", i);
+        }
+    }
+    return queue;
+}
+
+/** Wait for the pending frames to be processed and stop the workers
+ */
+void frame_queue_close(FrameQueue *queue) {
+    int i;
+    if (queue->threads) {
+        pthread_mutex_lock(&queue->lock);
+        queue->bDone = TRUE;
+        pthread_cond_broadcast(&queue->cond_ready);
+        pthread_mutex_unlock(&queue->lock);
+        for (i=0; i<queue->nworkers; ++i) {
+            pthread_join(queue->threads[i], NULL);
+        }
+        sfree(queue->threads);
+        queue->threads = NULL;
+    }
+}
+
+/** Stop the workers if they are still running and clean the instance of
+ * FrameQueue
+ */
+void clean_frame_queue(FrameQueue *queue) {
+    int i;
+    if (queue) {
+        frame_queue_close(queue);
+        pthread_mutex_destroy(&queue->lock);
+        pthread_cond_destroy(&queue->cond_ready);
+        pthread_cond_destroy(&queue->cond_free);
+        for (i=0; i<queue->nslots; ++i) {
+            sfree(queue->slots[i].x);
+        }
+        sfree(queue->slots);
+        sfree(queue->ready);
+        sfree(queue->free);
+        sfree(queue->workers);
+        sfree(queue);
+    }
+}
+
+/** Get a buffer to read a frame in, wait for one if none is available
+ */
+FrameSlot *frame_queue_get_free(FrameQueue *queue) {
+    int islot;
+    double start;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->nfree == 0) {
+        start = frame_queue_clock();
+        while (queue->nfree == 0) {
+            pthread_cond_wait(&queue->cond_free, &queue->lock);
+        }
+        queue->wait_free += frame_queue_clock() - start;
+    }
+    islot = queue->free[--queue->nfree];
+    pthread_mutex_unlock(&queue->lock);
+    return &queue->slots[islot];
+}
+
+/** Give a filled buffer to the workers
+ */
+void frame_queue_push(FrameQueue *queue, FrameSlot *slot) {
+    pthread_mutex_lock(&queue->lock);
+    queue->ready[(queue->ready_head + queue->nready) % queue->nslots] =
+        (int)(slot - queue->slots);
+    queue->nready++;
+    queue->nframes++;
+    pthread_cond_signal(&queue->cond_ready);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/** Give back a buffer that was not filled
+ */
+void frame_queue_release(FrameQueue *queue, FrameSlot *slot) {
+    pthread_mutex_lock(&queue->lock);
+    queue->free[queue->nfree++] = (int)(slot - queue->slots);
+    pthread_cond_signal(&queue->cond_free);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/** Wait until every frame given to the workers has been processed
+ *
+ * Must be called from the reading thread, it is the only one that pushes
+ * frames.
+ */
+void frame_queue_drain(FrameQueue *queue) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->nfree < queue->nslots) {
+        pthread_cond_wait(&queue->cond_free, &queue->lock);
+    }
+    pthread_mutex_unlock(&queue->lock);
+}
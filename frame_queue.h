@@ -0,0 +1,79 @@
+#ifndef _frame_queue_h
+#define _frame_queue_h
+
+#include <pthread.h>
+#include <time.h>
+
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+
+/** Function called by a worker thread on each frame it gets
+ *
+ * "data" is the pointer given for this worker to build_frame_queue.
+ */
+typedef void (*frame_func)(void *data, rvec *x, matrix box);
+
+/** A preallocated buffer holding one decoded frame
+ */
+typedef struct FrameSlot {
+    rvec *x;
+    matrix box;
+    double t;
+} FrameSlot;
+
+typedef struct FrameWorker {
+    struct FrameQueue *queue;
+    void *data;
+} FrameWorker;
+
+/** Hand decoded frames to a pool of worker threads
+ *
+ * The reading thread takes a free slot with frame_queue_get_free, fills it,
+ * and gives it to the workers with frame_queue_push. The slot comes back in
+ * the free list once a worker is done with it. The number of slots bounds
+ * the number of frames kept in memory, and how far reading can run ahead of
+ * the analysis.
+ *
+ * The time spent waiting on each side is recorded: a reading thread that
+ * waits for free slots means the analysis is the bottleneck, workers that
+ * wait for frames mean reading is.
+ */
+typedef struct FrameQueue {
+    int nslots;
+    int natoms;
+    FrameSlot *slots;
+    int *ready;         /* Circular FIFO of the slots waiting for a worker */
+    int ready_head;
+    int nready;
+    int *free;          /* Stack of the slots available for reading */
+    int nfree;
+    int nworkers;
+    pthread_t *threads; /* NULL once the workers are stopped */
+    FrameWorker *workers;
+    frame_func process;
+    gmx_bool bDone;
+    pthread_mutex_t lock;
+    pthread_cond_t cond_ready;
+    pthread_cond_t cond_free;
+    double wait_free;   /* Seconds the reading thread waited for a slot */
+    double wait_ready;  /* Seconds the workers waited for a frame, summed */
+    int nframes;        /* Number of frames pushed */
+} FrameQueue;
+
+FrameQueue *build_frame_queue(int nworkers, int nslots, int natoms,
+        frame_func process, void **worker_data);
+
+void frame_queue_close(FrameQueue *queue);
+
+void clean_frame_queue(FrameQueue *queue);
+
+FrameSlot *frame_queue_get_free(FrameQueue *queue);
+
+void frame_queue_push(FrameQueue *queue, FrameSlot *slot);
+
+void frame_queue_release(FrameQueue *queue, FrameSlot *slot);
+
+void frame_queue_drain(FrameQueue *queue);
+
+#endif /* _frame_queue_h */
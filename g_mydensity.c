@@ -59,6 +59,12 @@
 
 #include "grid_mode.h"
 #include "dist_mode.h"
+#include "density.h"
+#include "frame_queue.h"
+#include "state_io.h"
+#include "timing.h"
+#include "traj_cache.h"
+#include "block_mode.h"
 
 typedef struct {
   char *atomname;
@@ -120,263 +126,582 @@ int get_electrons(t_electron **eltab, const char *fn)
   return nr;
 }
 
-void center_coords(t_atoms *atoms,matrix box,rvec x0[],int axis)
+/* Number of electrons of every atom of the groups, minus its partial
+ * charge */
+static void get_electron_weights(t_topology *top, atom_id **index, int gnx[],
+                                 int nr_grps, t_electron eltab[], int nr,
+                                 real *weights)
 {
-  int  i,m;
-  real tmass,mm;
-  rvec com,shift,box_center;
-  
-  tmass = 0;
-  clear_rvec(com);
-  for(i=0; (i<atoms->nr); i++) {
-    mm     = atoms->atom[i].m;
-    tmass += mm;
-    for(m=0; (m<DIM); m++) 
-      com[m] += mm*x0[i][m];
+  gmx_bool *bDone;       /* atoms already resolved                */
+  char **missing = NULL; /* atom names already reported missing   */
+  int nmissing = 0;
+  int i,n,k,atom;
+  t_electron *found;     /* found by bsearch */
+  t_electron sought;     /* thingie thought by bsearch */
+
+  snew(bDone,top->atoms.nr);
+  for (n = 0; n < nr_grps; n++) {
+    for (i = 0; i < gnx[n]; i++) {
+      atom = index[n][i];
+      if (bDone[atom])
+        continue;
+      bDone[atom] = TRUE;
+      sought.nr_el = 0;
+      sought.atomname = *(top->atoms.atomname[atom]);
+      found = (t_electron *)
+        bsearch((const void *)&sought,
+                (const void *)eltab, nr, sizeof(t_electron), 
+                (int(*)(const void*, const void*))compare);
+      if (found != NULL) {
+        weights[atom] = found->nr_el - top->atoms.atom[atom].q;
+        continue;
+      }
+      /* The atom does not contribute; tell it once per atom name */
+      for (k = 0; k < nmissing; k++)
+        if (strcmp(missing[k],sought.atomname) == 0)
+          break;
+      if (k == nmissing) {
+        fprintf(stderr,"Couldn't find %s. Add it to the .dat file\n",
+                sought.atomname);
+        srenew(missing,nmissing+1);
+        missing[nmissing++] = sought.atomname;
+      }
+    }
   }
-  for(m=0; (m<DIM); m++) 
-    com[m] /= tmass;
-  calc_box_center(ecenterDEF,box,box_center);
-  rvec_sub(box_center,com,shift);
-  shift[axis] -= box_center[axis];
-  
-  for(i=0; (i<atoms->nr); i++) 
-    rvec_dec(x0[i],shift);
+  sfree(missing);
+  sfree(bDone);
 }
 
-void calc_electron_density(const char *fn, atom_id **index, int gnx[], 
-			   real ***slDensity, int *nslices, t_topology *top,
-			   int ePBC,
-			   int axis, int nr_grps, real *slWidth, 
-			   t_electron eltab[], int nr,gmx_bool bCenter,
-                           const output_env_t oenv)
+/* Resolve the weights of every atom once per type of density, before
+ * reading the trajectory: its mass, 1, its charge or, for electron
+ * densities, its number of electrons minus its partial charge. */
+real **get_weights(t_topology *top, atom_id **index, int gnx[], int nr_grps,
+                   const char *dens, t_electron eltab[], int nr)
 {
-  rvec *x0;              /* coordinates without pbc */
-  matrix box;            /* box (3x3) */
-  double invvol;
-  int natoms;            /* nr. atoms in trj */
-  t_trxstatus *status;  
-  int i,n,               /* loop indices */
-      nr_frames = 0,     /* number of frames */
-      slice;             /* current slice */
-  t_electron *found;     /* found by bsearch */
-  t_electron sought;     /* thingie thought by bsearch */
-  gmx_rmpbc_t  gpbc=NULL;
-  t_pbc *pbc = NULL;
- 
-  real t, 
-        z;
+  real **weights;
+  int c,i;
 
-  if (axis < 0 || axis >= DIM) {
-    gmx_fatal(FARGS,"Invalid axes. Terminating\n");
+  snew(weights,strlen(dens));
+  for (c = 0; dens[c] != '\0'; c++) {
+    snew(weights[c],top->atoms.nr);
+    switch (dens[c]) {
+    case 'n':
+      for (i = 0; i < top->atoms.nr; i++)
+        weights[c][i] = 1;
+      break;
+    case 'c':
+      for (i = 0; i < top->atoms.nr; i++)
+        weights[c][i] = top->atoms.atom[i].q;
+      break;
+    case 'e':
+      get_electron_weights(top, index, gnx, nr_grps, eltab, nr, weights[c]);
+      break;
+    default:
+      for (i = 0; i < top->atoms.nr; i++)
+        weights[c][i] = top->atoms.atom[i].m;
+    }
   }
+  return weights;
+}
 
-  if ((natoms = read_first_x(oenv,&status,fn,&t,&x0,box)) == 0)
-    gmx_fatal(FARGS,"Could not read coordinates from statusfile\n");
-  
-  if (! *nslices)
-    *nslices = (int)(box[axis][axis] * 10); /* default value */
-  fprintf(stderr,"\nDividing the box in %d slices\n",*nslices);
+/* Parse the comma separated list of types of density of -dens into one
+ * letter per type */
+static void parse_dens(const char *opt, char *dens)
+{
+  static const char *types[] = { "mass", "number", "charge", "electron" };
+  const char *p, *end;
+  size_t len;
+  int  n = 0, t;
 
-  snew(*slDensity, nr_grps);
-  for (i = 0; i < nr_grps; i++)
-    snew((*slDensity)[i], *nslices);
- 
-  if (ePBC != epbcNONE)
-      snew(pbc,1);
-  else
-      pbc = NULL;
-  gpbc = gmx_rmpbc_init(&top->idef,ePBC,top->atoms.nr,box);
-  /*********** Start processing trajectory ***********/
-  do {
-      if (pbc) {
-          set_pbc(pbc,ePBC,box);
-          /* make molecules whole again */
-          gmx_rmpbc(gpbc,natoms,box,x0);
-      }
+  for (p = opt; *p != '\0'; p = (*end == ',') ? end + 1 : end) {
+    end = strchr(p, ',');
+    if (end == NULL)
+      end = p + strlen(p);
+    len = end - p;
+    for (t = 0; t < asize(types); t++)
+      if (len > 0 && gmx_strncasecmp(p, types[t], len) == 0)
+        break;
+    if (t == asize(types))
+      gmx_fatal(FARGS,"Invalid type of density '%.*s' in '%s'; use mass, "
+                "number, charge or electron\n", (int)len, p, opt);
+    if (memchr(dens, types[t][0], n) != NULL)
+      gmx_fatal(FARGS,"Density %s is given twice\n", types[t]);
+    if (n == BIN_MAX_CHANNELS)
+      gmx_fatal(FARGS,"At most %d types of density can be computed\n",
+                BIN_MAX_CHANNELS);
+    dens[n++] = types[t][0];
+    dens[n] = '\0';
+  }
+  if (n == 0)
+    gmx_fatal(FARGS,"No type of density given with -dens\n");
+}
 
-    if (bCenter)
-      center_coords(&top->atoms,box,x0,axis);
-    
-    *slWidth = box[axis][axis]/(*nslices);
-    invvol = *nslices/(box[XX][XX]*box[YY][YY]*box[ZZ][ZZ]);
-
-    for (n = 0; n < nr_grps; n++) {      
-      for (i = 0; i < gnx[n]; i++) {   /* loop over all atoms in index file */
-	  z = x0[index[n][i]][axis];
-	  while (z < 0) 
-	    z += box[axis][axis];
-	  while (z > box[axis][axis])
-	    z -= box[axis][axis];
-      
-	  /* determine which slice atom is in */
-	  slice = (z / (*slWidth)); 
-	  sought.nr_el = 0;
-	  sought.atomname = strdup(*(top->atoms.atomname[index[n][i]]));
-
-	  /* now find the number of electrons. This is not efficient. */
-	  found = (t_electron *)
-	    bsearch((const void *)&sought,
-		    (const void *)eltab, nr, sizeof(t_electron), 
-		    (int(*)(const void*, const void*))compare);
-
-	  if (found == NULL)
-	    fprintf(stderr,"Couldn't find %s. Add it to the .dat file\n",
-		    *(top->atoms.atomname[index[n][i]]));
-	  else  
-	    (*slDensity)[n][slice] += (found->nr_el - 
-				       top->atoms.atom[index[n][i]].q)*invvol;
-	  free(sought.atomname);
-	}
+/* Arguments of analyse_frame for a worker thread */
+typedef struct FrameTask {
+  DensityJob *job;
+  DensityAccum *accum;
+} FrameTask;
+
+static void analyse_frame_task(void *data, rvec *x, matrix box)
+{
+  FrameTask *task = (FrameTask *)data;
+  analyse_frame(task->job, task->accum, x, box);
+}
+
+/* Normalize the sums of every mode, write the grid and distance outputs,
+ * and return the slab profiles */
+static real **finish_density(DensityJob *job, DensityAccum *accum)
+{
+  real **slDensity;
+  int  i,n;
+
+  timing_start(accum->timing);
+  grid_end(accum->grid);
+  voxel_end(accum->voxel);
+  dist_end(accum->dist);
+  dist_report(accum->dist, stderr);
+  timing_stop(accum->timing, etimOUTPUT);
+
+  /* slDensity now contains the total mass per slice, summed over all
+     frames. Now divide by nr_frames and volume of slice 
+     */
+  for (n =0; n < job_nprofiles(job); n++) {
+    for (i = 0; i < job->nslices; i++) {
+      accum->slDensity[n][i] /= accum->nframes;
     }
-      nr_frames++;
-  } while (read_next_x(oenv,status,&t,natoms,x0,box));
-  gmx_rmpbc_done(gpbc);
+  }
+  slDensity = accum->slDensity;
+  accum->slDensity = NULL;
+  clean_accum(job, accum);
+  return slDensity;
+}
 
-  /*********** done with status file **********/
-  close_trj(status);
-  
-/* slDensity now contains the total number of electrons per slice, summed 
-   over all frames. Now divide by nr_frames and volume of slice 
-*/
+/* Width of the slices along each axis of the job */
+static void slice_widths(DensityJob *job, matrix box, real *slWidth)
+{
+  int  a;
+
+  for (a = 0; a < job->naxes; a++)
+    slWidth[a] = box[job->axes[a]][job->axes[a]]/job->nslices;
+}
 
-  fprintf(stderr,"\nRead %d frames from trajectory. Counting electrons\n",
-	  nr_frames);
+/* Sum the frames of the current block, including the ones of the workers,
+ * into the totals, write the block, and start a new one */
+static void end_block(DensityJob *job, DensityAccum *accum,
+                      DensityAccum *block, DensityAccum **workers,
+                      int nworkers, BlockOutput *blocks, matrix box)
+{
+  real slWidth[DIM];
+  int  i;
 
-  for (n =0; n < nr_grps; n++) {
-    for (i = 0; i < *nslices; i++)
-      (*slDensity)[n][i] /= nr_frames;
+  for (i = 0; i < nworkers; i++) {
+    reduce_accum(job, block, workers[i]);
+    reset_accum(job, workers[i]);
   }
+  if (block->nframes == 0)
+    return;
+  reduce_accum(job, accum, block);
+  slice_widths(job, box, slWidth);
+  timing_start(accum->timing);
+  block_write(blocks, job, block, slWidth);
+  timing_stop(accum->timing, etimOUTPUT);
+  reset_accum(job, block);
+}
 
-  sfree(x0);  /* free memory used by coordinate array */
+/* Where the frames come from: a trajectory, or the cache written by an
+ * earlier run */
+/* How the frames of a run are read and prepared */
+typedef struct RunOptions {
+  gmx_bool bCenter;      /* center the frames along the normal axis */
+  atom_id *cindex;       /* group to center on, NULL for the whole system */
+  int  csize;            /* size of the centering group */
+  gmx_bool bSelPBC;      /* only make whole the molecules of the used atoms */
+  int  nthreads;         /* nr. of analysis threads */
+  int  nbuf;             /* nr. of frames decoded ahead, 0 for the default */
+  const char *cpi_fn;    /* checkpoint to resume from, or NULL */
+  const char *cpo_fn;    /* checkpoint to write, or NULL */
+  int  nstcpt;           /* frames between checkpoints, 0 for the end only */
+  const char *cache_in_fn;  /* cache to read instead of the trajectory */
+  const char *cache_out_fn; /* cache to write while reading */
+  BlockOutput *blocks;   /* block averages, or NULL */
+  Timing *timing;        /* time spent in each phase, or NULL */
+} RunOptions;
+
+typedef struct FrameSource {
+  output_env_t oenv;
+  t_trxstatus *status;
+  TrajCache *cache;      /* NULL when reading the trajectory */
+} FrameSource;
+
+/* Read the next frame of the cache within the -b and -e times */
+static gmx_bool read_cached_frame(FrameSource *src, double *t, rvec *x,
+                                  matrix box)
+{
+  gmx_bool bOK;
+  do {
+    bOK = cache_read_frame(src->cache,t,box,x);
+  } while (bOK && bTimeSet(TBEGIN) && *t < rTimeValue(TBEGIN));
+  if (bOK && bTimeSet(TEND) && *t > rTimeValue(TEND))
+    bOK = FALSE;
+  return bOK;
+}
+
+/* Read the first frame, allocating the coordinates; returns the number of
+ * atoms, or 0 if there is no frame */
+static int read_first_frame(FrameSource *src, const char *fn, double *t,
+                            rvec **x, matrix box)
+{
+  int natoms;
+  real tr;
+
+  if (src->cache == NULL) {
+    natoms = read_first_x(src->oenv,&src->status,fn,&tr,x,box);
+    *t = tr;
+    return natoms;
+  }
+  natoms = src->cache->header.natoms;
+  snew(*x, natoms);
+  if (!read_cached_frame(src,t,*x,box)) {
+    sfree(*x);
+    *x = NULL;
+    natoms = 0;
+  }
+  return natoms;
+}
+
+/* Read the next frame later than tskip; the times are compared in double
+ * precision, as a real can not tell apart the frames of long trajectories */
+static gmx_bool read_next_frame(FrameSource *src, double *t, int natoms,
+                                rvec *x, matrix box,
+                                gmx_bool bSkip, double tskip)
+{
+  gmx_bool bOK;
+  real tr;
+  do {
+    if (src->cache) {
+      bOK = read_cached_frame(src,t,x,box);
+    } else {
+      bOK = read_next_x(src->oenv,src->status,&tr,natoms,x,box);
+      *t = tr;
+    }
+  } while (bOK && bSkip && *t <= tskip);
+  return bOK;
+}
+
+/* Close the source, counting the bytes read */
+static void close_frame_source(FrameSource *src, Timing *timing)
+{
+  if (src->cache) {
+    if (timing)
+      timing->bytes = cache_bytes_read(src->cache);
+    cache_close(src->cache);
+  } else if (src->status) {
+    if (timing)
+      timing->bytes = gmx_fio_ftell(trx_get_fileio(src->status));
+    close_trj(src->status);
+  }
 }
 
 void calc_density(const char *fn, atom_id **index, int gnx[], 
 		  real ***slDensity, int *nslices, t_topology *top, int ePBC,
-		  int axis, int nr_grps, real *slWidth, gmx_bool bCenter,
-                  const output_env_t oenv, GridHeight *grid, DistMode *dist)
+		  int *axes, int naxes, int nr_grps, real *slWidth,
+                  const char *dens,
+                  real **weights, const output_env_t oenv,
+                  GridHeight *grid, VoxelGrid *voxel, DistMode *dist,
+                  const RunOptions *opts)
 {
-  rvec *x0;              /* coordinates without pbc */
+  rvec *x0 = NULL;       /* coordinates without pbc */
   matrix box;            /* box (3x3) */
-  double invvol;
+  matrix last_box;       /* box of the last frame read */
   int natoms;            /* nr. atoms in trj */
-  t_trxstatus *status;  
-  int  **slCount,         /* nr. of atoms in one slice for a group */
-      i,j,n,               /* loop indices */
-      teller = 0,      
-      ax1=0, ax2=0,
-      nr_frames = 0,     /* number of frames */
-      slice;             /* current slice */
-  real t, 
-        z;
-  char *buf;             /* for tmp. keeping atomname */
-  gmx_rmpbc_t  gpbc=NULL;
-
-  t_pbc *pbc;
-
-  if (axis < 0 || axis >= DIM) {
-    gmx_fatal(FARGS,"Invalid axes. Terminating\n");
+  FrameSource src;
+  TrajCache *cache_out = NULL;
+  int  i;                /* loop index */
+  int  axis = axes[0];   /* normal axis */
+  int  nread = 0;        /* nr. of frames read by this run */
+  double t, last_t = 0;
+  gmx_bool bResume = (opts->cpi_fn != NULL);
+  gmx_bool bFrame, bMore;
+  StateHeader state;
+  DensityJob job;
+  DensityAccum *accum;
+  DensityAccum *block = NULL;  /* sums of the current block of frames */
+  DensityAccum *sums[2];       /* totals and current block */
+  int  nsums = 1;
+  DensityAccum **workers = NULL;
+  int  nmain;                  /* instances of workers not owned by threads */
+  FrameTask *tasks = NULL;
+  void **task_ptrs = NULL;
+  FrameQueue *queue = NULL;
+  FrameSlot *slot = NULL;
+  int  nthreads = opts->nthreads;
+  int  nbuf = opts->nbuf;
+  BlockOutput *blocks = opts->blocks;
+  Timing *timing = opts->timing;
+
+  src.oenv = oenv;
+  src.status = NULL;
+  src.cache = NULL;
+  if (opts->cache_in_fn)
+    src.cache = cache_open(opts->cache_in_fn);
+  if (opts->cache_out_fn && bResume)
+    gmx_fatal(FARGS,"A cache can not be written when resuming, as it would "
+              "miss the frames already analysed\n");
+
+  memset(&state, 0, sizeof(state));
+  if (bResume) {
+    /* The frames up to the last one of the checkpoint are skipped by
+     * read_next_frame; the begin time is left alone, as a real could round
+     * the time of the checkpoint past the next frame */
+    read_state_header(opts->cpi_fn, &state);
+    fprintf(stderr,"\nResuming from %s: %d frames analysed, last time %.12g\n",
+            opts->cpi_fn, state.nframes, state.t);
+    last_t = state.t;
+    if (! *nslices)
+      *nslices = state.nslices;
   }
 
-  if ((natoms = read_first_x(oenv,&status,fn,&t,&x0,box)) == 0)
-    gmx_fatal(FARGS,"Could not read coordinates from statusfile\n");
+  timing_start(timing);
+  natoms = read_first_frame(&src,fn,&t,&x0,box);
+  bFrame = (natoms != 0);
+  if (bFrame && bResume && t <= state.t)
+    bFrame = read_next_frame(&src,&t,natoms,x0,box,TRUE,state.t);
+  timing_stop(timing, etimDECODE);
+  if (!bFrame) {
+    if (!bResume)
+      gmx_fatal(FARGS,"Could not read coordinates from statusfile\n");
+    /* Everything was already analysed, the output only needs the
+     * checkpoint */
+    fprintf(stderr,"\nNo frame after t = %g in %s\n", state.t, fn);
+    if (natoms == 0) {
+      natoms = top->atoms.nr;
+      snew(x0, natoms);
+    }
+  }
   
   if (! *nslices) {
     *nslices = (int)(box[axis][axis] * 10); /* default value */
     fprintf(stderr,"\nDividing the box in %d slices\n",*nslices);
   }
-  
-  snew(*slDensity, nr_grps);
-  for (i = 0; i < nr_grps; i++)
-    snew((*slDensity)[i], *nslices);
 
-  if (ePBC != epbcNONE)
-      snew(pbc,1);
-  else
-      pbc = NULL;
+  set_job(&job, index, gnx, nr_grps, *nslices, axes, naxes, top, ePBC,
+          opts->bCenter, dens, weights);
+  build_job_atoms(&job, dist, opts->bSelPBC, opts->cindex, opts->csize);
+  /* The frames of a cache are already prepared; the ones written to a cache
+   * are prepared by this thread before being written */
+  if (src.cache)
+    cache_check_atoms(src.cache, top->atoms.nr, job.used, job.nused,
+                      opts->bCenter, axis, opts->cindex, opts->csize,
+                      opts->bSelPBC);
+  job.bPrepared = (src.cache || opts->cache_out_fn);
+
+  accum = build_accum(&job, grid, voxel, dist, box);
+  accum->timing = timing;
+  if (bResume)
+    read_state(opts->cpi_fn, &job, accum, &state);
+  if (opts->cache_out_fn)
+    cache_out = cache_create(opts->cache_out_fn, natoms, job.used, job.nused,
+                             opts->bCenter, axis, opts->cindex, opts->csize,
+                             opts->bSelPBC);
+  /* With blocks, the frames are analysed into a copy of the accumulators,
+   * added to the totals at the end of each block */
+  sums[0] = accum;
+  if (blocks) {
+    block = copy_accum(&job, accum, box);
+    sums[nsums++] = block;
+  }
+  copy_mat(box, last_box);
 
-  gpbc = gmx_rmpbc_init(&top->idef,ePBC,top->atoms.nr,box);
   /*********** Start processing trajectory ***********/
-  do {
-      if (pbc) {
-          set_pbc(pbc,ePBC,box);
-          /* make molecules whole again */
-          gmx_rmpbc(gpbc,natoms,box,x0);
+  if (!bFrame) {
+    /* Nothing to read */
+  } else if (nthreads > 1 || nbuf > 0) {
+    /* Each worker fills its own copy of the accumulators; the frames are
+     * decoded by this thread and handed over through the queue, up to
+     * nbuf frames ahead of the analysis. */
+    if (nbuf <= 0)
+      nbuf = 2*nthreads;
+    else if (nbuf < nthreads)
+      gmx_fatal(FARGS,"The frame buffer (%d) can not be smaller than the "
+                "number of threads (%d)\n", nbuf, nthreads);
+    nmain = nsums;
+    snew(workers, nthreads + nmain);
+    snew(tasks, nthreads);
+    snew(task_ptrs, nthreads);
+    for (i = 0; i < nthreads; i++) {
+      workers[i + nmain] = copy_accum(&job, accum, box);
+      tasks[i].job = &job;
+      tasks[i].accum = workers[i + nmain];
+      task_ptrs[i] = &tasks[i];
+    }
+    /* The first workers are the totals and the current block, so a
+     * checkpoint sums them all */
+    for (i = 0; i < nmain; i++)
+      workers[i] = sums[i];
+    queue = build_frame_queue(nthreads, nbuf, natoms,
+            analyse_frame_task, task_ptrs);
+    slot = frame_queue_get_free(queue);
+    for (i = 0; i < natoms; i++)
+      copy_rvec(x0[i], slot->x[i]);
+    copy_mat(box, slot->box);
+    slot->t = t;
+    while (TRUE) {
+      last_t = slot->t;
+      if (cache_out) {
+        prepare_frame(&job, accum, slot->x, slot->box);
+        cache_write_frame(cache_out, slot->t, slot->box, slot->x);
       }
-
-    if (bCenter)
-      center_coords(&top->atoms,box,x0,axis);
-   
-    grid_start_frame(grid, box);
-    dist_start_frame(dist, box, x0, top);
-
-    *slWidth = box[axis][axis]/(*nslices);
-    invvol = *nslices/(box[XX][XX]*box[YY][YY]*box[ZZ][ZZ]);
-    teller++;
-    
-    for (n = 0; n < nr_grps; n++) {      
-        for (i = 0; i < gnx[n]; i++) {   /* loop over all atoms in index file */
-            grid_store(grid, n, x0[index[n][i]], pbc,
-                    top->atoms.atom[index[n][i]].m);
-            dist_store(dist, n, index[n][i], x0, pbc,
-                    top->atoms.atom[index[n][i]].m);
-            z = x0[index[n][i]][axis];
-            while (z < 0) 
-                z += box[axis][axis];
-            while (z > box[axis][axis])
-                z -= box[axis][axis];
-
-            /* determine which slice atom is in */
-            slice = (int)(z / (*slWidth)); 
-            (*slDensity)[n][slice] += top->atoms.atom[index[n][i]].m*invvol;
-            /*printf("invvol: %f, vol: %f\n", invvol, 1/invvol);*/
-            /*printf("mass prof: %f\n", top->atoms.atom[index[n][i]].m);*/
-        }
+      frame_queue_push(queue, slot);
+      if (blocks && block_frame(blocks, last_t)) {
+        frame_queue_drain(queue);
+        end_block(&job, accum, block, workers + nmain, nthreads, blocks,
+                  last_box);
+      }
+      if (opts->nstcpt > 0 && ++nread % opts->nstcpt == 0) {
+        frame_queue_drain(queue);
+        slice_widths(&job, last_box, slWidth);
+        write_state(opts->cpo_fn, &job, workers, nthreads + nmain, last_t,
+                    slWidth);
+      }
+      slot = frame_queue_get_free(queue);
+      timing_start(timing);
+      bMore = read_next_frame(&src,&slot->t,natoms,slot->x,slot->box,
+                              bResume,state.t);
+      timing_stop(timing, etimDECODE);
+      if (!bMore) {
+        frame_queue_release(queue, slot);
+        break;
+      }
+      copy_mat(slot->box, last_box);
+    }
+    frame_queue_close(queue);
+    if (timing) {
+      timing->nbuf = queue->nslots;
+      timing->nworkers = queue->nworkers;
+      timing->wait_free = queue->wait_free;
+      timing->wait_ready = queue->wait_ready;
+    }
+    clean_frame_queue(queue);
+    for (i = nmain; i < nthreads + nmain; i++) {
+      reduce_accum(&job, sums[nsums - 1], workers[i]);
+      clean_accum(&job, workers[i]);
     }
-    nr_frames++;
-  } while (read_next_x(oenv,status,&t,natoms,x0,box));
-  gmx_rmpbc_done(gpbc);
+    sfree(workers);
+    sfree(tasks);
+    sfree(task_ptrs);
+  } else {
+    do {
+      if (cache_out) {
+        prepare_frame(&job, accum, x0, box);
+        cache_write_frame(cache_out, t, box, x0);
+      }
+      analyse_frame(&job, sums[nsums - 1], x0, box);
+      copy_mat(box, last_box);
+      last_t = t;
+      if (blocks && block_frame(blocks, t))
+        end_block(&job, accum, block, NULL, 0, blocks, last_box);
+      if (opts->nstcpt > 0 && ++nread % opts->nstcpt == 0) {
+        slice_widths(&job, last_box, slWidth);
+        write_state(opts->cpo_fn, &job, sums, nsums, last_t, slWidth);
+      }
+      timing_start(timing);
+      bMore = read_next_frame(&src,&t,natoms,x0,box,bResume,state.t);
+      timing_stop(timing, etimDECODE);
+    } while (bMore);
+  }
+  /* The last block may be shorter */
+  if (block) {
+    end_block(&job, accum, block, NULL, 0, blocks, last_box);
+    clean_accum(&job, block);
+  }
+  if (bFrame)
+    slice_widths(&job, last_box, slWidth);
+  else
+    for (i = 0; i < naxes; i++)
+      slWidth[i] = state.slWidth[i];
 
-  grid_end(grid);
-  dist_end(dist);
+  /* Save the final sums, so a later run with -cpi only reads new frames */
+  if (opts->cpo_fn)
+    write_state(opts->cpo_fn, &job, &accum, 1, last_t, slWidth);
 
   /*********** done with status file **********/
-  close_trj(status);
-  
-  /* slDensity now contains the total mass per slice, summed over all
-     frames. Now divide by nr_frames and volume of slice 
-     */
+  close_frame_source(&src, timing);
+  cache_close(cache_out);
   
   fprintf(stderr,"\nRead %d frames from trajectory. Calculating density\n",
-	  nr_frames);
+	  accum->nframes);
+
+  *slDensity = finish_density(&job, accum);
+  clean_job_atoms(&job);
+
+  sfree(x0);  /* free memory used by coordinate array */
+}
+
+/* Sum the partial results written by several runs, as if the frames they
+ * analysed had been read by a single run */
+void merge_density(char **fns, int nfiles, atom_id **index, int gnx[],
+                   real ***slDensity, int *nslices, t_topology *top, int ePBC,
+                   int *axes, int naxes, int nr_grps, real *slWidth,
+                   const char *dens, real **weights,
+                   GridHeight *grid, VoxelGrid *voxel, DistMode *dist,
+                   const RunOptions *opts)
+{
+  StateHeader state;
+  DensityJob job;
+  DensityAccum *accum;
+  matrix box;
+  double tlast = 0;
+  int  i, a;
+
+  read_state_header(fns[0], &state);
+  if (! *nslices)
+    *nslices = state.nslices;
+  set_job(&job, index, gnx, nr_grps, *nslices, axes, naxes, top, ePBC,
+          FALSE, dens, weights);
+  clear_mat(box);
+  accum = build_accum(&job, grid, voxel, dist, box);
+  accum->timing = opts->timing;
 
-  for (n =0; n < nr_grps; n++) {
-    for (i = 0; i < *nslices; i++) {
-      (*slDensity)[n][i] /= nr_frames;
+  for (i = 0; i < nfiles; i++) {
+    read_state(fns[i], &job, accum, &state);
+    fprintf(stderr,"Read %d frames up to t = %g from %s\n",
+            state.nframes, state.t, fns[i]);
+    /* The slices are as wide as in the last frame of the trajectory */
+    if (i == 0 || state.t > tlast) {
+      tlast = state.t;
+      for (a = 0; a < naxes; a++)
+        slWidth[a] = state.slWidth[a];
     }
   }
+  if (opts->cpo_fn)
+    write_state(opts->cpo_fn, &job, &accum, 1, tlast, slWidth);
 
-  sfree(x0);  /* free memory used by coordinate array */
+  fprintf(stderr,"\nMerged %d frames from %d files. Calculating density\n",
+	  accum->nframes, nfiles);
+
+  *slDensity = finish_density(&job, accum);
+}
+
+/* Name of the output of one axis: the axis letter is added before the
+ * extension when there are several axes */
+static char *axis_fn(const char *fn, int axis, int naxes)
+{
+  char suffix[2] = { 'X' + axis, '\0' };
+
+  return output_fn(fn, naxes == 1 ? NULL : suffix);
 }
 
 void plot_density(real *slDensity[], const char *afile, int nslices,
 		  int nr_grps, char *grpname[], real slWidth, 
-		  const char **dens_opt,
+		  char dens,
 		  gmx_bool bSymmetrize, const output_env_t oenv)
 {
   FILE  *den;
-  const char *ylabel=NULL;
   int   slice, n;
   real  ddd;
 
-  switch (dens_opt[0][0]) {
-  case 'm': ylabel = "Density (kg m\\S-3\\N)"; break;
-  case 'n': ylabel = "Number density (nm\\S-3\\N)"; break;
-  case 'c': ylabel = "Charge density (e nm\\S-3\\N)"; break;
-  case 'e': ylabel = "Electron density (e nm\\S-3\\N)"; break;
-  }
-  
-  den = xvgropen(afile, "Partial densities", "Box (nm)", ylabel,oenv);
+  den = xvgropen(afile, "Partial densities", "Box (nm)", dens_ylabel(dens),
+                 oenv);
 
   xvgr_legend(den,nr_grps,(const char**)grpname,oenv);
 
@@ -387,7 +712,7 @@ void plot_density(real *slDensity[], const char *afile, int nslices,
 	ddd = (slDensity[n][slice]+slDensity[n][nslices-slice-1])*0.5;
       else
 	ddd = slDensity[n][slice];
-      if (dens_opt[0][0] == 'm')
+      if (dens == 'm')
 	fprintf(den,"   %12g", ddd*AMU/(NANO*NANO*NANO));
       else
 	fprintf(den,"   %12g", ddd);
@@ -405,7 +730,11 @@ int gmx_mydensity(int argc,char *argv[])
     "For the total density of NPT simulations, use [TT]g_energy[tt] instead.",
     "[PAR]",
     "Densities are in kg/m^3, and number densities or electron densities can also be",
-    "calculated. For electron densities, a file describing the number of",
+    "calculated. Several types of density, given as a comma separated list to",
+    "[TT]-dens[tt] like [TT]mass,charge[tt], are computed from the same pass",
+    "over the trajectory; each output then gets one file per type, with the",
+    "name of the type added before the extension.",
+    "For electron densities, a file describing the number of",
     "electrons for each type of atom should be provided using [TT]-ei[tt].",
     "It should look like:[BR]",
     "   [TT]2[tt][BR]",
@@ -416,41 +745,99 @@ int gmx_mydensity(int argc,char *argv[])
     "The number of electrons for each atom is modified by its atomic",
     "partial charge.",
     "[PAR]",
-    "WARNING: This is a modified version of g_density. It allows to calculate partial density landscapes on a grid (using the [TT]-og[tt] option) and partial density profile as a function of the distance from a group (using the [TT]-od[tt] option). In the latter case, distances are calculated in the plane normal to the axis given with the [TT]-d[tt] option. To get the distances in 3D, use the [TT]-3d[tt] option."
+    "WARNING: This is a modified version of g_density. It allows to calculate partial density landscapes on a grid (using the [TT]-og[tt] option), 3D partial densities on voxels (using the [TT]-ov[tt] option) and partial density profile as a function of the distance from a group (using the [TT]-od[tt] option). In the latter case, distances are calculated in the plane normal to the axis given with the [TT]-d[tt] option. To get the distances in 3D, use the [TT]-3d[tt] option.",
+    "[PAR]",
+    "The raw sums of every output are written to the [TT]-cpo[tt] file. Several of these files, from runs over different parts of a trajectory, can be combined with [TT]-merge[tt] instead of [TT]-f[tt]; the index groups and output options must be the same as for these runs. The options that act on the frames ([TT]-cpi[tt], [TT]-fc[tt], [TT]-oc[tt], [TT]-pbcsel[tt], [TT]-cgrp[tt], [TT]-nt[tt], [TT]-nbuf[tt], [TT]-block[tt], [TT]-b[tt] and [TT]-e[tt]) can not be used with [TT]-merge[tt].",
+    "[PAR]",
+    "[TT]-oc[tt] writes the coordinates of the atoms the analysis reads, made whole and centered, with the boxes, to a compact cache. Later runs read it with [TT]-fc[tt] instead of [TT]-f[tt], for instance to try other numbers of slices; their groups must be part of the cached atoms, and [TT]-center[tt] must be set as when the cache was written.",
+    "[PAR]",
+    "With [TT]-block[tt] N, the densities of every block of N consecutive frames are appended to [TT]-ob[tt] while the trajectory is read, one set per block, besides the averages over all the frames. The grids and the distance profiles of the blocks are written too when [TT]-obg[tt] and [TT]-obd[tt] are set. The memory used does not depend on the number of blocks."
   };
 
   output_env_t oenv;
-  static const char *dens_opt[] = 
-    { NULL, "mass", "number", "charge", "electron", NULL };
+  static const char *dens_opt = "mass";
+  static const char *ogfmt_opt[] =
+    { NULL, "text", "npz", "sparse", NULL };
+  static const char *ovfmt_opt[] =
+    { NULL, "dx", "npz", NULL };
+  static rvec vslices = {0, 0, 0}; /* nr of voxels along each vector */
+  static real grid_mem = 1024;   /* MB above which grids are sparse */
+  static real skin = 0;          /* Verlet skin of -od, in nm  */
+  static real edt_spacing = 0;   /* distance grid of -od, in nm */
+  static gmx_bool bEdtInterp=TRUE;
+  static int  nstedtcheck = 0;   /* frames between grid checks */
   static int  axis = 2;          /* normal to memb. default z  */
+  int  axes[DIM];                /* axes of the slab profiles  */
+  int  naxes = 0;
   static const char *axtitle="Z"; 
   static int  nslices = 50;      /* nr of slices defined       */
   static int  nslices2 = -1;      /* nr of slices defined       */
   static int  ngrps   = 1;       /* nr. of groups              */
+  static int  nref    = 1;       /* nr. of reference groups    */
   static gmx_bool bSymmetrize=FALSE;
   static gmx_bool bCenter=FALSE;
+  static gmx_bool bCenterGroup=FALSE;
+  static gmx_bool bSelPBC=FALSE;
   static gmx_bool b3D=TRUE;
   static gmx_bool bCOM=FALSE;
+  static int  nthreads = 1;      /* nr. of analysis threads    */
+  static int  nstcpt = 0;        /* frames between checkpoints */
+  static int  nbuf = 0;          /* frames decoded ahead       */
+  static int  nblock = 0;        /* frames per block           */
+  static gmx_bool bTiming=FALSE;
+  static const char *timing_json="";
   t_pargs pa[] = {
     { "-d", FALSE, etSTR, {&axtitle}, 
-      "Take the normal on the membrane in direction X, Y or Z." },
+      "Take the normal on the membrane in direction X, Y or Z. Several axes, like XYZ, give one density profile per axis from the same pass over the trajectory, written to [TT]-o[tt] with the axis letter added to the name; the first axis is the normal used by [TT]-center[tt], [TT]-og[tt] and [TT]-od[tt]." },
     { "-sl",  FALSE, etINT, {&nslices},
       "Divide the box in #nr slices." },
     { "-sl2",  FALSE, etINT, {&nslices2},
       "Divide the box second dimension in #nr slices." },
-    { "-dens",    FALSE, etENUM, {dens_opt},
-      "Density"},
+    { "-dens",    FALSE, etSTR, {&dens_opt},
+      "Density: mass, number, charge or electron, or a comma separated list of these"},
+    { "-ogfmt",   FALSE, etENUM, {ogfmt_opt},
+      "Format of the [TT]-og[tt] output: text, a NumPy .npz archive of float64 arrays, or a .npz archive of the non-empty cells only"},
+    { "-ogmem",   FALSE, etREAL, {&grid_mem},
+      "Memory in MB, counting one copy of the grids per thread and one for the current [TT]-block[tt], above which the [TT]-og[tt] grids are stored as tiles allocated when first touched; 0 to always store them densely"},
+    { "-vsl",     FALSE, etRVEC, {vslices},
+      "Number of voxels along each box vector for [TT]-ov[tt]; 0 means the value of [TT]-sl[tt]" },
+    { "-ovfmt",   FALSE, etENUM, {ovfmt_opt},
+      "Format of the [TT]-ov[tt] output: OpenDX files, one per group, or a NumPy .npz archive of float64 arrays"},
     { "-ng",       FALSE, etINT, {&ngrps},
       "Number of groups to compute densities of" },
+    { "-nref",     FALSE, etINT, {&nref},
+      "Number of reference groups for [TT]-od[tt]; each one gets its own output file, numbered after the [TT]-od[tt] name when there are several" },
     { "-symm",    FALSE, etBOOL, {&bSymmetrize},
       "Symmetrize the density along the axis, with respect to the center. Useful for bilayers." },
     { "-center",  FALSE, etBOOL, {&bCenter},
       "Shift the center of mass along the axis to zero. This means if your axis is Z and your box is bX, bY, bZ, the center of mass will be at bX/2, bY/2, 0."},
+    { "-cgrp",  FALSE, etBOOL, {&bCenterGroup},
+      "With [TT]-center[tt], center on the center of mass of a group chosen from the index instead of the whole system."},
+    { "-pbcsel",  FALSE, etBOOL, {&bSelPBC},
+      "Only make whole the molecules that contain atoms of the analysed groups, of the reference group, or of the centering group. Consecutive atoms of a molecule must be closer than half the box. With [TT]-center[tt], it requires [TT]-cgrp[tt]: the center of mass of the whole system would include molecules that are not made whole."},
     { "-3d",  FALSE, etBOOL, {&b3D}, "Calculate distance in 3D instead of 2D."},
-    /*
-     * { "-com",  FALSE, etBOOL, {&bCOM},
-     *   "Use distance to the center of mass instead of minimum distance."}
-     */
+    { "-skin", FALSE, etREAL, {&skin},
+      "With [TT]-od[tt], keep for each atom the reference atoms at most this distance (nm) farther than its nearest one, and only search the whole reference group again when the atoms moved by more than half of it; 0 searches at every frame. The distances are the same either way." },
+    { "-edt", FALSE, etREAL, {&edt_spacing},
+      "With [TT]-od[tt], approximate the minimum distances with a distance transform on a grid of this spacing (nm), rebuilt at each frame; the error is at most about the diagonal of a grid cell. 0 computes them exactly." },
+    { "-edtint", FALSE, etBOOL, {&bEdtInterp},
+      "With [TT]-edt[tt], interpolate the distances between the grid nodes instead of taking the one of the nearest node" },
+    { "-edtchk", FALSE, etINT, {&nstedtcheck},
+      "With [TT]-edt[tt], compare the approximate distances with the exact ones every #nr frames and print the statistics of the errors; 0 means never" },
+    { "-nt",  FALSE, etINT, {&nthreads},
+      "Number of threads analysing frames in parallel; frames are decoded by the main thread." },
+    { "-timing", FALSE, etBOOL, {&bTiming},
+      "Print the time spent in each phase of the analysis, and the throughput" },
+    { "-tjson", FALSE, etSTR, {&timing_json},
+      "With [TT]-timing[tt], also write the timings to this JSON file" },
+    { "-nbuf", FALSE, etINT, {&nbuf},
+      "Number of frames the reading thread can decode ahead of the analysis; 0 means twice [TT]-nt[tt] with several threads and no read-ahead with one" },
+    { "-cpt", FALSE, etINT, {&nstcpt},
+      "Write the accumulated sums to the [TT]-cpo[tt] file every #nr frames (0 means only at the end when [TT]-cpo[tt] is set)" },
+    { "-block", FALSE, etINT, {&nblock},
+      "Append the densities of each block of #nr frames to [TT]-ob[tt], and to [TT]-obg[tt] and [TT]-obd[tt] when they are set; 0 means no blocks. Can not be used with [TT]-cpi[tt]" },
+    { "-com",  FALSE, etBOOL, {&bCOM},
+      "Use distance to the center of mass of the reference group instead of minimum distance. The reference group must be smaller than half the box."},
   };
 
   const char *bugs[] = {
@@ -458,27 +845,52 @@ int gmx_mydensity(int argc,char *argv[])
   };
   
   real **density;      /* density per slice          */
-  real slWidth;          /* width of one slice         */
+  real slWidth[DIM];     /* width of one slice per axis */
   char **grpname;        /* groupnames                 */
-  int  nr_electrons;     /* nr. electrons              */
+  int  nr_electrons=0;   /* nr. electrons              */
   int  *ngx;             /* sizes of groups            */
-  t_electron *el_tab;    /* tabel with nr. of electrons*/
+  t_electron *el_tab=NULL; /* tabel with nr. of electrons*/
+  char dens[BIN_MAX_CHANNELS+1]; /* type of each density  */
+  int  ndens;
+  real **weights;        /* weight of each atom per type */
   t_topology *top;       /* topology 		       */ 
   int  ePBC;
   atom_id   **index;     /* indices for all groups     */
-  int  i;
+  int  i, a, c;
+  char *out_fn, *dens_fn;
+  RunOptions run;          /* how the frames are read */
+  char *cgrpname = NULL;   /* centering group            */
+  atom_id *cindex = NULL;
+  int  csize = 0;
+  char **merge_fns = NULL; /* partial results to merge  */
+  int  nmerge;
+  const char *frame_opt = NULL; /* option acting on the frames */
 
+  Timing *timing = NULL;
   GridHeight *grid_store = NULL;
+  VoxelGrid *voxel_store = NULL;
+  int  vshape[DIM];
   DistMode *dist_store = NULL;
+  BlockOutput *blocks = NULL;
+  char **block_fns;
 
   t_filenm  fnm[] = {    /* files for g_density 	  */
-    { efTRX, "-f", NULL,  ffREAD },  
+    { efTRX, "-f", NULL,  ffOPTRD },  
     { efNDX, NULL, NULL,  ffOPTRD }, 
     { efTPX, NULL, NULL,  ffREAD },    	    
     { efDAT, "-ei", "electrons", ffOPTRD }, /* file with nr. of electrons */
     { efXVG,"-o","density",ffWRITE }, 	    
     { efDAT,"-og","density_grid",ffOPTWR }, 	    
+    { efDAT,"-ov","density_vox",ffOPTWR },
     { efDAT,"-od","density_dist",ffOPTWR }, 	    
+    { efCPT,"-cpi","density_state",ffOPTRD },
+    { efCPT,"-cpo","density_state",ffOPTWR },
+    { efCPT,"-merge","density_part",ffOPTRDMULT },
+    { efDAT,"-oc","density_cache",ffOPTWR },
+    { efDAT,"-fc","density_cache",ffOPTRD },
+    { efXVG,"-ob","density_block",ffOPTWR },
+    { efDAT,"-obg","density_grid_block",ffOPTWR },
+    { efXVG,"-obd","density_dist_block",ffOPTWR },
   };
   
 #define NFILE asize(fnm)
@@ -489,21 +901,62 @@ int gmx_mydensity(int argc,char *argv[])
 		    NFILE,fnm,asize(pa),pa,asize(desc),desc,asize(bugs),bugs,
                     &oenv);
 
+  if (bTiming)
+    timing = build_timing();
+
   if (bSymmetrize && !bCenter) {
     fprintf(stderr,"Can not symmetrize without centering. Turning on -center\n");
     bCenter = TRUE;
   }
-  /* Calculate axis */
-  axis = toupper(axtitle[0]) - 'X';
+  /* Only the molecules of the used atoms are made whole, so the center of
+   * mass of the whole system would be taken over broken molecules */
+  if (bSelPBC && bCenter && !bCenterGroup)
+    gmx_fatal(FARGS,"-pbcsel with -center requires a centering group "
+              "(-cgrp)\n");
+  /* Calculate axes */
+  for (i = 0; axtitle[i] != '\0'; i++) {
+    axis = toupper(axtitle[i]) - 'X';
+    if (axis < 0 || axis >= DIM)
+      gmx_fatal(FARGS,"Invalid axes. Terminating\n");
+    for (a = 0; a < naxes; a++)
+      if (axes[a] == axis)
+        gmx_fatal(FARGS,"Axis %c is given twice\n", 'X' + axis);
+    axes[naxes++] = axis;
+  }
+  if (naxes == 0)
+    gmx_fatal(FARGS,"Invalid axes. Terminating\n");
+  axis = axes[0];
+  /* The partial results are summed as they are, so the options acting on
+   * the frames of a trajectory would be silently ignored */
+  if (opt2bSet("-merge", NFILE, fnm)) {
+    if (nblock > 0)
+      frame_opt = "-block";
+    else if (opt2bSet("-cpi", NFILE, fnm))
+      frame_opt = "-cpi";
+    else if (opt2bSet("-fc", NFILE, fnm))
+      frame_opt = "-fc";
+    else if (opt2bSet("-oc", NFILE, fnm))
+      frame_opt = "-oc";
+    else if (bSelPBC)
+      frame_opt = "-pbcsel";
+    else if (bCenterGroup)
+      frame_opt = "-cgrp";
+    else if (nthreads != 1)
+      frame_opt = "-nt";
+    else if (nbuf != 0)
+      frame_opt = "-nbuf";
+    else if (bTimeSet(TBEGIN))
+      frame_opt = "-b";
+    else if (bTimeSet(TEND))
+      frame_opt = "-e";
+    if (frame_opt)
+      gmx_fatal(FARGS,"%s needs the frames of a trajectory, it can not be "
+                "used with -merge\n", frame_opt);
+  }
+  parse_dens(dens_opt, dens);
+  ndens = strlen(dens);
   
   top = read_top(ftp2fn(efTPX,NFILE,fnm),&ePBC);     /* read topology file */
-  if (dens_opt[0][0] == 'n') {
-    for(i=0; (i<top->atoms.nr); i++)
-      top->atoms.atom[i].m = 1;  
-  } else if (dens_opt[0][0] == 'c') {
-    for(i=0; (i<top->atoms.nr); i++)
-      top->atoms.atom[i].m = top->atoms.atom[i].q;  
-  }
 
   snew(grpname,ngrps);
   snew(index,ngrps);
@@ -511,37 +964,123 @@ int gmx_mydensity(int argc,char *argv[])
  
   get_index(&top->atoms,ftp2fn_null(efNDX,NFILE,fnm),ngrps,ngx,index,grpname); 
 
-  if (dens_opt[0][0] == 'e') {
+  if (bCenter && bCenterGroup) {
+    fprintf(stderr,"\nSelect the group to center on:\n");
+    get_index(&top->atoms,ftp2fn_null(efNDX,NFILE,fnm),1,&csize,&cindex,
+              &cgrpname);
+  }
+
+  if (strchr(dens, 'e') != NULL) {
     nr_electrons =  get_electrons(&el_tab,ftp2fn(efDAT,NFILE,fnm));
     fprintf(stderr,"Read %d atomtypes from datafile\n", nr_electrons);
+  }
+  weights = get_weights(top, index, ngx, ngrps, dens, el_tab, nr_electrons);
 
-    calc_electron_density(ftp2fn(efTRX,NFILE,fnm),index, ngx, &density, 
-			  &nslices, top, ePBC, axis, ngrps, &slWidth, el_tab, 
-			  nr_electrons,bCenter,oenv);
+  if (opt2fn_null("-og",NFILE,fnm)) {
+      if (nslices2 <= 0) {
+          nslices2 = nslices;
+      }
+      /* The totals, one copy per thread, and the current block */
+      grid_store = build_grids((int[2]){nslices, nslices2}, axis, ngrps,
+              opt2fn("-og",NFILE,fnm), dens, ogfmt_opt[0][0],
+              (const char **)grpname,
+              grid_mem * 1e6 / (nthreads + 1 + (nblock > 0)));
+  }
+  if (opt2bSet("-ov", NFILE, fnm)) {
+      for (i = 0; i < DIM; i++) {
+          vshape[i] = (vslices[i] > 0) ? (int)(vslices[i] + 0.5) : nslices;
+      }
+      voxel_store = build_voxels(vshape, ngrps, opt2fn("-ov",NFILE,fnm),
+              dens, ovfmt_opt[0][0], (const char **)grpname);
+  }
+  if (opt2bSet("-od", NFILE, fnm)) {
+      if (skin > 0 && edt_spacing > 0)
+          gmx_fatal(FARGS,"-skin and -edt can not be used together\n");
+      dist_store = build_dist(nslices, axis, ngrps, dens,
+              opt2fn("-od",NFILE,fnm), oenv, ftp2fn(efNDX,NFILE,fnm), top,
+              (const char **)grpname, b3D, bCOM, nref, skin, edt_spacing,
+              bEdtInterp, nstedtcheck);
+  }
+  if (nblock > 0) {
+      if (opt2bSet("-cpi", NFILE, fnm))
+          gmx_fatal(FARGS,"-block can not be used with -cpi, the block open at the checkpoint would be lost\n");
+      if (opt2bSet("-obg", NFILE, fnm) && grid_store == NULL)
+          gmx_fatal(FARGS,"-obg needs the grids of -og\n");
+      if (opt2bSet("-obd", NFILE, fnm) && dist_store == NULL)
+          gmx_fatal(FARGS,"-obd needs the distance profiles of -od\n");
+      snew(block_fns, ndens*naxes);
+      for (c = 0; c < ndens; c++) {
+          dens_fn = dens_output_fn(opt2fn("-ob",NFILE,fnm), dens[c], ndens);
+          for (a = 0; a < naxes; a++)
+              block_fns[c*naxes + a] = axis_fn(dens_fn, axes[a], naxes);
+          sfree(dens_fn);
+      }
+      blocks = build_block_output(nblock, naxes, block_fns,
+              opt2fn_null("-obg",NFILE,fnm), opt2fn_null("-obd",NFILE,fnm),
+              nref, ngrps, (const char **)grpname, dens, oenv);
+      for (a = 0; a < ndens*naxes; a++)
+          sfree(block_fns[a]);
+      sfree(block_fns);
+  }
+  run.bCenter = bCenter;
+  run.cindex = cindex;
+  run.csize = csize;
+  run.bSelPBC = bSelPBC;
+  run.nthreads = nthreads;
+  run.nbuf = nbuf;
+  run.cpi_fn = opt2fn_null("-cpi", NFILE, fnm);
+  run.cpo_fn = NULL;
+  if (nstcpt > 0 || opt2bSet("-cpo", NFILE, fnm)) {
+      run.cpo_fn = opt2fn("-cpo", NFILE, fnm);
+  }
+  run.nstcpt = nstcpt;
+  run.cache_in_fn = opt2fn_null("-fc", NFILE, fnm);
+  run.cache_out_fn = opt2fn_null("-oc", NFILE, fnm);
+  run.blocks = blocks;
+  run.timing = timing;
+  if (opt2bSet("-merge", NFILE, fnm)) {
+      nmerge = opt2fns(&merge_fns, "-merge", NFILE, fnm);
+      merge_density(merge_fns, nmerge, index, ngx, &density, &nslices, top,
+                    ePBC, axes, naxes, ngrps, slWidth, dens, weights,
+                    grid_store, voxel_store, dist_store, &run);
   } else {
-    if (opt2fn_null("-og",NFILE,fnm)) {
-        if (nslices2 <= 0) {
-            nslices2 = nslices;
-        }
-        grid_store = build_grids((int[2]){nslices, nslices2}, axis, ngrps,
-                opt2fn("-og",NFILE,fnm), dens_opt[0][0]);
-    }
-    if (opt2bSet("-od", NFILE, fnm)) {
-        dist_store = build_dist(nslices, axis, ngrps, dens_opt[0][0],
-                opt2fn("-od",NFILE,fnm), oenv, ftp2fn(efNDX,NFILE,fnm), top,
-                (const char **)grpname, b3D, bCOM);
-    }
-    calc_density(ftp2fn(efTRX,NFILE,fnm),index, ngx, &density, &nslices, top, 
-		 ePBC, axis, ngrps, &slWidth, bCenter,oenv, grid_store, dist_store); 
-	clean_grids(grid_store);
-	clean_dist(dist_store);
+      calc_density(ftp2fn(efTRX,NFILE,fnm),index, ngx, &density, &nslices,
+                   top, ePBC, axes, naxes, ngrps, slWidth, dens, weights,
+                   oenv, grid_store, voxel_store, dist_store, &run);
   }
+  clean_block_output(blocks);
+  clean_grids(grid_store);
+  clean_voxels(voxel_store);
+  clean_dist(dist_store);
+  for (c = 0; c < ndens; c++)
+    sfree(weights[c]);
+  sfree(weights);
   
-  plot_density(density, opt2fn("-o",NFILE,fnm),
-	       nslices, ngrps, grpname, slWidth, dens_opt,
-	       bSymmetrize,oenv);
+  timing_start(timing);
+  for (c = 0; c < ndens; c++) {
+    dens_fn = dens_output_fn(opt2fn("-o",NFILE,fnm), dens[c], ndens);
+    for (a = 0; a < naxes; a++) {
+      out_fn = axis_fn(dens_fn, axes[a], naxes);
+      plot_density(density + (c*naxes + a)*ngrps, out_fn,
+                   nslices, ngrps, grpname, slWidth[a], dens[c],
+                   bSymmetrize,oenv);
+      sfree(out_fn);
+    }
+    sfree(dens_fn);
+  }
+  timing_stop(timing, etimOUTPUT);
+
+  timing_end(timing);
+  timing_report(timing, stderr);
+  if (timing && timing_json[0] != '\0')
+    timing_write_json(timing, timing_json);
+  clean_timing(timing);
   
-  do_view(oenv,opt2fn("-o",NFILE,fnm), "-nxy");       /* view xvgr file */
+  dens_fn = dens_output_fn(opt2fn("-o",NFILE,fnm), dens[0], ndens);
+  out_fn = axis_fn(dens_fn, axes[0], naxes);
+  sfree(dens_fn);
+  do_view(oenv,out_fn, "-nxy");       /* view xvgr file */
+  sfree(out_fn);
   thanx(stderr);
   return 0;
 }
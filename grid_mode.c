@@ -1,13 +1,71 @@
 #include "grid_mode.h"
 
+/** Allocate the empty grids of an instance of GridHeight, dense or sparse
+ * according to its bSparse field
+ */
+static void grid_alloc(GridHeight *grid) {
+    int d;
+
+    for (d=0; d<2; ++d) {
+        grid->ntiles[d] = (grid->shape[d] + GRID_TILE - 1) >> GRID_TILE_SHIFT;
+    }
+    grid->grids = NULL;
+    grid->tiles = NULL;
+    grid->pool = NULL;
+    grid->npool = 0;
+    grid->pool_free = 0;
+    if (grid->bSparse) {
+        snew(grid->tiles, grid_ntiles(grid));
+    }
+    else {
+        grid->grids = realBlock(grid_ngrids(grid), grid->shape[0],
+                grid->shape[1], 0.0);
+    }
+}
+
+/** Take a new tile, filled with zeros, from the pool of a sparse grid
+ */
+static real *grid_new_tile(GridHeight *grid) {
+    if (grid->pool_free == 0) {
+        srenew(grid->pool, grid->npool + 1);
+        snew_aligned(grid->pool[grid->npool],
+                GRID_POOL_TILES * GRID_TILE_SIZE, 64);
+        grid->npool++;
+        grid->pool_free = GRID_POOL_TILES;
+    }
+    return grid->pool[grid->npool - 1]
+        + (size_t)(GRID_POOL_TILES - grid->pool_free--) * GRID_TILE_SIZE;
+}
+
+/** Get a tile of a sparse grid, allocating it on first touch
+ */
+static inline real *grid_tile(GridHeight *grid, size_t tile) {
+    if (grid->tiles[tile] == NULL) {
+        grid->tiles[tile] = grid_new_tile(grid);
+    }
+    return grid->tiles[tile];
+}
+
 /** Contruct an instance of GridHeight
  *
  * All the dimensions described in the "shape" array have to be greater than 0.
+ * The output is written as text if "format" is 't', as a NumPy .npz
+ * archive if it is 'n', or as a .npz archive of the non-empty cells if it
+ * is 's'. The group names are used in the npz outputs.
+ *
+ * "dens" lists the types of density, one per channel; with several types,
+ * each one is written to its own file, named by dens_output_fn.
+ *
+ * The grids are sparse when the dense block would take more than
+ * "max_dense" bytes; 0 means always dense.
  */
 GridHeight *build_grids(int shape[2], int normal_axis, int ngroups,
-        const char *grid_fn, char dens) {
+        const char *grid_fn, const char *dens, char format,
+        const char **names, double max_dense) {
     GridHeight *grid_store;
-    int grid, i;
+    double dense_size;
+    char *fn;
+    int i, c;
 
     /* Check dimensions */
     if (shape[0] <= 0 || shape[1] <= 0) {
@@ -16,14 +74,24 @@ GridHeight *build_grids(int shape[2], int normal_axis, int ngroups,
                 shape[0], shape[1]);
         exit(1);
     }
+    if (strlen(dens) == 0 || strlen(dens) > BIN_MAX_CHANNELS) {
+        gmx_fatal(FARGS, "Invalid number of density types: %d\n",
+                (int)strlen(dens));
+    }
 
     /* Allocate empty structure */
     snew(grid_store, 1);
     
     grid_store->nframes = 0;
     grid_store->ngroups = ngroups;
+    grid_store->nchannels = strlen(dens);
     grid_store->invvol = 0;
-    grid_store->dens = dens;
+    for (c=0; c<grid_store->nchannels; ++c) {
+        grid_store->dens[c] = dens[c];
+    }
+    grid_store->format = format;
+    grid_store->names = names;
+    grid_store->grid_fn = strdup(grid_fn);
     for (i=0; i<2; ++i) {
         /* Store the shape */
         grid_store->shape[i] = shape[i];
@@ -48,36 +116,131 @@ GridHeight *build_grids(int shape[2], int normal_axis, int ngroups,
             gmx_fatal(FARGS,"Invalid axes. Terminating. \n");
     }
 
-    /* Allocate the grids */
-    snew(grid_store->grids, ngroups);
-    for (grid = 0; grid < ngroups; ++grid) {
-        (grid_store->grids)[grid] = realMatrix(shape[0], shape[1], 0.0);
+    /* Allocate the grids, as tiles if the dense block is too large */
+    dense_size = (double)grid_ngrids(grid_store) * shape[0] * shape[1]
+        * sizeof(real);
+    grid_store->bSparse = (max_dense > 0 && dense_size > max_dense);
+    if (grid_store->bSparse) {
+        fprintf(stderr, "The grids would take %.0f MB, they are stored as "
+                "tiles of %dx%d cells allocated when first touched\n",
+                dense_size / 1e6, GRID_TILE, GRID_TILE);
     }
+    grid_alloc(grid_store);
 
-    /* Open the files */
-    grid_store->out_grid = ffopen(grid_fn, "w");
-    if (grid_store->out_grid == NULL) {
-        fprintf(stderr, "Error oppenning %s for grid mode\n", grid_fn);
-        exit(1);
+    /* Open the files; the npz archive is only written at the end */
+    for (c=0; c<BIN_MAX_CHANNELS; ++c) {
+        grid_store->out_grid[c] = NULL;
+    }
+    for (c=0; c<grid_store->nchannels && format == 't'; ++c) {
+        fn = dens_output_fn(grid_fn, dens[c], grid_store->nchannels);
+        grid_store->out_grid[c] = ffopen(fn, "w");
+        if (grid_store->out_grid[c] == NULL) {
+            fprintf(stderr, "Error oppenning %s for grid mode\n", fn);
+            exit(1);
+        }
+        sfree(fn);
     }
 
     return grid_store;
 }
 
+/** Contruct an empty instance of GridHeight with the same shape as "src"
+ *
+ * The copy has no output file; it is meant to be summed back into "src" with
+ * grid_reduce. Returns NULL if "src" is NULL.
+ */
+GridHeight *copy_grids(GridHeight *src) {
+    GridHeight *grid_store;
+    int c;
+
+    if (src == NULL) {
+        return NULL;
+    }
+    snew(grid_store, 1);
+    *grid_store = *src;
+    grid_store->nframes = 0;
+    grid_store->box_width[0] = 0.0;
+    grid_store->box_width[1] = 0.0;
+    for (c=0; c<BIN_MAX_CHANNELS; ++c) {
+        grid_store->out_grid[c] = NULL;
+    }
+    grid_store->grid_fn = NULL;
+    grid_alloc(grid_store);
+    return grid_store;
+}
+
 /** Clean an instance of GridHeight
  */
 void clean_grids(GridHeight *grid_store) {
-    int grid = 0;
+    int i;
     if (grid_store) {
-        for (grid = 0; grid < grid_store->ngroups; ++grid) {
-            deleteRealMat(grid_store->grids[grid], grid_store->shape[0]);
+        deleteRealBlock(grid_store->grids);
+        for (i=0; i<grid_store->npool; ++i) {
+            sfree_aligned(grid_store->pool[i]);
         }
-        sfree(grid_store->grids);
-        ffclose(grid_store->out_grid);
+        sfree(grid_store->pool);
+        sfree(grid_store->tiles);
+        for (i=0; i<BIN_MAX_CHANNELS; ++i) {
+            if (grid_store->out_grid[i]) {
+                ffclose(grid_store->out_grid[i]);
+            }
+        }
+        sfree(grid_store->grid_fn);
         sfree(grid_store);
     }
 }
 
+/** Add the grids, the frame count and the box widths of "src" to "dst"
+ */
+void grid_reduce(GridHeight *dst, GridHeight *src) {
+    size_t cell, ncells, tile;
+    int i;
+    if (dst && src) {
+        if (src->bSparse) {
+            for (tile = 0; tile < grid_ntiles(src); ++tile) {
+                if (src->tiles[tile]) {
+                    grid_tile_add(dst, tile, src->tiles[tile]);
+                }
+            }
+        }
+        else {
+            ncells = grid_index(dst, grid_ngrids(dst), 0, 0);
+            for (cell = 0; cell < ncells; ++cell) {
+                dst->grids[cell] += src->grids[cell];
+            }
+        }
+        dst->nframes += src->nframes;
+        for (i = 0; i < 2; ++i) {
+            dst->box_width[i] += src->box_width[i];
+        }
+    }
+}
+
+/** Set the grids, the frame count and the box widths back to zero
+ *
+ * The tiles of a sparse grid are kept, so a grid filled again over the same
+ * cells does not allocate more memory.
+ */
+void reset_grids(GridHeight *grid) {
+    int i;
+    if (grid) {
+        if (grid->bSparse) {
+            for (i = 0; i < grid->npool; ++i) {
+                memset(grid->pool[i], 0,
+                        GRID_POOL_TILES * GRID_TILE_SIZE * sizeof(real));
+            }
+        }
+        else {
+            memset(grid->grids, 0,
+                    grid_index(grid, grid_ngrids(grid), 0, 0)
+                    * sizeof(real));
+        }
+        grid->nframes = 0;
+        grid->box_width[0] = 0.0;
+        grid->box_width[1] = 0.0;
+    }
+}
+
 void grid_start_frame(GridHeight *grid_store, matrix box) {
     int i = 0;
     int axis = 0;
@@ -90,60 +253,396 @@ void grid_start_frame(GridHeight *grid_store, matrix box) {
         }
         grid_store->invvol = (grid_store->shape[0] * grid_store->shape[1])/
             (box[XX][XX] * box[YY][YY] * box[ZZ][ZZ]);
+        copy_mat(box, grid_store->box);
+        grid_store->bRect = (box[YY][XX] == 0 && box[ZZ][XX] == 0
+                && box[ZZ][YY] == 0);
     }
 }
 
-void grid_store(GridHeight *grid, int group, rvec atom, t_pbc *pbc, real mass) {
-    int slice[2] = {0, 0};
-    int i = 0;
+/** Add the atoms of the frame to the grids of their groups, one per
+ * channel
+ *
+ * The bins are the ones of the geometry of the frame, shared with the other
+ * modes, and are used by all the channels and groups.
+ * Parameters :
+ *  - grid  : the grid mode, nothing is done if it is NULL
+ *  - buf   : scratch buffers, with the geometry and the weights of the
+ *            atoms
+ */
+void grid_store(GridHeight *grid, BinBuffer *buf) {
+    int i, c, g, n = buf->n;
+    const unsigned int *mask;
+    const int *bin, *bin2;
+    rvec *xbox;
+    real *tile, *weight;
     if (grid) {
-        put_atom_in_box((real (*)[3])pbc->box,atom);
-        for (i =0; i<2; ++i) {
-            slice[i] = atom[grid->axis[i+1]]/grid->width[i];
+        if (grid->bRect) {
+            bin = bin_geometry_bins(buf, grid->axis[1], grid->shape[0]);
+            bin2 = bin_geometry_bins(buf, grid->axis[2], grid->shape[1]);
+        }
+        else {
+            /* Triclinic boxes need the box vectors to wrap the atoms */
+            xbox = bin_geometry_in_box(buf);
+            for (i=0; i<n; ++i) {
+                buf->bin[i] = xbox[i][grid->axis[1]]/grid->width[0];
+                buf->bin2[i] = xbox[i][grid->axis[2]]/grid->width[1];
+            }
+            bin = buf->bin;
+            bin2 = buf->bin2;
+        }
+        if (grid->bSparse) {
+            for (c=0; c<grid->nchannels; ++c) {
+                weight = bin_weights(buf, c);
+                for (i=0; i<n; ++i) {
+                    mask = buf->mask + (size_t)i * buf->nmask;
+                    for (g = bin_mask_next(mask, grid->ngroups, -1); g >= 0;
+                            g = bin_mask_next(mask, grid->ngroups, g)) {
+                        tile = grid_tile(grid, grid_tile_index(grid,
+                                    c * grid->ngroups + g, bin[i], bin2[i]));
+                        tile[grid_tile_offset(bin[i], bin2[i])] +=
+                            weight[i] * (double)grid->invvol;
+                    }
+                }
+            }
+            return;
+        }
+        for (i=0; i<n; ++i) {
+            buf->bin[i] = bin[i] * grid->shape[1] + bin2[i];
+        }
+        for (c=0; c<grid->nchannels; ++c) {
+            for (g=0; g<grid->ngroups; ++g) {
+                buf->hist[g] = grid->grids + grid_index(grid,
+                        c * grid->ngroups + g, 0, 0);
+            }
+            histogram_add_groups(buf->hist, buf->bin, bin_weights(buf, c),
+                    buf, grid->invvol);
         }
-        grid->grids[group][slice[0]][slice[1]] += mass*grid->invvol;
     }
 }
 
-void grid_end(GridHeight *grid_store) {
+/** Value of cell (i, j) of a grid, for dense or sparse grids
+ */
+real grid_value(const GridHeight *grid, int group, int i, int j) {
+    const real *tile;
+    if (grid->bSparse) {
+        tile = grid->tiles[grid_tile_index(grid, group, i, j)];
+        return tile ? tile[grid_tile_offset(i, j)] : 0;
+    }
+    return grid->grids[grid_index(grid, group, i, j)];
+}
+
+/** Total number of tiles of the grids, whether they are sparse or not
+ */
+size_t grid_ntiles(const GridHeight *grid) {
+    return (size_t)grid_ngrids(grid) * grid->ntiles[0] * grid->ntiles[1];
+}
+
+/** First cell (i, j) of a tile, and its grid
+ */
+static void grid_tile_origin(const GridHeight *grid, size_t tile, int *group,
+        int *i, int *j) {
+    size_t per_group = (size_t)grid->ntiles[0] * grid->ntiles[1];
+    *group = tile / per_group;
+    *i = ((tile % per_group) / grid->ntiles[1]) << GRID_TILE_SHIFT;
+    *j = ((tile % per_group) % grid->ntiles[1]) << GRID_TILE_SHIFT;
+}
+
+/** Add the cells of a tile to "values", laid out as in a sparse tile
+ *
+ * Tiles work on dense grids too, so the grids can be saved and read back
+ * tile by tile whatever their storage. Returns FALSE, without touching
+ * "values", if the grids are sparse and the tile was never touched.
+ */
+gmx_bool grid_tile_get(const GridHeight *grid, size_t tile, real *values) {
+    int group, i0, j0, i, j, imax, jmax;
+
+    if (grid->bSparse) {
+        if (grid->tiles[tile] == NULL) {
+            return FALSE;
+        }
+        for (i=0; i<GRID_TILE_SIZE; ++i) {
+            values[i] += grid->tiles[tile][i];
+        }
+        return TRUE;
+    }
+    grid_tile_origin(grid, tile, &group, &i0, &j0);
+    imax = min(i0 + GRID_TILE, grid->shape[0]);
+    jmax = min(j0 + GRID_TILE, grid->shape[1]);
+    for (i=i0; i<imax; ++i) {
+        for (j=j0; j<jmax; ++j) {
+            values[grid_tile_offset(i, j)] +=
+                grid->grids[grid_index(grid, group, i, j)];
+        }
+    }
+    return TRUE;
+}
+
+/** Add values laid out as in a sparse tile to the cells of a tile
+ */
+void grid_tile_add(GridHeight *grid, size_t tile, const real *values) {
+    int group, i0, j0, i, j, imax, jmax;
+    real *dst;
+
+    if (grid->bSparse) {
+        dst = grid_tile(grid, tile);
+        for (i=0; i<GRID_TILE_SIZE; ++i) {
+            dst[i] += values[i];
+        }
+        return;
+    }
+    grid_tile_origin(grid, tile, &group, &i0, &j0);
+    imax = min(i0 + GRID_TILE, grid->shape[0]);
+    jmax = min(j0 + GRID_TILE, grid->shape[1]);
+    for (i=i0; i<imax; ++i) {
+        for (j=j0; j<jmax; ++j) {
+            grid->grids[grid_index(grid, group, i, j)] +=
+                values[grid_tile_offset(i, j)];
+        }
+    }
+}
+
+/** Write the averaged grids of a channel as text
+ *
+ * The header gives the mean box widths, the axes and the unit; the grids of
+ * each group follow, one row per line, separated by "&&".
+ */
+static void write_grid_text(GridHeight *grid_store, int channel) {
     char labels[] = "XYZ";
+    FILE *out = grid_store->out_grid[channel];
+    char dens = grid_store->dens[channel];
     int i, j, group;
-    if (grid_store) {
-        for (group = 0; group < grid_store->ngroups; ++group) {
-            for (i=0; i < grid_store->shape[0]; ++i) {
-                for (j=0; j < grid_store->shape[1]; ++j) {
-                    grid_store->grids[group][i][j] /= grid_store->nframes;
-                    if (grid_store->dens == 'm') {
-                        grid_store->grids[group][i][j] *= AMU/(NANO*NANO*NANO);
-                    }
+
+    fprintf(out, "@xwidth %7.3f\n",
+            grid_store->box_width[0]/grid_store->nframes);
+    fprintf(out, "@ywidth %7.3f\n",
+            grid_store->box_width[1]/grid_store->nframes);
+    fprintf(out, "@xlabel %c (nm)\n", labels[grid_store->axis[1]]);
+    fprintf(out, "@ylabel %c (nm)\n", labels[grid_store->axis[2]]);
+    fprintf(out, "@legend Partial %s density (%s)\n",
+            dens_name(dens), dens_unit(dens));
+    for (group = 0; group < grid_store->ngroups; ++group) {
+        for (i=0; i < grid_store->shape[0]; ++i) {
+            for (j=0; j < grid_store->shape[1]; ++j) {
+                if (j > 0) {
+                    fprintf(out, "\t");
                 }
+                fprintf(out, "%7.3f", grid_value(grid_store,
+                            channel * grid_store->ngroups + group, i, j));
             }
+            fprintf(out, "\n");
         }
-        /* Write the output */
-        fprintf(grid_store->out_grid, "@xwidth %7.3f\n",
-                grid_store->box_width[0]/grid_store->nframes);
-        fprintf(grid_store->out_grid, "@ywidth %7.3f\n",
-                grid_store->box_width[1]/grid_store->nframes);
-        fprintf(grid_store->out_grid, "@xlabel %c (nm)\n",
-                labels[grid_store->axis[1]]);
-        fprintf(grid_store->out_grid, "@ylabel %c (nm)\n",
-                labels[grid_store->axis[2]]);
-        fprintf(grid_store->out_grid,
-                "@legend Partial mass density (kg/m^3)\n");
-        for (group = 0; group < grid_store->ngroups; ++group) {
-            for (i=0; i < grid_store->shape[0]; ++i) {
-                for (j=0; j < grid_store->shape[1]; ++j) {
-                    if (j > 0) {
-                        fprintf(grid_store->out_grid, "\t");
-                    }
-                    fprintf(grid_store->out_grid, "%7.3f",
-                            grid_store->grids[group][i][j]);
+        fprintf(out, "&&\n");
+    }
+}
+
+/** Add the description of the grids of a channel to a .npz archive
+ */
+static void write_grid_npz_info(GridHeight *grid_store, int channel,
+        NpzFile *npz) {
+    char labels[][2] = {"X", "Y", "Z"};
+    const char *axes[2];
+    const char *unit[1];
+    const char *type[1];
+    real width[2];
+    int shape[1];
+
+    width[0] = grid_store->box_width[0]/grid_store->nframes;
+    width[1] = grid_store->box_width[1]/grid_store->nframes;
+    shape[0] = 2;
+    npz_add_reals(npz, "width", 1, shape, width);
+    axes[0] = labels[grid_store->axis[1]];
+    axes[1] = labels[grid_store->axis[2]];
+    npz_add_strings(npz, "axes", 2, axes);
+    unit[0] = dens_unit(grid_store->dens[channel]);
+    npz_add_strings(npz, "unit", 1, unit);
+    type[0] = dens_name(grid_store->dens[channel]);
+    npz_add_strings(npz, "type", 1, type);
+    npz_add_strings(npz, "groups", grid_store->ngroups, grid_store->names);
+}
+
+/** Open the .npz archive of a channel
+ */
+static NpzFile *open_grid_npz(GridHeight *grid_store, int channel) {
+    NpzFile *npz;
+    char *fn;
+
+    fn = dens_output_fn(grid_store->grid_fn, grid_store->dens[channel],
+            grid_store->nchannels);
+    npz = npz_open(fn);
+    sfree(fn);
+    return npz;
+}
+
+/** Write the averaged grids of a channel as a NumPy .npz archive
+ *
+ * The archive holds:
+ *  - density : the grids, shaped (groups, first axis, second axis)
+ *  - width   : the mean box width along the two axes (nm)
+ *  - axes    : the names of the two axes
+ *  - unit    : the unit of the densities
+ *  - type    : the type of density
+ *  - groups  : the name of each group
+ */
+static void write_grid_npz(GridHeight *grid_store, int channel) {
+    real *row;
+    int shape[3];
+    int group, i, j, first;
+    NpzFile *npz;
+
+    npz = open_grid_npz(grid_store, channel);
+    first = channel * grid_store->ngroups;
+    shape[0] = grid_store->ngroups;
+    shape[1] = grid_store->shape[0];
+    shape[2] = grid_store->shape[1];
+    if (grid_store->bSparse) {
+        /* Written row by row, so the dense grids are never allocated */
+        snew(row, grid_store->shape[1]);
+        npz_begin_reals(npz, "density", 3, shape);
+        for (group = first; group < first + grid_store->ngroups; ++group) {
+            for (i = 0; i < grid_store->shape[0]; ++i) {
+                for (j = 0; j < grid_store->shape[1]; ++j) {
+                    row[j] = grid_value(grid_store, group, i, j);
                 }
-                fprintf(grid_store->out_grid, "\n");
+                npz_write_reals(npz, row, grid_store->shape[1]);
             }
-            fprintf(grid_store->out_grid, "&&\n");
         }
+        npz_end_reals(npz);
+        sfree(row);
+    }
+    else {
+        npz_add_reals(npz, "density", 3, shape,
+                grid_store->grids + grid_index(grid_store, first, 0, 0));
     }
+    write_grid_npz_info(grid_store, channel, npz);
+    npz_close(npz);
 }
 
+/** List the non-empty cells of the grids of a channel
+ *
+ * The cells are given tile after tile. If "cells" is not NULL, the group,
+ * first and second index of each cell are written in it, 3 indices per
+ * cell; if "values" is not NULL, the values are written in it. Returns the
+ * number of non-empty cells.
+ */
+static size_t grid_nonzero(const GridHeight *grid, int channel, int *cells,
+        real *values) {
+    real tile_values[GRID_TILE_SIZE];
+    size_t tile, n = 0;
+    int g, i0, j0, i, j, imax, jmax;
+    real value;
 
+    for (tile = 0; tile < grid_ntiles(grid); ++tile) {
+        grid_tile_origin(grid, tile, &g, &i0, &j0);
+        if (g / grid->ngroups != channel) {
+            continue;
+        }
+        memset(tile_values, 0, sizeof(tile_values));
+        if (!grid_tile_get(grid, tile, tile_values)) {
+            continue;
+        }
+        imax = min(i0 + GRID_TILE, grid->shape[0]);
+        jmax = min(j0 + GRID_TILE, grid->shape[1]);
+        for (i=i0; i<imax; ++i) {
+            for (j=j0; j<jmax; ++j) {
+                value = tile_values[grid_tile_offset(i, j)];
+                if (value == 0) {
+                    continue;
+                }
+                if (cells) {
+                    cells[3*n] = g % grid->ngroups;
+                    cells[3*n + 1] = i;
+                    cells[3*n + 2] = j;
+                }
+                if (values) {
+                    values[n] = value;
+                }
+                n++;
+            }
+        }
+    }
+    return n;
+}
+
+/** Write the non-empty cells of the averaged grids of a channel as a NumPy
+ * .npz archive
+ *
+ * The archive holds the same arrays as write_grid_npz, except the density
+ * that is replaced by:
+ *  - shape  : the shape of the dense density, (groups, first axis, second
+ *             axis)
+ *  - cells  : the group, first and second index of each non-empty cell
+ *  - values : the density in each of these cells
+ */
+static void write_grid_sparse(GridHeight *grid_store, int channel) {
+    int *cells;
+    real *values;
+    int dense_shape[3];
+    int shape[2];
+    size_t n;
+    NpzFile *npz;
+
+    n = grid_nonzero(grid_store, channel, NULL, NULL);
+    snew(cells, 3 * n + 1);
+    snew(values, n + 1);
+    grid_nonzero(grid_store, channel, cells, values);
+
+    npz = open_grid_npz(grid_store, channel);
+    dense_shape[0] = grid_store->ngroups;
+    dense_shape[1] = grid_store->shape[0];
+    dense_shape[2] = grid_store->shape[1];
+    shape[0] = 3;
+    npz_add_ints(npz, "shape", 1, shape, dense_shape);
+    shape[0] = n;
+    shape[1] = 3;
+    npz_add_ints(npz, "cells", 2, shape, cells);
+    npz_add_reals(npz, "values", 1, shape, values);
+    write_grid_npz_info(grid_store, channel, npz);
+    npz_close(npz);
+    sfree(cells);
+    sfree(values);
+}
+
+void grid_end(GridHeight *grid_store) {
+    size_t cell, ncells, tile;
+    real factor[BIN_MAX_CHANNELS];
+    int c, g, i0, j0;
+    if (grid_store) {
+        for (c = 0; c < grid_store->nchannels; ++c) {
+            factor[c] = 1.0/grid_store->nframes;
+            if (grid_store->dens[c] == 'm') {
+                factor[c] *= AMU/(NANO*NANO*NANO);
+            }
+        }
+        if (grid_store->bSparse) {
+            for (tile = 0; tile < grid_ntiles(grid_store); ++tile) {
+                if (grid_store->tiles[tile]) {
+                    grid_tile_origin(grid_store, tile, &g, &i0, &j0);
+                    for (cell = 0; cell < GRID_TILE_SIZE; ++cell) {
+                        grid_store->tiles[tile][cell] *=
+                            factor[g / grid_store->ngroups];
+                    }
+                }
+            }
+        }
+        else {
+            ncells = grid_index(grid_store, grid_store->ngroups, 0, 0);
+            for (c = 0; c < grid_store->nchannels; ++c) {
+                for (cell = 0; cell < ncells; ++cell) {
+                    grid_store->grids[c * ncells + cell] *= factor[c];
+                }
+            }
+        }
+        /* Write the output of each channel */
+        for (c = 0; c < grid_store->nchannels; ++c) {
+            if (grid_store->format == 'n') {
+                write_grid_npz(grid_store, c);
+            }
+            else if (grid_store->format == 's') {
+                write_grid_sparse(grid_store, c);
+            }
+            else {
+                write_grid_text(grid_store, c);
+            }
+        }
+    }
+}
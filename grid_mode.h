@@ -2,6 +2,7 @@
 #define _grid_mode_h
 
 #include <math.h>
+#include <string.h>
 
 #include <gromacs/macros.h>
 #include <gromacs/smalloc.h>
@@ -12,6 +13,9 @@
 #include <gromacs/futil.h>
 
 #include "matrix.h"
+#include "binning.h"
+#include "npy_io.h"
+#include "output_names.h"
 
 /** Store the height field of each leaflet and the membrane thickness as grids
  *
@@ -22,28 +26,101 @@
  * lealet and the thickness.
  *
  * The shape of the grids is also stored to avoid looking out of boundaries.
+ *
+ * There is one grid per group and per channel, that is per type of density;
+ * the grid of channel c of group n is grid c * ngroups + n, and each channel
+ * is written to its own output.
+ *
+ * Dense grids are stored in one contiguous block indexed as [grid][i][j];
+ * use grid_index to get the offset of a cell. When the dense block would be
+ * too large, the grids are sparse instead: they are cut in square tiles of
+ * GRID_TILE cells of side, and a tile is only allocated, from a pool, when
+ * one of its cells is first touched. Sparse groups like ions or ligands
+ * then only use memory where they go. The tiles are indexed as
+ * [grid][ti][tj] and their cells as [i][j], cells beyond the edge of the
+ * grid being unused.
  */
+#define GRID_TILE_SHIFT (4)
+#define GRID_TILE (1 << GRID_TILE_SHIFT)
+#define GRID_TILE_SIZE (GRID_TILE * GRID_TILE)
+/* Number of tiles in each block of the pool of a sparse grid */
+#define GRID_POOL_TILES (64)
+
 typedef struct GridHeight {
-    real ***grids;    
+    real *grids;        /* Dense grids, NULL for sparse grids */
+    gmx_bool bSparse;
+    real **tiles;       /* Tiles of sparse grids, NULL until touched */
+    int ntiles[2];      /* Number of tiles along each dimension */
+    real **pool;        /* Blocks the tiles are taken from */
+    int npool;
+    int pool_free;      /* Tiles not used yet in the last block */
     int  shape[2];
-    FILE *out_grid;
+    FILE *out_grid[BIN_MAX_CHANNELS]; /* Text output of each channel */
     real width[2];
     int axis[3];
     real box_width[2];
     int nframes;
     int ngroups;
+    int nchannels;
     real invvol;
-    char dens;
+    char dens[BIN_MAX_CHANNELS]; /* Type of density of each channel */
+    char format;        /* Output format: 't' for text, 'n' for npz */
+    char *grid_fn;      /* Output file name */
+    const char **names; /* Name of each group */
+    matrix box;         /* Box of the current frame */
+    gmx_bool bRect;     /* Is the box of the current frame rectangular? */
 } GridHeight;
 
+/** Number of grids, for all the groups and channels
+ */
+static inline int grid_ngrids(const GridHeight *grid) {
+    return grid->nchannels * grid->ngroups;
+}
+
+/** Offset of cell (i, j) of a grid in GridHeight.grids
+ */
+static inline size_t grid_index(const GridHeight *grid, int group, int i,
+        int j) {
+    return ((size_t)group * grid->shape[0] + i) * grid->shape[1] + j;
+}
+
+/** Index of the tile holding cell (i, j) of a grid in GridHeight.tiles
+ */
+static inline size_t grid_tile_index(const GridHeight *grid, int group,
+        int i, int j) {
+    return ((size_t)group * grid->ntiles[0] + (i >> GRID_TILE_SHIFT))
+        * grid->ntiles[1] + (j >> GRID_TILE_SHIFT);
+}
+
+/** Offset of cell (i, j) in its tile
+ */
+static inline int grid_tile_offset(int i, int j) {
+    return ((i & (GRID_TILE - 1)) << GRID_TILE_SHIFT) + (j & (GRID_TILE - 1));
+}
+
 GridHeight *build_grids(int shape[2], int normal_axis, int ngroups,
-        const char *grid_fn, char dens);
+        const char *grid_fn, const char *dens, char format,
+        const char **names, double max_dense);
+
+GridHeight *copy_grids(GridHeight *src);
 
 void clean_grids(GridHeight *grid_store);
 
+void grid_reduce(GridHeight *dst, GridHeight *src);
+
+void reset_grids(GridHeight *grid);
+
 void grid_start_frame(GridHeight *grid_store, matrix box);
 
-void grid_store(GridHeight *grid, int group, rvec atom, t_pbc *pbc, real mass);
+void grid_store(GridHeight *grid, BinBuffer *buf);
+
+real grid_value(const GridHeight *grid, int group, int i, int j);
+
+size_t grid_ntiles(const GridHeight *grid);
+
+gmx_bool grid_tile_get(const GridHeight *grid, size_t tile, real *values);
+
+void grid_tile_add(GridHeight *grid, size_t tile, const real *values);
 
 void grid_end(GridHeight *grid_store);
 
@@ -58,7 +58,7 @@ int **intMatrix(int d1, int d2, int defval) {
   
     smalloc(mat, d1 * sizeof(int*));
     for(i = 0; i < d1; i++){
-        smalloc(mat[i], d2 * sizeof(real));
+        smalloc(mat[i], d2 * sizeof(int));
         for(j = 0; j < d2; j++) {
             mat[i][j] = defval;
         }
@@ -80,4 +80,34 @@ void deleteIntMat(int **mat, int d1) {
     sfree(mat);
 }
 
+/** Create a contiguous 3D array of real numbers
+ *
+ * The array is a single contiguous block aligned on 64 bytes. Cell
+ * (i, j, k) is at (i * d2 + j) * d3 + k.
+ *
+ * Parameters:
+ *  - d1, d2, d3: the dimensions of the array
+ *  - defval: the value to put in every cells
+ *
+ * Return:
+ *  The filled array, to destroy with deleteRealBlock.
+ */
+real *realBlock(int d1, int d2, int d3, real defval) {
+    size_t i, size;
+    real *block;
+
+    size = (size_t)d1 * d2 * d3;
+    snew_aligned(block, size, 64);
+    if (defval != 0) {
+        for(i = 0; i < size; i++) {
+            block[i] = defval;
+        }
+    }
+    return block;
+}
 
+/** Destroy a 3D array created with realBlock
+ */
+void deleteRealBlock(real *block) {
+    sfree_aligned(block);
+}
@@ -8,5 +8,7 @@ real **realMatrix(int d1, int d2, real defval);
 void deleteRealMat(real **mat, int d1);
 int **intMatrix(int d1, int d2, int defval);
 void deleteIntMat(int **mat, int d1);
+real *realBlock(int d1, int d2, int d3, real defval);
+void deleteRealBlock(real *block);
 
 //#endif	[> _matrix_h <]
@@ -0,0 +1,356 @@
+#include "npy_io.h"
+
+#include <string.h>
+
+/* Size of the header of a zip local file entry, without the name */
+#define ZIP_LOCAL_HEADER (30)
+/* Alignment of the array data in the file */
+#define NPY_ALIGN (64)
+
+static void put_u16(FILE *fp, unsigned int value) {
+    fputc(value & 0xff, fp);
+    fputc((value >> 8) & 0xff, fp);
+}
+
+static void put_u32(FILE *fp, unsigned long value) {
+    put_u16(fp, value & 0xffff);
+    put_u16(fp, (value >> 16) & 0xffff);
+}
+
+/** Write bytes of the current member and update its checksum
+ */
+static void member_write(NpzFile *npz, const unsigned char *bytes,
+        size_t size) {
+    size_t i;
+    unsigned long crc = npz->current->crc;
+    for (i=0; i<size; ++i) {
+        crc = npz->crc_table[(crc ^ bytes[i]) & 0xff] ^ (crc >> 8);
+    }
+    npz->current->crc = crc;
+    npz->current->size += size;
+    if (fwrite(bytes, 1, size, npz->fp) != size) {
+        gmx_fatal(FARGS, "Error writing %s in npz archive\n",
+                npz->current->name);
+    }
+}
+
+/** Write the local header of a member, padded so that the data written
+ * after "data_offset" bytes of the member are aligned
+ */
+static void member_begin(NpzFile *npz, const char *name, size_t data_offset) {
+    NpzEntry *entry;
+    long pos;
+    size_t namelen = strlen(name);
+    size_t extra, i;
+
+    srenew(npz->entries, npz->nentries + 1);
+    entry = &npz->entries[npz->nentries++];
+    entry->name = strdup(name);
+    entry->crc = 0xffffffffUL;
+    entry->size = 0;
+    pos = ftell(npz->fp);
+    entry->offset = pos;
+    npz->current = entry;
+
+    /* The extra field holds the padding: a 4 bytes header then zeros */
+    extra = NPY_ALIGN - (pos + ZIP_LOCAL_HEADER + namelen + 4 + data_offset)
+        % NPY_ALIGN;
+    extra = (extra % NPY_ALIGN) + 4;
+
+    put_u32(npz->fp, 0x04034b50UL);   /* signature */
+    put_u16(npz->fp, 20);             /* version needed */
+    put_u16(npz->fp, 0);              /* flags */
+    put_u16(npz->fp, 0);              /* stored, no compression */
+    put_u16(npz->fp, 0);              /* time */
+    put_u16(npz->fp, 0x21);           /* date: 1980-01-01 */
+    put_u32(npz->fp, 0);              /* crc, written by member_end */
+    put_u32(npz->fp, 0);              /* compressed size */
+    put_u32(npz->fp, 0);              /* uncompressed size */
+    put_u16(npz->fp, namelen);
+    put_u16(npz->fp, extra);
+    fwrite(name, 1, namelen, npz->fp);
+    put_u16(npz->fp, 0xcafe);         /* padding field, ignored by readers */
+    put_u16(npz->fp, extra - 4);
+    for (i=4; i<extra; ++i) {
+        fputc(0, npz->fp);
+    }
+}
+
+/** Go back to the local header to write the checksum and the size
+ */
+static void member_end(NpzFile *npz) {
+    NpzEntry *entry = npz->current;
+    long end = ftell(npz->fp);
+
+    entry->crc ^= 0xffffffffUL;
+    if (end < 0 || (unsigned long)end > 0xffffffffUL) {
+        gmx_fatal(FARGS, "npz archive too large, zip64 is not supported\n");
+    }
+    fseek(npz->fp, entry->offset + 14, SEEK_SET);
+    put_u32(npz->fp, entry->crc);
+    put_u32(npz->fp, entry->size);
+    put_u32(npz->fp, entry->size);
+    fseek(npz->fp, end, SEEK_SET);
+    npz->current = NULL;
+}
+
+/** Build the .npy header for an array, padded to NPY_ALIGN bytes
+ *
+ * Returns the length of the header written in "header".
+ */
+static size_t npy_header(char *header, size_t maxlen, const char *descr,
+        int ndim, const int *shape) {
+    char dict[512];
+    char dims[256] = "";
+    char tmp[32];
+    size_t len, total;
+    int d;
+
+    for (d=0; d<ndim; ++d) {
+        sprintf(tmp, "%d,%s", shape[d], (d + 1 < ndim) ? " " : "");
+        strcat(dims, tmp);
+    }
+    if (ndim > 1) {
+        /* Only 1-tuples need the trailing comma */
+        dims[strlen(dims) - 1] = '\0';
+    }
+    sprintf(dict, "{'descr': '%s', 'fortran_order': False, 'shape': (%s), }",
+            descr, dims);
+    len = strlen(dict);
+    /* magic (6) + version (2) + header length (2) + dict + newline */
+    total = 10 + len + 1;
+    total += (NPY_ALIGN - total % NPY_ALIGN) % NPY_ALIGN;
+    if (total > maxlen) {
+        gmx_fatal(FARGS, "Too many dimensions for a npy header\n");
+    }
+    memcpy(header, "\x93NUMPY\x01\x00", 8);
+    header[8] = (total - 10) & 0xff;
+    header[9] = ((total - 10) >> 8) & 0xff;
+    memcpy(header + 10, dict, len);
+    memset(header + 10 + len, ' ', total - 10 - len - 1);
+    header[total - 1] = '\n';
+    return total;
+}
+
+/** Open a .npz archive for writing
+ */
+NpzFile *npz_open(const char *fn) {
+    NpzFile *npz;
+    unsigned long c;
+    int n, k;
+
+    snew(npz, 1);
+    npz->fp = ffopen(fn, "wb");
+    if (npz->fp == NULL) {
+        gmx_fatal(FARGS, "Error opening %s\n", fn);
+    }
+    npz->entries = NULL;
+    npz->nentries = 0;
+    npz->current = NULL;
+    for (n=0; n<256; ++n) {
+        c = n;
+        for (k=0; k<8; ++k) {
+            c = (c & 1) ? 0xedb88320UL ^ (c >> 1) : c >> 1;
+        }
+        npz->crc_table[n] = c;
+    }
+    return npz;
+}
+
+/** Write the zip central directory and close the archive
+ */
+void npz_close(NpzFile *npz) {
+    long start, end;
+    int i;
+    size_t namelen;
+
+    if (npz == NULL) {
+        return;
+    }
+    start = ftell(npz->fp);
+    for (i=0; i<npz->nentries; ++i) {
+        namelen = strlen(npz->entries[i].name);
+        put_u32(npz->fp, 0x02014b50UL);   /* signature */
+        put_u16(npz->fp, 20);             /* version made by */
+        put_u16(npz->fp, 20);             /* version needed */
+        put_u16(npz->fp, 0);              /* flags */
+        put_u16(npz->fp, 0);              /* stored */
+        put_u16(npz->fp, 0);              /* time */
+        put_u16(npz->fp, 0x21);           /* date */
+        put_u32(npz->fp, npz->entries[i].crc);
+        put_u32(npz->fp, npz->entries[i].size);
+        put_u32(npz->fp, npz->entries[i].size);
+        put_u16(npz->fp, namelen);
+        put_u16(npz->fp, 0);              /* extra length */
+        put_u16(npz->fp, 0);              /* comment length */
+        put_u16(npz->fp, 0);              /* disk number */
+        put_u16(npz->fp, 0);              /* internal attributes */
+        put_u32(npz->fp, 0);              /* external attributes */
+        put_u32(npz->fp, npz->entries[i].offset);
+        fwrite(npz->entries[i].name, 1, namelen, npz->fp);
+    }
+    end = ftell(npz->fp);
+    put_u32(npz->fp, 0x06054b50UL);       /* end of central directory */
+    put_u16(npz->fp, 0);
+    put_u16(npz->fp, 0);
+    put_u16(npz->fp, npz->nentries);
+    put_u16(npz->fp, npz->nentries);
+    put_u32(npz->fp, end - start);
+    put_u32(npz->fp, start);
+    put_u16(npz->fp, 0);                  /* comment length */
+    ffclose(npz->fp);
+
+    for (i=0; i<npz->nentries; ++i) {
+        sfree(npz->entries[i].name);
+    }
+    sfree(npz->entries);
+    sfree(npz);
+}
+
+/** Start an array of reals, whose values are then given in C order with
+ * npz_write_reals; npz_end_reals closes it
+ *
+ * Parameters :
+ *  - npz   : the archive
+ *  - name  : the name of the array, ".npy" is appended
+ *  - ndim  : the number of dimensions
+ *  - shape : the size of each dimension
+ */
+void npz_begin_reals(NpzFile *npz, const char *name, int ndim,
+        const int *shape) {
+    char header[1024];
+    char member[256];
+    size_t hlen;
+
+    hlen = npy_header(header, sizeof(header), "<f8", ndim, shape);
+    sprintf(member, "%.250s.npy", name);
+    member_begin(npz, member, hlen);
+    member_write(npz, (unsigned char *)header, hlen);
+}
+
+/** Append values to the array being written, as little-endian float64
+ */
+void npz_write_reals(NpzFile *npz, const real *data, size_t n) {
+    unsigned char bytes[8 * 512];
+    size_t i, chunk;
+    unsigned long long bits;
+    double value;
+    int b;
+
+    chunk = 0;
+    for (i=0; i<n; ++i) {
+        value = data[i];
+        memcpy(&bits, &value, sizeof(bits));
+        for (b=0; b<8; ++b) {
+            bytes[chunk++] = (bits >> (8 * b)) & 0xff;
+        }
+        if (chunk == sizeof(bytes)) {
+            member_write(npz, bytes, chunk);
+            chunk = 0;
+        }
+    }
+    member_write(npz, bytes, chunk);
+}
+
+void npz_end_reals(NpzFile *npz) {
+    member_end(npz);
+}
+
+/** Add an array of reals to the archive, as little-endian float64
+ *
+ * Parameters :
+ *  - npz   : the archive
+ *  - name  : the name of the array, ".npy" is appended
+ *  - ndim  : the number of dimensions
+ *  - shape : the size of each dimension
+ *  - data  : the values, in C order
+ */
+void npz_add_reals(NpzFile *npz, const char *name, int ndim, const int *shape,
+        const real *data) {
+    size_t n = 1;
+    int d;
+
+    for (d=0; d<ndim; ++d) {
+        n *= shape[d];
+    }
+    npz_begin_reals(npz, name, ndim, shape);
+    npz_write_reals(npz, data, n);
+    npz_end_reals(npz);
+}
+
+/** Add an array of integers to the archive, as little-endian int32
+ *
+ * Parameters :
+ *  - npz   : the archive
+ *  - name  : the name of the array, ".npy" is appended
+ *  - ndim  : the number of dimensions
+ *  - shape : the size of each dimension
+ *  - data  : the values, in C order
+ */
+void npz_add_ints(NpzFile *npz, const char *name, int ndim, const int *shape,
+        const int *data) {
+    char header[1024];
+    char member[256];
+    unsigned char bytes[4 * 512];
+    size_t hlen, n = 1, i, chunk;
+    unsigned int bits;
+    int d, b;
+
+    for (d=0; d<ndim; ++d) {
+        n *= shape[d];
+    }
+    hlen = npy_header(header, sizeof(header), "<i4", ndim, shape);
+    sprintf(member, "%.250s.npy", name);
+    member_begin(npz, member, hlen);
+    member_write(npz, (unsigned char *)header, hlen);
+    chunk = 0;
+    for (i=0; i<n; ++i) {
+        bits = (unsigned int)data[i];
+        for (b=0; b<4; ++b) {
+            bytes[chunk++] = (bits >> (8 * b)) & 0xff;
+        }
+        if (chunk == sizeof(bytes)) {
+            member_write(npz, bytes, chunk);
+            chunk = 0;
+        }
+    }
+    member_write(npz, bytes, chunk);
+    member_end(npz);
+}
+
+/** Add an array of strings to the archive
+ *
+ * The strings are stored as fixed width unicode (UTF-32LE), the NumPy
+ * "<U" type; only ASCII strings are expected.
+ */
+void npz_add_strings(NpzFile *npz, const char *name, int n,
+        const char **strings) {
+    char header[1024];
+    char member[256];
+    char descr[32];
+    unsigned char cell[4];
+    size_t hlen, len, maxlen = 1;
+    int i, c, shape[1];
+
+    for (i=0; i<n; ++i) {
+        len = strlen(strings[i]);
+        if (len > maxlen) {
+            maxlen = len;
+        }
+    }
+    sprintf(descr, "<U%lu", (unsigned long)maxlen);
+    shape[0] = n;
+    hlen = npy_header(header, sizeof(header), descr, 1, shape);
+    sprintf(member, "%.250s.npy", name);
+    member_begin(npz, member, hlen);
+    member_write(npz, (unsigned char *)header, hlen);
+    for (i=0; i<n; ++i) {
+        len = strlen(strings[i]);
+        for (c=0; c<(int)maxlen; ++c) {
+            cell[0] = (c < (int)len) ? (unsigned char)strings[i][c] : 0;
+            cell[1] = cell[2] = cell[3] = 0;
+            member_write(npz, cell, 4);
+        }
+    }
+    member_end(npz);
+}
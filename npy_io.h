@@ -0,0 +1,54 @@
+#ifndef _npy_io_h
+#define _npy_io_h
+
+#include <stdio.h>
+
+#include <gromacs/smalloc.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/futil.h>
+#include <gromacs/types/simple.h>
+
+/** Writer for NumPy .npz archives
+ *
+ * An archive is a zip file whose members are .npy arrays. Members are
+ * stored without compression and the array data are aligned on 64 bytes in
+ * the file, so readers can map them in memory without parsing or copying.
+ * Numbers are written as little-endian float64, and indices as little-endian
+ * int32, whatever the host is.
+ */
+typedef struct NpzEntry {
+    char *name;
+    unsigned long crc;
+    unsigned long size;
+    unsigned long offset;
+} NpzEntry;
+
+typedef struct NpzFile {
+    FILE *fp;
+    NpzEntry *current;  /* Member being written */
+    unsigned long crc_table[256];
+    NpzEntry *entries;
+    int nentries;
+} NpzFile;
+
+NpzFile *npz_open(const char *fn);
+
+void npz_close(NpzFile *npz);
+
+void npz_begin_reals(NpzFile *npz, const char *name, int ndim,
+        const int *shape);
+
+void npz_write_reals(NpzFile *npz, const real *data, size_t n);
+
+void npz_end_reals(NpzFile *npz);
+
+void npz_add_reals(NpzFile *npz, const char *name, int ndim, const int *shape,
+        const real *data);
+
+void npz_add_ints(NpzFile *npz, const char *name, int ndim, const int *shape,
+        const int *data);
+
+void npz_add_strings(NpzFile *npz, const char *name, int n,
+        const char **strings);
+
+#endif /* _npy_io_h */
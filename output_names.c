@@ -0,0 +1,67 @@
+#include "output_names.h"
+
+/** Unit of the densities for a type of density
+ */
+const char *dens_unit(char dens) {
+    switch (dens) {
+        case 'n': return "nm^-3";
+        case 'c': return "e nm^-3";
+        case 'e': return "e nm^-3";
+        default: return "kg/m^3";
+    }
+}
+
+/** Name of a type of density
+ */
+const char *dens_name(char dens) {
+    switch (dens) {
+        case 'n': return "number";
+        case 'c': return "charge";
+        case 'e': return "electron";
+        default: return "mass";
+    }
+}
+
+/** Label of the density axis of the xvg outputs, with the xmgrace markup
+ * of the slab profiles
+ */
+const char *dens_ylabel(char dens) {
+    switch (dens) {
+        case 'n': return "Number density (nm\\S-3\\N)";
+        case 'c': return "Charge density (e nm\\S-3\\N)";
+        case 'e': return "Electron density (e nm\\S-3\\N)";
+        default: return "Density (kg m\\S-3\\N)";
+    }
+}
+
+/** Add "_suffix" before the extension of a file name
+ *
+ * run.1/density.xvg with the suffix "X" gives run.1/density_X.xvg. A NULL
+ * suffix gives a copy of the name. The result is to be freed with sfree.
+ */
+char *output_fn(const char *fn, const char *suffix) {
+    const char *name, *ext;
+    char *ofn;
+    size_t base;
+
+    snew(ofn, strlen(fn) + (suffix ? strlen(suffix) + 2 : 1));
+    if (suffix == NULL) {
+        strcpy(ofn, fn);
+        return ofn;
+    }
+    name = strrchr(fn, '/');
+    ext = strrchr(name ? name + 1 : fn, '.');
+    base = ext ? (size_t)(ext - fn) : strlen(fn);
+    memcpy(ofn, fn, base);
+    sprintf(ofn + base, "_%s%s", suffix, ext ? ext : "");
+    return ofn;
+}
+
+/** Name of the output of a type of density: the name of the type is added
+ * before the extension when there are several types
+ *
+ * density.xvg gives density_mass.xvg, density_number.xvg...
+ */
+char *dens_output_fn(const char *fn, char dens, int ndens) {
+    return output_fn(fn, ndens == 1 ? NULL : dens_name(dens));
+}
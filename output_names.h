@@ -0,0 +1,26 @@
+#ifndef _output_names_h
+#define _output_names_h
+
+#include <string.h>
+
+#include <gromacs/smalloc.h>
+
+/** Names of the output files, and labels of the densities they hold
+ *
+ * An output split in several files, one per type of density, axis,
+ * reference or group, gets a suffix added before the extension of the name
+ * given by the user. The extension is the part after the last dot of the
+ * file name; the dots of the directories do not count.
+ */
+
+const char *dens_unit(char dens);
+
+const char *dens_name(char dens);
+
+const char *dens_ylabel(char dens);
+
+char *output_fn(const char *fn, const char *suffix);
+
+char *dens_output_fn(const char *fn, char dens, int ndens);
+
+#endif /* _output_names_h */
@@ -0,0 +1,375 @@
+#include "state_io.h"
+
+#include <string.h>
+
+#define STATE_MAGIC "g_mydensity_sum"
+#define STATE_VERSION (7)
+/* Marks the end of the tiles of the grids */
+#define STATE_END_TILES ((size_t)-1)
+/* Number of values summed and written at once */
+#define STATE_CHUNK (4096)
+
+static void write_values(FILE *fp, const void *values, size_t size,
+        size_t n, const char *fn) {
+    if (fwrite(values, size, n, fp) != n) {
+        gmx_fatal(FARGS, "Error writing %s\n", fn);
+    }
+}
+
+static void read_values(FILE *fp, void *values, size_t size, size_t n,
+        const char *fn) {
+    if (fread(values, size, n, fp) != n) {
+        gmx_fatal(FARGS, "%s is truncated\n", fn);
+    }
+}
+
+/** Write the sum over all the instances of an array of accumulators
+ *
+ * "get" returns the array of the i-th instance.
+ */
+static void write_summed(FILE *fp, DensityAccum **accums, int naccum,
+        real *(*get)(DensityAccum *, int), int part, size_t n,
+        const char *fn) {
+    real chunk[STATE_CHUNK];
+    size_t start, i, len;
+    int a;
+    real *values;
+
+    for (start=0; start<n; start+=STATE_CHUNK) {
+        len = (n - start < STATE_CHUNK) ? n - start : STATE_CHUNK;
+        for (i=0; i<len; ++i) {
+            chunk[i] = 0;
+        }
+        for (a=0; a<naccum; ++a) {
+            values = get(accums[a], part) + start;
+            for (i=0; i<len; ++i) {
+                chunk[i] += values[i];
+            }
+        }
+        write_values(fp, chunk, sizeof(real), len, fn);
+    }
+}
+
+/** Read an array from the file and add it to "values"
+ */
+static void read_summed(FILE *fp, real *values, size_t n, const char *fn) {
+    real chunk[STATE_CHUNK];
+    size_t start, i, len;
+
+    for (start=0; start<n; start+=STATE_CHUNK) {
+        len = (n - start < STATE_CHUNK) ? n - start : STATE_CHUNK;
+        read_values(fp, chunk, sizeof(real), len, fn);
+        for (i=0; i<len; ++i) {
+            values[start + i] += chunk[i];
+        }
+    }
+}
+
+static real *get_slab(DensityAccum *accum, int group) {
+    return accum->slDensity[group];
+}
+
+static real *get_voxels(DensityAccum *accum, int part) {
+    return accum->voxel->voxels;
+}
+
+/* Distance mode of the ref-th reference group */
+static DistMode *dist_ref(DistMode *dist, int ref) {
+    for (; ref > 0; --ref) {
+        dist = dist->next;
+    }
+    return dist;
+}
+
+/* "part" is ref * nprofiles + profile */
+static real *get_dist(DensityAccum *accum, int part) {
+    DistMode *dist = accum->dist;
+    return dist_ref(dist, part / dist_nprofiles(dist))
+        ->data[part % dist_nprofiles(dist)];
+}
+
+/* Has a tile at least one cell that is not zero? */
+static gmx_bool tile_nonzero(const real *values) {
+    int i;
+    for (i=0; i<GRID_TILE_SIZE; ++i) {
+        if (values[i] != 0) {
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+/** Write the sum of the accumulators of several instances of DensityAccum
+ *
+ * The file is first written under a temporary name then renamed, so an
+ * interrupted write never leaves a broken state behind.
+ *
+ * Parameters :
+ *  - fn      : the file to write
+ *  - job     : the description of the analysis
+ *  - accums  : the instances to sum, typically the main one and the copies
+ *              of the worker threads
+ *  - naccum  : the number of instances
+ *  - t       : the time of the last frame analysed
+ *  - slWidth : the slice width along each axis of the job in the last frame
+ *              analysed
+ */
+void write_state(const char *fn, DensityJob *job, DensityAccum **accums,
+        int naccum, double t, real *slWidth) {
+    StateHeader header;
+    GridHeight *grid = accums[0]->grid;
+    VoxelGrid *voxel = accums[0]->voxel;
+    DistMode *dist = accums[0]->dist;
+    char magic[16];
+    char *tmp_fn;
+    FILE *fp;
+    DistMode *ref_dist;
+    int a, n, ref, nframes;
+    real box_width[2];
+    matrix box_sum;
+    real tile_values[GRID_TILE_SIZE];
+    size_t tile;
+
+    memset(&header, 0, sizeof(header));
+    header.version = STATE_VERSION;
+    header.real_size = sizeof(real);
+    header.ngroups = job->ngroups;
+    header.nslices = job->nslices;
+    header.naxes = job->naxes;
+    for (a=0; a<job->naxes; ++a) {
+        header.axes[a] = job->axes[a];
+        header.slWidth[a] = slWidth[a];
+    }
+    header.nchannels = job->nchannels;
+    for (a=0; a<job->nchannels; ++a) {
+        header.dens[a] = job->dens[a];
+    }
+    if (grid) {
+        header.grid_shape[0] = grid->shape[0];
+        header.grid_shape[1] = grid->shape[1];
+    }
+    if (voxel) {
+        for (a=0; a<DIM; ++a) {
+            header.voxel_shape[a] = voxel->shape[a];
+        }
+    }
+    if (dist) {
+        header.dist_length = dist->length;
+        for (ref_dist=dist; ref_dist; ref_dist=ref_dist->next) {
+            header.dist_nref++;
+        }
+    }
+    for (a=0; a<naccum; ++a) {
+        header.nframes += accums[a]->nframes;
+    }
+    header.t = t;
+
+    snew(tmp_fn, strlen(fn) + 5);
+    sprintf(tmp_fn, "%s.tmp", fn);
+    fp = ffopen(tmp_fn, "wb");
+    if (fp == NULL) {
+        gmx_fatal(FARGS, "Error opening %s\n", tmp_fn);
+    }
+    memset(magic, 0, sizeof(magic));
+    memcpy(magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+    write_values(fp, magic, 1, sizeof(magic), fn);
+    write_values(fp, &header, sizeof(header), 1, fn);
+
+    for (n=0; n<job_nprofiles(job); ++n) {
+        write_summed(fp, accums, naccum, get_slab, n, job->nslices, fn);
+    }
+    if (grid) {
+        nframes = 0;
+        box_width[0] = box_width[1] = 0;
+        for (a=0; a<naccum; ++a) {
+            nframes += accums[a]->grid->nframes;
+            box_width[0] += accums[a]->grid->box_width[0];
+            box_width[1] += accums[a]->grid->box_width[1];
+        }
+        write_values(fp, &nframes, sizeof(int), 1, fn);
+        write_values(fp, box_width, sizeof(real), 2, fn);
+        /* The grids are written tile by tile, skipping the tiles whose
+         * cells are all zero, so dense and sparse grids share the layout
+         * and a dense grid does not write its empty regions */
+        for (tile=0; tile<grid_ntiles(grid); ++tile) {
+            memset(tile_values, 0, sizeof(tile_values));
+            for (a=0; a<naccum; ++a) {
+                grid_tile_get(accums[a]->grid, tile, tile_values);
+            }
+            if (tile_nonzero(tile_values)) {
+                write_values(fp, &tile, sizeof(size_t), 1, fn);
+                write_values(fp, tile_values, sizeof(real), GRID_TILE_SIZE,
+                        fn);
+            }
+        }
+        tile = STATE_END_TILES;
+        write_values(fp, &tile, sizeof(size_t), 1, fn);
+    }
+    if (voxel) {
+        nframes = 0;
+        clear_mat(box_sum);
+        for (a=0; a<naccum; ++a) {
+            nframes += accums[a]->voxel->nframes;
+            m_add(box_sum, accums[a]->voxel->box_sum, box_sum);
+        }
+        write_values(fp, &nframes, sizeof(int), 1, fn);
+        write_values(fp, box_sum, sizeof(real), DIM*DIM, fn);
+        write_summed(fp, accums, naccum, get_voxels, 0, voxel_size(voxel),
+                fn);
+    }
+    for (ref=0; ref<header.dist_nref; ++ref) {
+        nframes = 0;
+        box_width[0] = 0;
+        for (a=0; a<naccum; ++a) {
+            ref_dist = dist_ref(accums[a]->dist, ref);
+            nframes += ref_dist->nframes;
+            box_width[0] += ref_dist->box_width;
+        }
+        write_values(fp, &nframes, sizeof(int), 1, fn);
+        write_values(fp, box_width, sizeof(real), 1, fn);
+        for (n=0; n<dist_nprofiles(dist); ++n) {
+            write_summed(fp, accums, naccum, get_dist,
+                    ref * dist_nprofiles(dist) + n, dist->length, fn);
+        }
+    }
+    ffclose(fp);
+    if (rename(tmp_fn, fn) != 0) {
+        gmx_fatal(FARGS, "Could not rename %s into %s\n", tmp_fn, fn);
+    }
+    sfree(tmp_fn);
+}
+
+/** Open a state file and read its header
+ */
+static FILE *open_state(const char *fn, StateHeader *header) {
+    char magic[16];
+    FILE *fp;
+
+    fp = ffopen(fn, "rb");
+    if (fp == NULL) {
+        gmx_fatal(FARGS, "Error opening %s\n", fn);
+    }
+    read_values(fp, magic, 1, sizeof(magic), fn);
+    if (strncmp(magic, STATE_MAGIC, sizeof(magic)) != 0) {
+        gmx_fatal(FARGS, "%s is not a g_mydensity state file\n", fn);
+    }
+    read_values(fp, header, sizeof(*header), 1, fn);
+    if (header->version != STATE_VERSION) {
+        gmx_fatal(FARGS, "%s has version %d, expected %d\n", fn,
+                header->version, STATE_VERSION);
+    }
+    if (header->real_size != sizeof(real)) {
+        gmx_fatal(FARGS, "%s was written with %s precision\n", fn,
+                header->real_size == sizeof(float) ? "single" : "double");
+    }
+    return fp;
+}
+
+/** Read the header of a state file, without its data
+ */
+void read_state_header(const char *fn, StateHeader *header) {
+    ffclose(open_state(fn, header));
+}
+
+/** Add the accumulators stored in a state file to an instance of DensityAccum
+ *
+ * The shapes of the modes in the file must match the ones of the instance.
+ * The header of the file is copied in "header".
+ */
+void read_state(const char *fn, DensityJob *job, DensityAccum *accum,
+        StateHeader *header) {
+    GridHeight *grid = accum->grid;
+    VoxelGrid *voxel = accum->voxel;
+    DistMode *dist = accum->dist;
+    DistMode *ref_dist;
+    FILE *fp;
+    int n, a, nref = 0, nframes;
+    real box_width[2];
+    matrix box_sum;
+    real tile_values[GRID_TILE_SIZE];
+    size_t tile;
+
+    for (ref_dist=dist; ref_dist; ref_dist=ref_dist->next) {
+        nref++;
+    }
+    fp = open_state(fn, header);
+    if (header->ngroups != job->ngroups || header->nslices != job->nslices) {
+        gmx_fatal(FARGS, "%s has %d groups and %d slices, expected %d and %d\n",
+                fn, header->ngroups, header->nslices, job->ngroups,
+                job->nslices);
+    }
+    if (header->naxes != job->naxes) {
+        gmx_fatal(FARGS, "%s has profiles along %d axes, expected %d\n",
+                fn, header->naxes, job->naxes);
+    }
+    for (a=0; a<job->naxes; ++a) {
+        if (header->axes[a] != job->axes[a]) {
+            gmx_fatal(FARGS, "The axes of %s do not match the ones "
+                    "requested\n", fn);
+        }
+    }
+    if (header->nchannels != job->nchannels
+            || memcmp(header->dens, job->dens, job->nchannels) != 0) {
+        gmx_fatal(FARGS, "The types of density of %s do not match the ones "
+                "requested\n", fn);
+    }
+    if ((grid == NULL) != (header->grid_shape[0] == 0) ||
+            (grid && (grid->shape[0] != header->grid_shape[0] ||
+                      grid->shape[1] != header->grid_shape[1]))) {
+        gmx_fatal(FARGS, "The grid of %s does not match the grid requested\n",
+                fn);
+    }
+    if ((voxel == NULL) != (header->voxel_shape[0] == 0) ||
+            (voxel && (voxel->shape[0] != header->voxel_shape[0] ||
+                       voxel->shape[1] != header->voxel_shape[1] ||
+                       voxel->shape[2] != header->voxel_shape[2]))) {
+        gmx_fatal(FARGS, "The voxels of %s do not match the ones requested\n",
+                fn);
+    }
+    if ((dist == NULL) != (header->dist_length == 0) ||
+            (dist && (dist->length != header->dist_length ||
+                      nref != header->dist_nref))) {
+        gmx_fatal(FARGS, "The distance profile of %s does not match the one "
+                "requested\n", fn);
+    }
+
+    accum->nframes += header->nframes;
+    for (n=0; n<job_nprofiles(job); ++n) {
+        read_summed(fp, accum->slDensity[n], job->nslices, fn);
+    }
+    if (grid) {
+        read_values(fp, &nframes, sizeof(int), 1, fn);
+        read_values(fp, box_width, sizeof(real), 2, fn);
+        grid->nframes += nframes;
+        grid->box_width[0] += box_width[0];
+        grid->box_width[1] += box_width[1];
+        while (TRUE) {
+            read_values(fp, &tile, sizeof(size_t), 1, fn);
+            if (tile == STATE_END_TILES) {
+                break;
+            }
+            if (tile >= grid_ntiles(grid)) {
+                gmx_fatal(FARGS, "%s has a tile out of the grid\n", fn);
+            }
+            read_values(fp, tile_values, sizeof(real), GRID_TILE_SIZE, fn);
+            grid_tile_add(grid, tile, tile_values);
+        }
+    }
+    if (voxel) {
+        read_values(fp, &nframes, sizeof(int), 1, fn);
+        read_values(fp, box_sum, sizeof(real), DIM*DIM, fn);
+        voxel->nframes += nframes;
+        m_add(voxel->box_sum, box_sum, voxel->box_sum);
+        read_summed(fp, voxel->voxels, voxel_size(voxel), fn);
+    }
+    for (ref_dist=dist; ref_dist; ref_dist=ref_dist->next) {
+        read_values(fp, &nframes, sizeof(int), 1, fn);
+        read_values(fp, box_width, sizeof(real), 1, fn);
+        ref_dist->nframes += nframes;
+        ref_dist->box_width += box_width[0];
+        for (n=0; n<dist_nprofiles(ref_dist); ++n) {
+            read_summed(fp, ref_dist->data[n], ref_dist->length, fn);
+        }
+    }
+    ffclose(fp);
+}
@@ -0,0 +1,51 @@
+#ifndef _state_io_h
+#define _state_io_h
+
+#include <stdio.h>
+
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/futil.h>
+
+#include "density.h"
+
+/** Raw accumulators saved on disk
+ *
+ * A state file holds the un-normalized sums of every mode (slab profiles,
+ * grids, voxels, distance profiles), their frame counts and box width sums,
+ * and the time of the last frame analysed. It is written in the native
+ * binary layout of the machine; a header records the size of a real and the
+ * shape of each mode so incompatible files are rejected when read back. The
+ * grids are saved tile by tile, so a state written with dense grids can be
+ * read into sparse ones and the other way around.
+ */
+typedef struct StateHeader {
+    int version;
+    int real_size;
+    int ngroups;
+    int nslices;
+    int naxes;          /* Number of axes with a slab profile */
+    int axes[DIM];
+    int nchannels;      /* Number of types of density */
+    char dens[BIN_MAX_CHANNELS]; /* Type of density of each channel */
+    int grid_shape[2];  /* 0 when the grid mode is not used */
+    int voxel_shape[3]; /* 0 when the voxel mode is not used */
+    int dist_length;    /* 0 when the distance mode is not used */
+    int dist_nref;      /* Number of reference groups of the distance mode */
+    int nframes;
+    double t;           /* Time of the last frame analysed, in double
+                           precision so long trajectories resume exactly */
+    real slWidth[DIM];  /* Slice width along each axis in the last frame
+                           analysed */
+} StateHeader;
+
+void write_state(const char *fn, DensityJob *job, DensityAccum **accums,
+        int naccum, double t, real *slWidth);
+
+void read_state_header(const char *fn, StateHeader *header);
+
+void read_state(const char *fn, DensityJob *job, DensityAccum *accum,
+        StateHeader *header);
+
+#endif /* _state_io_h */
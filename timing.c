@@ -0,0 +1,172 @@
+#include "timing.h"
+
+#include <string.h>
+
+static const char *phase_names[etimNR] = {
+    "decode", "rmpbc", "center", "geometry", "slab", "grid", "voxel", "dist",
+    "output"
+};
+
+static double clock_seconds(clockid_t clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return now.tv_sec + 1e-9 * now.tv_nsec;
+}
+
+/** Contruct an instance of Timing and start the clock of the run
+ */
+Timing *build_timing(void) {
+    Timing *timing;
+    snew(timing, 1);
+    timing->run_start = clock_seconds(CLOCK_MONOTONIC);
+    return timing;
+}
+
+/** Contruct an empty instance of Timing for another thread
+ *
+ * Returns NULL if "src" is NULL.
+ */
+Timing *copy_timing(Timing *src) {
+    Timing *timing;
+    if (src == NULL) {
+        return NULL;
+    }
+    snew(timing, 1);
+    timing->run_start = src->run_start;
+    return timing;
+}
+
+void clean_timing(Timing *timing) {
+    sfree(timing);
+}
+
+/** Set the measures of a copy back to zero, once they have been summed into
+ * another instance
+ */
+void reset_timing(Timing *timing) {
+    double run_start;
+    if (timing) {
+        run_start = timing->run_start;
+        memset(timing, 0, sizeof(Timing));
+        timing->run_start = run_start;
+    }
+}
+
+/** Start measuring a phase in the calling thread
+ */
+void timing_start(Timing *timing) {
+    if (timing) {
+        timing->wall_start = clock_seconds(CLOCK_MONOTONIC);
+        timing->cpu_start = clock_seconds(CLOCK_THREAD_CPUTIME_ID);
+    }
+}
+
+/** Add the time since timing_start to a phase
+ */
+void timing_stop(Timing *timing, int phase) {
+    if (timing) {
+        timing->wall[phase] += clock_seconds(CLOCK_MONOTONIC)
+            - timing->wall_start;
+        timing->cpu[phase] += clock_seconds(CLOCK_THREAD_CPUTIME_ID)
+            - timing->cpu_start;
+    }
+}
+
+/** Add the times and counts of "src" to the ones of "dst"
+ */
+void timing_reduce(Timing *dst, Timing *src) {
+    int i;
+    if (dst && src) {
+        for (i=0; i<etimNR; ++i) {
+            dst->wall[i] += src->wall[i];
+            dst->cpu[i] += src->cpu[i];
+        }
+        dst->nframes += src->nframes;
+        dst->natoms += src->natoms;
+        dst->bytes += src->bytes;
+    }
+}
+
+/** Stop the clock of the run
+ */
+void timing_end(Timing *timing) {
+    if (timing) {
+        timing->run_wall = clock_seconds(CLOCK_MONOTONIC) - timing->run_start;
+    }
+}
+
+/** Print the time spent in each phase and the throughput of the run
+ *
+ * With several threads, the time of a phase is summed over the threads, so
+ * the phases can add up to more than the duration of the run.
+ */
+void timing_report(Timing *timing, FILE *fp) {
+    int i;
+    double run;
+    if (timing == NULL) {
+        return;
+    }
+    run = timing->run_wall;
+    fprintf(fp, "\n%-10s %12s %12s %8s\n", "Phase", "Wall (s)", "CPU (s)",
+            "Wall %");
+    for (i=0; i<etimNR; ++i) {
+        fprintf(fp, "%-10s %12.3f %12.3f %8.1f\n", phase_names[i],
+                timing->wall[i], timing->cpu[i],
+                run > 0 ? 100 * timing->wall[i] / run : 0.0);
+    }
+    fprintf(fp, "%-10s %12.3f\n", "total", run);
+    if (run > 0) {
+        fprintf(fp, "%d frames, %.1f frames/s, %.3g atoms/s, "
+                "%.1f MB read at %.1f MB/s\n", timing->nframes,
+                timing->nframes / run, timing->natoms / run,
+                timing->bytes / 1e6, timing->bytes / 1e6 / run);
+    }
+    if (timing->nbuf > 0) {
+        /* Reading that waits for free buffers means the analysis is the
+         * bottleneck, an analysis that waits for frames means reading is */
+        fprintf(fp, "Frame buffer of %d frames, %d analysis thread(s): "
+                "reading waited %.3f s for a free buffer, analysis waited "
+                "%.3f s for a frame (summed over threads)\n", timing->nbuf,
+                timing->nworkers, timing->wait_free, timing->wait_ready);
+        fprintf(fp, "The run is limited by %s\n",
+                timing->wait_ready > timing->wait_free * timing->nworkers ?
+                "reading the trajectory" : "the analysis");
+    }
+}
+
+/** Write the content of the report as a JSON object
+ */
+void timing_write_json(Timing *timing, const char *fn) {
+    FILE *fp;
+    int i;
+    if (timing == NULL) {
+        return;
+    }
+    fp = fopen(fn, "w");
+    if (fp == NULL) {
+        gmx_fatal(FARGS, "Error opening %s\n", fn);
+    }
+    fprintf(fp, "{\n  \"phases\": {\n");
+    for (i=0; i<etimNR; ++i) {
+        fprintf(fp, "    \"%s\": {\"wall\": %.6f, \"cpu\": %.6f}%s\n",
+                phase_names[i], timing->wall[i], timing->cpu[i],
+                i < etimNR - 1 ? "," : "");
+    }
+    fprintf(fp, "  },\n");
+    fprintf(fp, "  \"wall\": %.6f,\n", timing->run_wall);
+    fprintf(fp, "  \"frames\": %d,\n", timing->nframes);
+    fprintf(fp, "  \"atoms\": %.0f,\n", timing->natoms);
+    fprintf(fp, "  \"bytes\": %.0f,\n", timing->bytes);
+    fprintf(fp, "  \"frames_per_s\": %.6g,\n",
+            timing->run_wall > 0 ? timing->nframes / timing->run_wall : 0.0);
+    fprintf(fp, "  \"atoms_per_s\": %.6g,\n",
+            timing->run_wall > 0 ? timing->natoms / timing->run_wall : 0.0);
+    fprintf(fp, "  \"bytes_per_s\": %.6g,\n",
+            timing->run_wall > 0 ? timing->bytes / timing->run_wall : 0.0);
+    fprintf(fp, "  \"buffer\": {\"frames\": %d, \"threads\": %d, "
+            "\"read_wait\": %.6f, \"analysis_wait\": %.6f}\n",
+            timing->nbuf, timing->nworkers, timing->wait_free,
+            timing->wait_ready);
+    fprintf(fp, "}\n");
+    fclose(fp);
+}
@@ -0,0 +1,61 @@
+#ifndef _timing_h
+#define _timing_h
+
+#include <stdio.h>
+#include <time.h>
+
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+
+/** Phases of a run whose time is measured */
+enum {
+    etimDECODE, etimPBC, etimCENTER, etimGEOM, etimSLAB, etimGRID,
+    etimVOXEL, etimDIST, etimOUTPUT, etimNR
+};
+
+/** Wall and CPU time spent in each phase of a run
+ *
+ * Each thread measures its own phases in its own instance, one phase at a
+ * time; the instances are summed with timing_reduce. The CPU time is the
+ * one of the calling thread. Every function does nothing when given NULL,
+ * so the instrumented code does not need to test whether timing is on.
+ */
+typedef struct Timing {
+    double wall[etimNR];
+    double cpu[etimNR];
+    double wall_start;  /* Start of the phase being measured */
+    double cpu_start;
+    double run_start;   /* Start of the run */
+    double run_wall;    /* Duration of the run, set by timing_end */
+    int nframes;
+    double natoms;      /* Number of atoms binned, summed over frames */
+    double bytes;       /* Number of trajectory bytes read */
+    int nbuf;           /* Frames of the reading buffer, 0 without one */
+    int nworkers;       /* Analysis threads fed by the buffer */
+    double wait_free;   /* Seconds the reading waited for a free buffer */
+    double wait_ready;  /* Seconds the analysis waited for a frame, summed
+                           over the threads */
+} Timing;
+
+Timing *build_timing(void);
+
+Timing *copy_timing(Timing *src);
+
+void clean_timing(Timing *timing);
+
+void reset_timing(Timing *timing);
+
+void timing_start(Timing *timing);
+
+void timing_stop(Timing *timing, int phase);
+
+void timing_reduce(Timing *dst, Timing *src);
+
+void timing_end(Timing *timing);
+
+void timing_report(Timing *timing, FILE *fp);
+
+void timing_write_json(Timing *timing, const char *fn);
+
+#endif /* _timing_h */
@@ -0,0 +1,295 @@
+#include "traj_cache.h"
+
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CACHE_MAGIC "g_mydensity_xc"
+#define CACHE_VERSION (2)
+/* Size of the magic string at the start of the file */
+#define CACHE_MAGIC_SIZE (16)
+/* Alignment of the frames in the file */
+#define CACHE_ALIGN (64)
+
+/* Size of a frame in the file: time, box, coordinates */
+static size_t cache_frame_size(const CacheHeader *header) {
+    return sizeof(double)
+        + sizeof(real) * (DIM*DIM + (size_t)DIM * header->ncached);
+}
+
+/* Offset of the first frame in the file, aligned for the mapped reals */
+static size_t cache_frames_offset(const CacheHeader *header) {
+    size_t offset = CACHE_MAGIC_SIZE + sizeof(CacheHeader)
+        + sizeof(atom_id) * (size_t)header->ncached;
+    return (offset + CACHE_ALIGN - 1) / CACHE_ALIGN * CACHE_ALIGN;
+}
+
+/* Record in the header how the coordinates are prepared */
+static void cache_set_preparation(CacheHeader *header, gmx_bool bCenter,
+        int axis, atom_id *cindex, int csize, gmx_bool bSelPBC) {
+    unsigned int hash = 2166136261u;
+    int i;
+
+    header->bCenter = bCenter;
+    header->axis = bCenter ? axis : -1;
+    header->ncenter = (bCenter && cindex) ? csize : 0;
+    /* FNV-1a over the atom numbers */
+    for (i=0; i<header->ncenter; ++i) {
+        hash = (hash ^ (unsigned int)cindex[i]) * 16777619u;
+    }
+    header->center_hash = header->ncenter ? hash : 0;
+    header->bSelPBC = bSelPBC;
+}
+
+static void cache_write(TrajCache *cache, const void *values, size_t size,
+        size_t n) {
+    if (fwrite(values, size, n, cache->fp) != n) {
+        gmx_fatal(FARGS, "Error writing %s\n", cache->fn);
+    }
+}
+
+/** Start writing a cache file
+ *
+ * The file is written under a temporary name and renamed by cache_close, so
+ * an interrupted run never leaves a truncated cache behind.
+ *
+ * Parameters :
+ *  - fn      : the file to write
+ *  - natoms  : the number of atoms of the system
+ *  - atoms   : the atoms to store, sorted
+ *  - ncached : the number of atoms to store
+ *  - bCenter : are the coordinates given centered?
+ *  - axis    : the axis they are centered along
+ *  - cindex  : the group they are centered on, or NULL for the whole system
+ *  - csize   : the size of the centering group
+ *  - bSelPBC : were only the molecules of the used atoms made whole?
+ */
+TrajCache *cache_create(const char *fn, int natoms, atom_id *atoms,
+        int ncached, gmx_bool bCenter, int axis, atom_id *cindex, int csize,
+        gmx_bool bSelPBC) {
+    TrajCache *cache;
+    char magic[CACHE_MAGIC_SIZE];
+    char padding[CACHE_ALIGN];
+    char *tmp_fn;
+    size_t offset;
+
+    snew(cache, 1);
+    cache->fn = strdup(fn);
+    memset(&cache->header, 0, sizeof(CacheHeader));
+    cache->header.version = CACHE_VERSION;
+    cache->header.real_size = sizeof(real);
+    cache->header.natoms = natoms;
+    cache->header.ncached = ncached;
+    cache->header.nframes = 0;
+    cache_set_preparation(&cache->header, bCenter, axis, cindex, csize,
+            bSelPBC);
+    snew(cache->atoms, ncached);
+    memcpy(cache->atoms, atoms, ncached * sizeof(atom_id));
+    snew(cache->buf, ncached);
+
+    snew(tmp_fn, strlen(fn) + 5);
+    sprintf(tmp_fn, "%s.tmp", fn);
+    cache->fp = ffopen(tmp_fn, "wb");
+    if (cache->fp == NULL) {
+        gmx_fatal(FARGS, "Error opening %s\n", tmp_fn);
+    }
+    sfree(tmp_fn);
+    memset(magic, 0, sizeof(magic));
+    memcpy(magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    cache_write(cache, magic, 1, sizeof(magic));
+    /* The number of frames is written again by cache_close */
+    cache_write(cache, &cache->header, sizeof(CacheHeader), 1);
+    cache_write(cache, cache->atoms, sizeof(atom_id), ncached);
+    offset = CACHE_MAGIC_SIZE + sizeof(CacheHeader)
+        + sizeof(atom_id) * (size_t)ncached;
+    memset(padding, 0, sizeof(padding));
+    cache_write(cache, padding, 1,
+            cache_frames_offset(&cache->header) - offset);
+    return cache;
+}
+
+/** Append a frame to a cache being written
+ *
+ * "x" holds the coordinates of all the atoms; only the cached ones are
+ * written.
+ */
+void cache_write_frame(TrajCache *cache, double t, matrix box, rvec *x) {
+    int i;
+
+    for (i=0; i<cache->header.ncached; ++i) {
+        copy_rvec(x[cache->atoms[i]], cache->buf[i]);
+    }
+    cache_write(cache, &t, sizeof(double), 1);
+    cache_write(cache, box, sizeof(real), DIM*DIM);
+    cache_write(cache, cache->buf, sizeof(rvec), cache->header.ncached);
+    cache->header.nframes++;
+}
+
+/** Map a cache file in memory for reading
+ */
+TrajCache *cache_open(const char *fn) {
+    TrajCache *cache;
+    struct stat st;
+    int fd;
+    const char *data;
+
+    snew(cache, 1);
+    cache->fn = strdup(fn);
+    fd = open(fn, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        gmx_fatal(FARGS, "Error opening %s\n", fn);
+    }
+    cache->map_size = st.st_size;
+    if (cache->map_size < CACHE_MAGIC_SIZE + sizeof(CacheHeader)) {
+        gmx_fatal(FARGS, "%s is not a g_mydensity cache file\n", fn);
+    }
+    cache->map = mmap(NULL, cache->map_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (cache->map == MAP_FAILED) {
+        gmx_fatal(FARGS, "Could not map %s in memory\n", fn);
+    }
+    madvise(cache->map, cache->map_size, MADV_SEQUENTIAL);
+
+    data = (const char *)cache->map;
+    if (strncmp(data, CACHE_MAGIC, CACHE_MAGIC_SIZE) != 0) {
+        gmx_fatal(FARGS, "%s is not a g_mydensity cache file\n", fn);
+    }
+    memcpy(&cache->header, data + CACHE_MAGIC_SIZE, sizeof(CacheHeader));
+    if (cache->header.version != CACHE_VERSION) {
+        gmx_fatal(FARGS, "%s has version %d, expected %d\n", fn,
+                cache->header.version, CACHE_VERSION);
+    }
+    if (cache->header.real_size != sizeof(real)) {
+        gmx_fatal(FARGS, "%s was written with %s precision\n", fn,
+                cache->header.real_size == sizeof(float) ?
+                "single" : "double");
+    }
+    if (cache->map_size < cache_frames_offset(&cache->header)
+            + cache->header.nframes * cache_frame_size(&cache->header)) {
+        gmx_fatal(FARGS, "%s is truncated\n", fn);
+    }
+    snew(cache->atoms, cache->header.ncached);
+    memcpy(cache->atoms, data + CACHE_MAGIC_SIZE + sizeof(CacheHeader),
+            cache->header.ncached * sizeof(atom_id));
+    cache->frames = data + cache_frames_offset(&cache->header);
+    cache->frame = 0;
+    fprintf(stderr, "Reading %d frames of %d atoms out of %d from %s\n",
+            cache->header.nframes, cache->header.ncached,
+            cache->header.natoms, fn);
+    return cache;
+}
+
+/** Check that a cache holds the atoms an analysis needs
+ *
+ * "atoms" must be sorted. The cache must have been written for a system of
+ * "natoms" atoms, with the coordinates prepared as the analysis would: the
+ * same centering, axis and centering group, and the same -pbcsel.
+ */
+void cache_check_atoms(TrajCache *cache, int natoms, atom_id *atoms, int n,
+        gmx_bool bCenter, int axis, atom_id *cindex, int csize,
+        gmx_bool bSelPBC) {
+    CacheHeader expected;
+    int i, c = 0;
+
+    if (cache->header.natoms != natoms) {
+        gmx_fatal(FARGS, "%s was written for %d atoms, the topology has "
+                "%d\n", cache->fn, cache->header.natoms, natoms);
+    }
+    cache_set_preparation(&expected, bCenter, axis, cindex, csize, bSelPBC);
+    if (cache->header.bCenter != expected.bCenter) {
+        gmx_fatal(FARGS, "%s was written %s -center\n", cache->fn,
+                cache->header.bCenter ? "with" : "without");
+    }
+    if (cache->header.axis != expected.axis) {
+        gmx_fatal(FARGS, "%s was centered along %c, not %c\n", cache->fn,
+                'X' + cache->header.axis, 'X' + expected.axis);
+    }
+    if (cache->header.ncenter != expected.ncenter
+            || cache->header.center_hash != expected.center_hash) {
+        gmx_fatal(FARGS, "%s was centered on another group\n", cache->fn);
+    }
+    if (cache->header.bSelPBC != expected.bSelPBC) {
+        gmx_fatal(FARGS, "%s was written %s -pbcsel\n", cache->fn,
+                cache->header.bSelPBC ? "with" : "without");
+    }
+    for (i=0; i<n; ++i) {
+        while (c < cache->header.ncached && cache->atoms[c] < atoms[i]) {
+            c++;
+        }
+        if (c == cache->header.ncached || cache->atoms[c] != atoms[i]) {
+            gmx_fatal(FARGS, "Atom %d is not in %s; the cache has to be "
+                    "written again with the new groups\n", atoms[i] + 1,
+                    cache->fn);
+        }
+    }
+}
+
+/** Read the next frame of a cache
+ *
+ * The cached coordinates are scattered in "x", which holds all the atoms of
+ * the system; the other atoms are left untouched. Returns FALSE after the
+ * last frame.
+ */
+gmx_bool cache_read_frame(TrajCache *cache, double *t, matrix box, rvec *x) {
+    const char *frame;
+    const real *values;
+    int i;
+
+    if (cache->frame >= cache->header.nframes) {
+        return FALSE;
+    }
+    frame = cache->frames
+        + (size_t)cache->frame * cache_frame_size(&cache->header);
+    /* With single precision reals, the time of a frame may not be aligned
+     * on 8 bytes */
+    memcpy(t, frame, sizeof(double));
+    values = (const real *)(frame + sizeof(double));
+    memcpy(box, values, DIM*DIM * sizeof(real));
+    values += DIM*DIM;
+    for (i=0; i<cache->header.ncached; ++i) {
+        copy_rvec(values + DIM*i, x[cache->atoms[i]]);
+    }
+    cache->frame++;
+    return TRUE;
+}
+
+/** Number of bytes of frames read so far
+ */
+double cache_bytes_read(TrajCache *cache) {
+    return (double)cache->frame * cache_frame_size(&cache->header);
+}
+
+/** Close a cache
+ *
+ * A cache being written gets its final number of frames and its final name.
+ */
+void cache_close(TrajCache *cache) {
+    char *tmp_fn;
+
+    if (cache == NULL) {
+        return;
+    }
+    if (cache->fp) {
+        fseek(cache->fp, CACHE_MAGIC_SIZE, SEEK_SET);
+        cache_write(cache, &cache->header, sizeof(CacheHeader), 1);
+        ffclose(cache->fp);
+        snew(tmp_fn, strlen(cache->fn) + 5);
+        sprintf(tmp_fn, "%s.tmp", cache->fn);
+        if (rename(tmp_fn, cache->fn) != 0) {
+            gmx_fatal(FARGS, "Could not rename %s into %s\n", tmp_fn,
+                    cache->fn);
+        }
+        sfree(tmp_fn);
+        fprintf(stderr, "Wrote %d frames of %d atoms to %s\n",
+                cache->header.nframes, cache->header.ncached, cache->fn);
+    }
+    if (cache->map) {
+        munmap(cache->map, cache->map_size);
+    }
+    sfree(cache->atoms);
+    sfree(cache->buf);
+    sfree(cache->fn);
+    sfree(cache);
+}
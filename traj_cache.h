@@ -0,0 +1,70 @@
+#ifndef _traj_cache_h
+#define _traj_cache_h
+
+#include <stdio.h>
+
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/futil.h>
+#include <gromacs/vec.h>
+
+/** Compact trajectory of the atoms an analysis reads
+ *
+ * A cache file holds, for each frame, the time, the box and the coordinates
+ * of a subset of the atoms only, already made whole and centered. Later
+ * runs map the file in memory instead of decoding the trajectory again.
+ * The file is written in the native binary layout of the machine; a header
+ * records the size of a real, the number of atoms of the system and of the
+ * cache, the number of frames, and how the coordinates were prepared: the
+ * axis and the group they were centered on, and whether only the molecules
+ * of the used atoms were made whole. The sorted list of the cached atoms
+ * follows, then, aligned on 64 bytes, the frames, each one being the time as
+ * a double, the 9 values of the box, and the coordinates.
+ */
+typedef struct CacheHeader {
+    int version;
+    int real_size;
+    int natoms;         /* Number of atoms of the system */
+    int ncached;        /* Number of atoms stored for each frame */
+    int nframes;
+    int bCenter;        /* Were the coordinates centered? */
+    int axis;           /* Axis of the centering, -1 if not centered */
+    int ncenter;        /* Size of the centering group, 0 for the whole
+                           system or if not centered */
+    unsigned int center_hash;   /* Hash of the atoms of the centering group */
+    int bSelPBC;        /* Were only the molecules of the used atoms made
+                           whole? */
+} CacheHeader;
+
+typedef struct TrajCache {
+    CacheHeader header;
+    atom_id *atoms;     /* Cached atoms, sorted */
+    char *fn;
+    FILE *fp;           /* Open file when writing, NULL when reading */
+    rvec *buf;          /* Coordinates of the cached atoms of a frame */
+    void *map;          /* Mapping of the file when reading */
+    size_t map_size;
+    const char *frames; /* First frame in the mapping */
+    int frame;          /* Next frame to read */
+} TrajCache;
+
+TrajCache *cache_create(const char *fn, int natoms, atom_id *atoms,
+        int ncached, gmx_bool bCenter, int axis, atom_id *cindex, int csize,
+        gmx_bool bSelPBC);
+
+void cache_write_frame(TrajCache *cache, double t, matrix box, rvec *x);
+
+TrajCache *cache_open(const char *fn);
+
+void cache_check_atoms(TrajCache *cache, int natoms, atom_id *atoms, int n,
+        gmx_bool bCenter, int axis, atom_id *cindex, int csize,
+        gmx_bool bSelPBC);
+
+gmx_bool cache_read_frame(TrajCache *cache, double *t, matrix box, rvec *x);
+
+double cache_bytes_read(TrajCache *cache);
+
+void cache_close(TrajCache *cache);
+
+#endif /* _traj_cache_h */
@@ -0,0 +1,240 @@
+#include "verlet_list.h"
+
+/** Contruct an instance of VerletList
+ *
+ * Parameters :
+ *  - skin        : the distance kept around the nearest reference atom, in
+ *                  nm, greater than 0
+ *  - masked_axis : the axis to ignore in distance calculation, -1 for none
+ */
+VerletList *build_verlet_list(real skin, int masked_axis) {
+    VerletList *list;
+
+    if (skin <= 0) {
+        gmx_fatal(FARGS, "Invalid Verlet skin: %g\n", skin);
+    }
+    snew(list, 1);
+    list->skin = skin;
+    list->masked = masked_axis;
+    list->bBuilt = FALSE;
+    list->natoms = 0;
+    list->natoms_alloc = 0;
+    list->x_sel = NULL;
+    list->nref = 0;
+    list->nref_alloc = 0;
+    list->x_ref = NULL;
+    clear_mat(list->box);
+    list->start = NULL;
+    list->cand = NULL;
+    list->ncand_alloc = 0;
+    list->dist = NULL;
+    verlet_list_reset(list);
+    return list;
+}
+
+/** Clean an instance of VerletList
+ */
+void clean_verlet_list(VerletList *list) {
+    if (list) {
+        sfree(list->x_sel);
+        sfree(list->x_ref);
+        sfree(list->start);
+        sfree(list->cand);
+        sfree(list->dist);
+        sfree(list);
+    }
+}
+
+/** Largest displacement of a set of atoms since the list was built
+ *
+ * The atoms are x[index[i]], or x[i] when "index" is NULL, and x0[i] their
+ * positions at the build. The displacement along the masked axis is
+ * ignored. The scan stops as soon as an atom moved by more than "limit".
+ */
+static real max_displacement(VerletList *list, rvec *x, atom_id *index,
+        rvec *x0, int n, t_pbc *pbc, real limit) {
+    int i;
+    rvec dx;
+    real d2, max2 = 0, limit2 = limit*limit;
+
+    for (i=0; i<n && max2 <= limit2; ++i) {
+        pbc_rvec_sub(pbc, index ? x[index[i]] : x[i], x0[i], dx);
+        make_2D(dx, list->masked, dx);
+        d2 = norm2(dx);
+        if (d2 > max2) {
+            max2 = d2;
+        }
+    }
+    return sqrt(max2);
+}
+
+static int append_candidate(VerletList *list, int n, atom_id ref) {
+    if (n >= list->ncand_alloc) {
+        list->ncand_alloc = 2 * n + 16;
+        srenew(list->cand, list->ncand_alloc);
+    }
+    list->cand[n] = ref;
+    return n + 1;
+}
+
+/** Build the candidate lists from the current positions
+ */
+static void verlet_list_build(VerletList *list, rvec *xsel, int n,
+        atom_id *ref_index, int ref_size, rvec *x, CellList *cells,
+        t_pbc *pbc, matrix box, real max_dist) {
+    int i, k, ncand = 0;
+    rvec pointA, pointB;
+    real d0, cutoff = max_dist + list->skin;
+
+    if (n > list->natoms_alloc) {
+        list->natoms_alloc = n;
+        srenew(list->x_sel, list->natoms_alloc);
+        srenew(list->start, list->natoms_alloc + 1);
+    }
+    if (ref_size > list->nref_alloc) {
+        list->nref_alloc = ref_size;
+        srenew(list->x_ref, list->nref_alloc);
+        srenew(list->dist, list->nref_alloc);
+    }
+    list->natoms = n;
+    list->nref = ref_size;
+    for (i=0; i<n; ++i) {
+        copy_rvec(xsel[i], list->x_sel[i]);
+    }
+    for (k=0; k<ref_size; ++k) {
+        copy_rvec(x[ref_index[k]], list->x_ref[k]);
+    }
+    copy_mat(box, list->box);
+
+    cell_list_update(cells, pbc, box, ref_index, ref_size, x);
+    for (i=0; i<n; ++i) {
+        list->start[i] = ncand;
+        if (cells->bValid) {
+            d0 = cell_list_min_dist(cells, xsel[i], cutoff);
+            if (d0 <= cutoff) {
+                ncand = cell_list_within(cells, xsel[i], d0 + list->skin,
+                        ncand, &list->cand, &list->ncand_alloc);
+            }
+        }
+        else {
+            /* Same distances as min_dist */
+            make_2D(xsel[i], list->masked, pointA);
+            d0 = GMX_REAL_MAX;
+            for (k=0; k<ref_size; ++k) {
+                make_2D(x[ref_index[k]], list->masked, pointB);
+                list->dist[k] = get_distance(pointA, pointB, pbc);
+                if (list->dist[k] < d0) {
+                    d0 = list->dist[k];
+                }
+            }
+            for (k=0; k<ref_size && d0 <= cutoff; ++k) {
+                if (list->dist[k] <= d0 + list->skin) {
+                    ncand = append_candidate(list, ncand, k);
+                }
+            }
+        }
+    }
+    list->start[n] = ncand;
+    list->bBuilt = TRUE;
+    list->nrebuild++;
+    list->ncand_sum += ncand;
+    list->natoms_sum += n;
+}
+
+/** Check the displacements since the last build, and build the list again
+ * if they exceed half the skin
+ *
+ * Must be called at each frame, before verlet_list_min_dist. Returns TRUE
+ * if the list was built.
+ *
+ * Parameters :
+ *  - list      : the list to update
+ *  - xsel      : the coordinates of the analysed atoms, in the same order
+ *                at each frame
+ *  - n         : the number of analysed atoms
+ *  - ref_index : the reference group
+ *  - ref_size  : the size of the reference group
+ *  - x         : the coordinates of all the atoms, for the references
+ *  - cells     : a cell list, updated with the reference group when the
+ *                list is built
+ *  - pbc       : the periodic box, or NULL
+ *  - box       : the box of the frame
+ *  - max_dist  : the largest distance of interest for the frame
+ */
+gmx_bool verlet_list_update(VerletList *list, rvec *xsel, int n,
+        atom_id *ref_index, int ref_size, rvec *x, CellList *cells,
+        t_pbc *pbc, matrix box, real max_dist) {
+    int d;
+    rvec dbox;
+    real budget = list->skin / 2, moved = 0;
+
+    list->nupdate++;
+    if (list->bBuilt && list->natoms == n && list->nref == ref_size) {
+        /* A change of the box vectors moves the periodic images */
+        for (d=0; d<DIM; ++d) {
+            rvec_sub(box[d], list->box[d], dbox);
+            moved += norm(dbox);
+        }
+        if (moved <= budget) {
+            moved += max_displacement(list, x, ref_index, list->x_ref,
+                    ref_size, pbc, budget - moved);
+        }
+        if (moved <= budget) {
+            moved += max_displacement(list, xsel, NULL, list->x_sel, n, pbc,
+                    budget - moved);
+        }
+        if (moved <= budget) {
+            return FALSE;
+        }
+    }
+    verlet_list_build(list, xsel, n, ref_index, ref_size, x, cells, pbc,
+            box, max_dist);
+    return TRUE;
+}
+
+/** Get the minimum distance between an analysed atom and the reference
+ * group
+ *
+ * "i" is the position of the atom in the coordinates given to
+ * verlet_list_update, and "point" its current coordinates. The result is
+ * the same as min_dist, except for the atoms without candidates, that are
+ * farther than the maximum distance: GMX_REAL_MAX is returned for them.
+ */
+real verlet_list_min_dist(VerletList *list, int i, rvec point,
+        atom_id *ref_index, rvec *x, t_pbc *pbc) {
+    int c;
+    rvec pointA, pointB;
+    real dist, best = GMX_REAL_MAX;
+
+    make_2D(point, list->masked, pointA);
+    for (c=list->start[i]; c<list->start[i + 1]; ++c) {
+        make_2D(x[ref_index[list->cand[c]]], list->masked, pointB);
+        dist = get_distance(pointA, pointB, pbc);
+        if (dist < best) {
+            best = dist;
+        }
+    }
+    return best;
+}
+
+/** Add the build counts of "src" to "dst"
+ */
+void verlet_list_reduce(VerletList *dst, VerletList *src) {
+    if (dst && src) {
+        dst->nupdate += src->nupdate;
+        dst->nrebuild += src->nrebuild;
+        dst->ncand_sum += src->ncand_sum;
+        dst->natoms_sum += src->natoms_sum;
+    }
+}
+
+/** Set the build counts back to zero, the lists are kept
+ */
+void verlet_list_reset(VerletList *list) {
+    if (list) {
+        list->nupdate = 0;
+        list->nrebuild = 0;
+        list->ncand_sum = 0;
+        list->natoms_sum = 0;
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef _verlet_list_h
+#define _verlet_list_h
+
+#include <math.h>
+
+#include <gromacs/macros.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/pbc.h>
+#include <gromacs/vec.h>
+
+#include "distances.h"
+#include "cell_list.h"
+
+/** Candidate reference atoms of each analysed atom, kept across frames
+ *
+ * When the list is built, each analysed atom keeps the reference atoms that
+ * are at most "skin" farther than its nearest one. As long as the analysed
+ * atoms, the reference atoms and the box vectors have together moved by less
+ * than half the skin since then, the nearest reference atom is still among
+ * the candidates, and the minimum distance is the smallest distance to them.
+ * Past that, the list is built again from a cell list search.
+ *
+ * The displacements are taken with the periodic conditions, so an atom
+ * that jumps to the other side of the box does not count as moving. An atom
+ * farther than max_dist + skin from the reference group gets no candidate:
+ * it stays beyond max_dist until the next build.
+ *
+ * The analysed atoms are identified by their position in the coordinates
+ * given to verlet_list_update, which must be the same at each frame.
+ */
+typedef struct VerletList {
+    real skin;          /* Extra distance kept around the nearest atom */
+    int masked;         /* Axis to ignore, -1 to use the 3 dimensions */
+    gmx_bool bBuilt;    /* Is there a list to reuse? */
+    int natoms;         /* Number of analysed atoms in the list */
+    int natoms_alloc;
+    rvec *x_sel;        /* Analysed atoms when the list was built */
+    int nref;           /* Number of reference atoms in the list */
+    int nref_alloc;
+    rvec *x_ref;        /* Reference atoms when the list was built */
+    matrix box;         /* Box when the list was built */
+    int *start;         /* First candidate of each analysed atom, natoms+1 */
+    atom_id *cand;      /* Candidates, as positions in the reference index */
+    int ncand_alloc;
+    real *dist;         /* Distances to the reference atoms, for the
+                           brute force build */
+    int nupdate;        /* Number of frames seen */
+    int nrebuild;       /* Number of frames the list was built at */
+    double ncand_sum;   /* Candidates summed over the builds */
+    double natoms_sum;  /* Analysed atoms summed over the builds */
+} VerletList;
+
+VerletList *build_verlet_list(real skin, int masked_axis);
+
+void clean_verlet_list(VerletList *list);
+
+gmx_bool verlet_list_update(VerletList *list, rvec *xsel, int n,
+        atom_id *ref_index, int ref_size, rvec *x, CellList *cells,
+        t_pbc *pbc, matrix box, real max_dist);
+
+real verlet_list_min_dist(VerletList *list, int i, rvec point,
+        atom_id *ref_index, rvec *x, t_pbc *pbc);
+
+void verlet_list_reduce(VerletList *dst, VerletList *src);
+
+void verlet_list_reset(VerletList *list);
+
+#endif /* _verlet_list_h */
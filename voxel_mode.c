@@ -0,0 +1,290 @@
+#include "voxel_mode.h"
+
+/** Contruct an instance of VoxelGrid
+ *
+ * All the dimensions described in the "shape" array have to be greater than 0.
+ * The output is written as OpenDX files, one per group, if "format" is 'd',
+ * or as a NumPy .npz archive if it is 'n'. The group names are used in the
+ * headers of the output. "dens" lists the types of density, one per
+ * channel; each type has its own outputs, named by dens_output_fn.
+ */
+VoxelGrid *build_voxels(int shape[3], int ngroups, const char *voxel_fn,
+        const char *dens, char format, const char **names) {
+    VoxelGrid *voxel;
+    int d, c;
+
+    if (shape[0] <= 0 || shape[1] <= 0 || shape[2] <= 0) {
+        gmx_fatal(FARGS, "I can not build voxels with this dimensions: "
+                "(%d, %d, %d)\n", shape[0], shape[1], shape[2]);
+    }
+    if (strlen(dens) == 0 || strlen(dens) > BIN_MAX_CHANNELS) {
+        gmx_fatal(FARGS, "Invalid number of density types: %d\n",
+                (int)strlen(dens));
+    }
+
+    snew(voxel, 1);
+    voxel->nframes = 0;
+    voxel->ngroups = ngroups;
+    voxel->nchannels = strlen(dens);
+    voxel->invvol = 0;
+    for (c=0; c<voxel->nchannels; ++c) {
+        voxel->dens[c] = dens[c];
+    }
+    voxel->format = format;
+    voxel->names = names;
+    voxel->voxel_fn = voxel_fn ? strdup(voxel_fn) : NULL;
+    for (d=0; d<DIM; ++d) {
+        voxel->shape[d] = shape[d];
+    }
+    clear_mat(voxel->box_sum);
+    voxel->voxels = realBlock(voxel->nchannels * ngroups, shape[0] * shape[1],
+            shape[2], 0.0);
+    return voxel;
+}
+
+/** Contruct an empty instance of VoxelGrid with the same shape as "src"
+ *
+ * The copy has no output file; it is meant to be summed back into "src" with
+ * voxel_reduce. Returns NULL if "src" is NULL.
+ */
+VoxelGrid *copy_voxels(VoxelGrid *src) {
+    VoxelGrid *voxel;
+
+    if (src == NULL) {
+        return NULL;
+    }
+    snew(voxel, 1);
+    *voxel = *src;
+    voxel->nframes = 0;
+    clear_mat(voxel->box_sum);
+    voxel->voxel_fn = NULL;
+    voxel->voxels = realBlock(src->nchannels * src->ngroups,
+            src->shape[0] * src->shape[1], src->shape[2], 0.0);
+    return voxel;
+}
+
+/** Clean an instance of VoxelGrid
+ */
+void clean_voxels(VoxelGrid *voxel) {
+    if (voxel) {
+        deleteRealBlock(voxel->voxels);
+        sfree(voxel->voxel_fn);
+        sfree(voxel);
+    }
+}
+
+/** Add the voxels, the frame count and the box sum of "src" to "dst"
+ */
+void voxel_reduce(VoxelGrid *dst, VoxelGrid *src) {
+    size_t cell, ncells;
+    if (dst && src) {
+        ncells = voxel_size(dst);
+        for (cell = 0; cell < ncells; ++cell) {
+            dst->voxels[cell] += src->voxels[cell];
+        }
+        dst->nframes += src->nframes;
+        m_add(dst->box_sum, src->box_sum, dst->box_sum);
+    }
+}
+
+/** Set the voxels, the frame count and the box sum back to zero
+ */
+void reset_voxels(VoxelGrid *voxel) {
+    if (voxel) {
+        memset(voxel->voxels, 0, voxel_size(voxel) * sizeof(real));
+        voxel->nframes = 0;
+        clear_mat(voxel->box_sum);
+    }
+}
+
+void voxel_start_frame(VoxelGrid *voxel, matrix box) {
+    if (voxel) {
+        voxel->nframes += 1;
+        m_add(voxel->box_sum, box, voxel->box_sum);
+        voxel->invvol = ((real)voxel->shape[0] * voxel->shape[1]
+                * voxel->shape[2]) / (box[XX][XX] * box[YY][YY] * box[ZZ][ZZ]);
+        copy_mat(box, voxel->box);
+        m_inv_ur0(box, voxel->invbox);
+        voxel->bRect = (box[YY][XX] == 0 && box[ZZ][XX] == 0
+                && box[ZZ][YY] == 0);
+    }
+}
+
+/** Add the atoms of the frame to the voxels of their groups, for each
+ * channel
+ *
+ * The bins along each box vector are folded in turn into the flat voxel
+ * index, which is used by all the channels and groups. In a rectangular
+ * box, they are the ones of the geometry of the frame, shared with the
+ * other modes.
+ *
+ * Parameters :
+ *  - voxel : the voxel mode, nothing is done if it is NULL
+ *  - buf   : scratch buffers, with the geometry and the weights of the
+ *            atoms
+ */
+void voxel_store(VoxelGrid *voxel, BinBuffer *buf) {
+    int i, d, e, c, g, n = buf->n;
+    const int *bin;
+    if (voxel) {
+        for (d=0; d<DIM; ++d) {
+            if (voxel->bRect) {
+                bin = bin_geometry_bins(buf, d, voxel->shape[d]);
+            }
+            else {
+                /* Fractional coordinate along the d-th box vector; the
+                 * inverse of the box is lower triangular */
+                for (i=0; i<n; ++i) {
+                    buf->coord[i] = 0;
+                    for (e=d; e<DIM; ++e) {
+                        buf->coord[i] += buf->x[i][e] * voxel->invbox[e][d];
+                    }
+                }
+                periodic_bins(buf->coord, n, 1, voxel->shape[d], buf->bin2);
+                bin = buf->bin2;
+            }
+            for (i=0; i<n; ++i) {
+                buf->bin[i] = (d == 0 ? 0 : buf->bin[i] * voxel->shape[d])
+                    + bin[i];
+            }
+        }
+        for (c=0; c<voxel->nchannels; ++c) {
+            for (g=0; g<voxel->ngroups; ++g) {
+                buf->hist[g] = voxel->voxels + voxel_index(voxel,
+                        c * voxel->ngroups + g, 0, 0, 0);
+            }
+            histogram_add_groups(buf->hist, buf->bin, bin_weights(buf, c),
+                    buf, voxel->invvol);
+        }
+    }
+}
+
+/** Name of the OpenDX file of a group: the group number is added before the
+ * extension when there are several groups
+ */
+static char *voxel_group_fn(const char *voxel_fn, int group, int ngroups) {
+    char suffix[16];
+
+    sprintf(suffix, "%d", group + 1);
+    return output_fn(voxel_fn, ngroups == 1 ? NULL : suffix);
+}
+
+/** Write the averaged voxels of a channel as OpenDX files, one per group
+ *
+ * The grid starts at the origin of the box and its steps are the mean box
+ * vectors divided by the number of voxels along them. Following the usage of
+ * the visualisation programs, the positions are in Angstroms; the densities
+ * keep the unit of the other outputs.
+ */
+static void write_voxel_dx(VoxelGrid *voxel, int channel, matrix box) {
+    FILE *out;
+    char *dens_fn, *fn;
+    char dens = voxel->dens[channel];
+    int group, d, e;
+    size_t cell, nvoxels;
+    real *values;
+
+    nvoxels = voxel_index(voxel, 1, 0, 0, 0);
+    dens_fn = dens_output_fn(voxel->voxel_fn, dens, voxel->nchannels);
+    for (group = 0; group < voxel->ngroups; ++group) {
+        fn = voxel_group_fn(dens_fn, group, voxel->ngroups);
+        out = ffopen(fn, "w");
+        if (out == NULL) {
+            gmx_fatal(FARGS, "Error opening %s for voxel mode\n", fn);
+        }
+        fprintf(out, "# Partial %s density of %s (%s), over %d frames\n",
+                dens_name(dens), voxel->names[group],
+                dens_unit(dens), voxel->nframes);
+        fprintf(out, "object 1 class gridpositions counts %d %d %d\n",
+                voxel->shape[0], voxel->shape[1], voxel->shape[2]);
+        fprintf(out, "origin 0 0 0\n");
+        for (d=0; d<DIM; ++d) {
+            fprintf(out, "delta");
+            for (e=0; e<DIM; ++e) {
+                fprintf(out, " %g", 10 * box[d][e] / voxel->shape[d]);
+            }
+            fprintf(out, "\n");
+        }
+        fprintf(out, "object 2 class gridconnections counts %d %d %d\n",
+                voxel->shape[0], voxel->shape[1], voxel->shape[2]);
+        fprintf(out, "object 3 class array type double rank 0 items %lu "
+                "data follows\n", (unsigned long)nvoxels);
+        values = voxel->voxels + voxel_index(voxel,
+                channel * voxel->ngroups + group, 0, 0, 0);
+        for (cell = 0; cell < nvoxels; ++cell) {
+            fprintf(out, "%g%s", values[cell],
+                    (cell % 3 == 2 || cell + 1 == nvoxels) ? "\n" : " ");
+        }
+        fprintf(out, "attribute \"dep\" string \"positions\"\n");
+        fprintf(out, "object \"density\" class field\n");
+        fprintf(out, "component \"positions\" value 1\n");
+        fprintf(out, "component \"connections\" value 2\n");
+        fprintf(out, "component \"data\" value 3\n");
+        ffclose(out);
+        sfree(fn);
+    }
+    sfree(dens_fn);
+}
+
+/** Write the averaged voxels of a channel as a NumPy .npz archive
+ *
+ * The archive holds:
+ *  - density : the voxels, shaped (groups, X, Y, Z)
+ *  - box     : the mean box, one vector per row (nm)
+ *  - unit    : the unit of the densities
+ *  - type    : the type of density
+ *  - groups  : the name of each group
+ */
+static void write_voxel_npz(VoxelGrid *voxel, int channel, matrix box) {
+    const char *unit[1];
+    const char *type[1];
+    char *fn;
+    int shape[4];
+    NpzFile *npz;
+
+    fn = dens_output_fn(voxel->voxel_fn, voxel->dens[channel],
+            voxel->nchannels);
+    npz = npz_open(fn);
+    sfree(fn);
+    shape[0] = voxel->ngroups;
+    shape[1] = voxel->shape[0];
+    shape[2] = voxel->shape[1];
+    shape[3] = voxel->shape[2];
+    npz_add_reals(npz, "density", 4, shape, voxel->voxels
+            + voxel_index(voxel, channel * voxel->ngroups, 0, 0, 0));
+    shape[0] = DIM;
+    shape[1] = DIM;
+    npz_add_reals(npz, "box", 2, shape, box[0]);
+    unit[0] = dens_unit(voxel->dens[channel]);
+    npz_add_strings(npz, "unit", 1, unit);
+    type[0] = dens_name(voxel->dens[channel]);
+    npz_add_strings(npz, "type", 1, type);
+    npz_add_strings(npz, "groups", voxel->ngroups, voxel->names);
+    npz_close(npz);
+}
+
+void voxel_end(VoxelGrid *voxel) {
+    size_t cell, ncells;
+    real factor;
+    matrix box;
+    int c;
+    if (voxel) {
+        msmul(voxel->box_sum, 1.0/voxel->nframes, box);
+        ncells = voxel_index(voxel, voxel->ngroups, 0, 0, 0);
+        for (c=0; c<voxel->nchannels; ++c) {
+            factor = 1.0/voxel->nframes;
+            if (voxel->dens[c] == 'm') {
+                factor *= AMU/(NANO*NANO*NANO);
+            }
+            for (cell = 0; cell < ncells; ++cell) {
+                voxel->voxels[c * ncells + cell] *= factor;
+            }
+            if (voxel->format == 'n') {
+                write_voxel_npz(voxel, c, box);
+            }
+            else {
+                write_voxel_dx(voxel, c, box);
+            }
+        }
+    }
+}
@@ -0,0 +1,81 @@
+#ifndef _voxel_mode_h
+#define _voxel_mode_h
+
+#include <math.h>
+#include <string.h>
+
+#include <gromacs/macros.h>
+#include <gromacs/smalloc.h>
+#include <gromacs/typedefs.h>
+#include <gromacs/gmx_fatal.h>
+#include <gromacs/pbc.h>
+#include <gromacs/vec.h>
+#include <gromacs/physics.h>
+#include <gromacs/futil.h>
+
+#include "matrix.h"
+#include "binning.h"
+#include "npy_io.h"
+#include "grid_mode.h"
+
+/** Store the 3D density of each group on a voxel grid
+ *
+ * The voxels follow the box vectors: the box is divided in shape[d] slices
+ * along each of its vectors, so each voxel holds the same fraction of the
+ * box whatever its shape. The atoms are binned on their fractional
+ * coordinates, which makes triclinic boxes work like rectangular ones.
+ *
+ * There is one grid per group and per channel, that is per type of density;
+ * the grid of channel c of group n is grid c * ngroups + n. All the grids
+ * are stored in one contiguous block indexed as [grid][i][j][k], with i along
+ * X and k along Z; use voxel_index to get the offset of a voxel.
+ */
+typedef struct VoxelGrid {
+    real *voxels;
+    int  shape[3];
+    int nframes;
+    int ngroups;
+    int nchannels;
+    matrix box_sum;     /* Sum of the boxes, for the mean voxel shape */
+    real invvol;
+    char dens[BIN_MAX_CHANNELS]; /* Type of density of each channel */
+    char format;        /* Output format: 'd' for OpenDX, 'n' for npz */
+    char *voxel_fn;     /* Output file name */
+    const char **names; /* Name of each group */
+    matrix box;         /* Box of the current frame */
+    matrix invbox;      /* Its inverse, to get fractional coordinates */
+    gmx_bool bRect;     /* Is the box of the current frame rectangular? */
+} VoxelGrid;
+
+/** Offset of voxel (i, j, k) of a grid in VoxelGrid.voxels
+ */
+static inline size_t voxel_index(const VoxelGrid *voxel, int grid, int i,
+        int j, int k) {
+    return (((size_t)grid * voxel->shape[0] + i) * voxel->shape[1] + j)
+        * voxel->shape[2] + k;
+}
+
+/** Number of voxels of all the grids
+ */
+static inline size_t voxel_size(const VoxelGrid *voxel) {
+    return voxel_index(voxel, voxel->nchannels * voxel->ngroups, 0, 0, 0);
+}
+
+VoxelGrid *build_voxels(int shape[3], int ngroups, const char *voxel_fn,
+        const char *dens, char format, const char **names);
+
+VoxelGrid *copy_voxels(VoxelGrid *src);
+
+void clean_voxels(VoxelGrid *voxel);
+
+void voxel_reduce(VoxelGrid *dst, VoxelGrid *src);
+
+void reset_voxels(VoxelGrid *voxel);
+
+void voxel_start_frame(VoxelGrid *voxel, matrix box);
+
+void voxel_store(VoxelGrid *voxel, BinBuffer *buf);
+
+void voxel_end(VoxelGrid *voxel);
+
+#endif /* _voxel_mode_h */